@@ -2,6 +2,7 @@
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <algorithm>
 #include "cuda.h"
 
 static void checkCudaErrors(CUresult err)
@@ -9,14 +10,14 @@ static void checkCudaErrors(CUresult err)
     assert(err == CUDA_SUCCESS);
 }
 
-/// main - Program entry point
-void execute_cuda_kernel(const KernelInfo& kernel_info)
+static bool load_cuda_function(
+    const std::string& kernel_path,
+    const std::string& kernel_name,
+    CUcontext& context,
+    CUmodule& cudaModule,
+    CUfunction& function)
 {
     CUdevice device;
-    CUmodule cudaModule;
-    CUcontext context;
-    CUfunction function;
-    CUlinkState linker;
     int devCount;
 
     // CUDA initialization
@@ -28,12 +29,11 @@ void execute_cuda_kernel(const KernelInfo& kernel_info)
     checkCudaErrors(cuDeviceGetName(name, 128, device));
     std::cout << "Using CUDA Device [0]: " << name << "\n";
 
-    auto kernel_path = kernel_info.kernel_file_path;
     std::ifstream t(kernel_path);
     if (!t.is_open())
     {
         std::cerr << kernel_path << " not found\n";
-        return;
+        return false;
     }
     std::string str((std::istreambuf_iterator<char>(t)),
                     std::istreambuf_iterator<char>());
@@ -45,7 +45,21 @@ void execute_cuda_kernel(const KernelInfo& kernel_info)
     checkCudaErrors(cuModuleLoadDataEx(&cudaModule, str.c_str(), 0, 0, 0));
 
     // Get kernel function
-    checkCudaErrors(cuModuleGetFunction(&function, cudaModule, kernel_info.kernel_name.c_str()));
+    checkCudaErrors(cuModuleGetFunction(&function, cudaModule, kernel_name.c_str()));
+    return true;
+}
+
+/// main - Program entry point
+void execute_cuda_kernel(const KernelInfo& kernel_info)
+{
+    CUmodule cudaModule;
+    CUcontext context;
+    CUfunction function;
+
+    if (!load_cuda_function(kernel_info.kernel_file_path, kernel_info.kernel_name, context, cudaModule, function))
+    {
+        return;
+    }
     
     // create argument params for the kernel
     std::vector<CUdeviceptr> device_ptrs;  // the variables should live until the end
@@ -99,7 +113,7 @@ void execute_cuda_kernel(const KernelInfo& kernel_info)
         {
             auto tvar = std::static_pointer_cast<Tensor>(var);
             size_t data_size = tvar->calculate_required_memory();
-            if (!tvar->is_input)
+            if (tvar->is_output)
             {
                 checkCudaErrors(cuMemcpyDtoH(tvar->tensor_data.data(), *reinterpret_cast<CUdeviceptr*>(kernel_params[kidx]), data_size));
             }
@@ -116,3 +130,140 @@ void execute_cuda_kernel(const KernelInfo& kernel_info)
     checkCudaErrors(cuModuleUnload(cudaModule));
     checkCudaErrors(cuCtxDestroy(context));
 }
+
+void execute_multi_tensor_kernel(const MultiTensorInfo& multi_info)
+{
+    size_t num_tensors = multi_info.tensor_groups.empty() ? 0 : multi_info.tensor_groups[0].size();
+    for (auto& group : multi_info.tensor_groups)
+    {
+        if (group.size() != num_tensors)
+        {
+            std::cerr << "Each tensor group needs the same number of tensors \n";
+            return;
+        }
+
+        for (auto& var : group)
+        {
+            if (var->vtype != VariableType::TENSOR)
+            {
+                std::cerr << "The tensor groups have only tensors, the scalars are given separately \n";
+                return;
+            }
+
+            auto tvar = std::static_pointer_cast<Tensor>(var);
+            if (tvar->get_num_elements() != std::static_pointer_cast<Tensor>(group[0])->get_num_elements())
+            {
+                std::cerr << "The tensors of a group need the same number of elements \n";
+                return;
+            }
+        }
+    }
+
+    for (auto& var : multi_info.scalars)
+    {
+        if (var->vtype != VariableType::SCALAR)
+        {
+            std::cerr << "The scalar arguments of the multi-tensor kernel have only scalars \n";
+            return;
+        }
+    }
+
+    CUmodule cudaModule;
+    CUcontext context;
+    CUfunction function;
+
+    if (!load_cuda_function(multi_info.kernel_file_path, multi_info.kernel_name, context, cudaModule, function))
+    {
+        return;
+    }
+
+    // a chunk: 8 byte pointer of each tensor argument, then the i32 length (padded to 8 bytes)
+    size_t chunk_bytes = num_tensors * sizeof(CUdeviceptr) + sizeof(CUdeviceptr);
+
+    std::vector<CUdeviceptr> device_ptrs;  // the variables should live until the end
+    std::vector<char> chunk_table;
+    for (auto& group : multi_info.tensor_groups)
+    {
+        std::vector<CUdeviceptr> group_ptrs;
+        int num_elements = std::static_pointer_cast<Tensor>(group[0])->get_num_elements();
+        for (auto& var : group)
+        {
+            auto tvar = std::static_pointer_cast<Tensor>(var);
+            size_t data_size = tvar->calculate_required_memory();
+
+            CUdeviceptr devBufferVar;
+            checkCudaErrors(cuMemAlloc(&devBufferVar, data_size));
+            if (tvar->is_input)
+            {
+                checkCudaErrors(cuMemcpyHtoD(devBufferVar, tvar->tensor_data.data(), data_size));
+            }
+
+            device_ptrs.push_back(devBufferVar);
+            group_ptrs.push_back(devBufferVar);
+        }
+
+        // the group is cut into chunks of at most chunk_size elements
+        for (int first = 0; first < num_elements; first += multi_info.chunk_size)
+        {
+            std::vector<char> chunk(chunk_bytes, 0);
+            for (size_t ix = 0; ix < num_tensors; ++ix)
+            {
+                auto tvar = std::static_pointer_cast<Tensor>(group[ix]);
+                CUdeviceptr chunk_ptr = group_ptrs[ix] + static_cast<CUdeviceptr>(first) * tvar->get_element_size();
+                memcpy(chunk.data() + ix * sizeof(CUdeviceptr), &chunk_ptr, sizeof(CUdeviceptr));
+            }
+
+            int length = std::min(multi_info.chunk_size, num_elements - first);
+            memcpy(chunk.data() + num_tensors * sizeof(CUdeviceptr), &length, sizeof(int));
+
+            chunk_table.insert(chunk_table.end(), chunk.begin(), chunk.end());
+        }
+    }
+
+    unsigned num_chunks = static_cast<unsigned>(chunk_table.size() / chunk_bytes);
+    if (num_chunks > 0)
+    {
+        CUdeviceptr devChunkTable;
+        checkCudaErrors(cuMemAlloc(&devChunkTable, chunk_table.size()));
+        checkCudaErrors(cuMemcpyHtoD(devChunkTable, chunk_table.data(), chunk_table.size()));
+        device_ptrs.push_back(devChunkTable);
+
+        // the scalars follow the chunk table
+        std::vector<char*> kernel_params = {reinterpret_cast<char*>(&devChunkTable)};
+        for (auto& var : multi_info.scalars)
+        {
+            auto svar = std::static_pointer_cast<Scalar>(var);
+            kernel_params.push_back(reinterpret_cast<char*>(&svar->value_f32));
+        }
+
+        std::cout << "Launching multi-tensor kernel (" << num_chunks << " chunks)\n";
+
+        // one block per chunk
+        checkCudaErrors(cuLaunchKernel(function, num_chunks, 1, 1,
+                                       multi_info.chunk_size, 1, 1,
+                                       0, NULL, (void**)kernel_params.data(), NULL));
+    }
+
+    // Retrieve device data
+    int kidx = 0;
+    for (auto& group : multi_info.tensor_groups)
+    {
+        for (auto& var : group)
+        {
+            auto tvar = std::static_pointer_cast<Tensor>(var);
+            if (tvar->is_output)
+            {
+                checkCudaErrors(cuMemcpyDtoH(tvar->tensor_data.data(), device_ptrs[kidx], tvar->calculate_required_memory()));
+            }
+            kidx++;
+        }
+    }
+
+    // Clean-up
+    for (auto& dev_ptr : device_ptrs)
+    {
+        checkCudaErrors(cuMemFree(dev_ptr));
+    }
+    checkCudaErrors(cuModuleUnload(cudaModule));
+    checkCudaErrors(cuCtxDestroy(context));
+}
@@ -14,7 +14,10 @@ enum class VariableType
 
 enum class DataType
 {
-    FLOAT32
+    FLOAT32,
+    COMPLEX64,  // interleaved (real, imag)
+    FLOAT32X2,
+    FLOAT32X4
 };
 
 struct Variable 
@@ -40,12 +43,13 @@ struct Scalar : public Variable
 struct Tensor : public Variable
 {
     bool is_input;
+    bool is_output;  // read back after the launch, an input written by the kernel (in place) is both
     std::vector<int> shape;
     std::vector<char> tensor_data;  // has to be empty for output
 
     explicit Tensor(
-        const DataType dtype, const std::vector<int>& shape, const bool is_input=true
-        ) : shape(shape), is_input(is_input)
+        const DataType dtype, const std::vector<int>& shape, const bool is_input=true, const bool is_output=false
+        ) : shape(shape), is_input(is_input), is_output(is_output || !is_input)
     {
         vtype = VariableType::TENSOR;
         this->dtype = dtype;
@@ -64,16 +68,28 @@ struct Tensor : public Variable
         return length;
     }
 
+    int get_element_size() const
+    {
+        if (dtype == DataType::COMPLEX64 || dtype == DataType::FLOAT32X2)
+        {
+            return 8;
+        }
+        else if (dtype == DataType::FLOAT32X4)
+        {
+            return 16;
+        }
+        return 4;
+    }
+
     int calculate_required_memory() const
     {
-        int data_type_size = (dtype == DataType::FLOAT32 ? 4 : 2);
         int length = get_num_elements();
-        return length * data_type_size;
+        return length * get_element_size();
     }
 
     void print() const
     {
-        int length = get_num_elements();
+        int length = calculate_required_memory() / 4;  // f32 lanes
 
         std::cout << "[";
         for (int ix = 0; ix < length; ++ix)
@@ -94,4 +110,17 @@ struct KernelInfo
     std::vector<VariablePtr> arguments;
 };
 
+// multi-tensor apply: one launch of the <name>_multi kernel (tglc --multi-tensor name)
+struct MultiTensorInfo
+{
+    int chunk_size;  // threads of a block, elements of a chunk
+    std::string kernel_name;
+    std::string kernel_file_path;
+    std::vector<std::vector<VariablePtr>> tensor_groups;  // tensor arguments of one kernel call each, equal lengths in a group
+    std::vector<VariablePtr> scalars;  // scalar arguments of the kernel in their order, the same for every call
+};
+
 void execute_cuda_kernel(const KernelInfo& kernel_info);
+
+// builds the chunk table of the tensor groups, then launches one block per chunk
+void execute_multi_tensor_kernel(const MultiTensorInfo& multi_info);
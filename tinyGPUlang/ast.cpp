@@ -1,8 +1,81 @@
 #include "ast.hpp"
 
-ASTNode::ASTNode()
+void* ASTArena::allocate(const size_t size, const size_t alignment)
 {
-    ast_id = GlobalUUIDGenerator::generate_uuid();
+    // a large node gets its own block, the current block stays open
+    if (size > max_block_size / 4)
+    {
+        large_blocks.push_back(std::unique_ptr<std::byte[]>(new std::byte[size]));
+        return large_blocks.back().get();
+    }
+
+    size_t offset = (block_offset + alignment - 1) / alignment * alignment;
+    if (offset + size > block_capacity)
+    {
+        // each block doubles the previous one, up to the max. size
+        block_capacity = std::max(std::min(2 * block_capacity, max_block_size), min_block_size);
+        while (block_capacity < size)
+        {
+            block_capacity *= 2;
+        }
+
+        blocks.push_back(std::unique_ptr<std::byte[]>(new std::byte[block_capacity]));  // not zeroed
+        offset = 0;
+    }
+
+    block_offset = offset + size;
+    return blocks.back().get() + offset;
+}
+
+
+thread_local ASTContext* ASTContext::current = nullptr;
+
+ASTContext::ASTContext(const bool keep_nodes) : arena(std::make_shared<ASTArena>()), keep_nodes(keep_nodes)
+{
+}
+
+int ASTContext::generate_id()
+{
+    return next_id++;
+}
+
+int ASTContext::get_num_ids() const
+{
+    return next_id;
+}
+
+int ASTContext::reserve_ids(const int num_ids)
+{
+    int first_id = next_id;
+    next_id += num_ids;
+    return first_id;
+}
+
+const std::vector<std::shared_ptr<ASTNode>>& ASTContext::get_kept_nodes() const
+{
+    return kept_nodes;
+}
+
+ASTContext& ASTContext::get_current()
+{
+    static thread_local ASTContext default_context;
+    return current ? *current : default_context;
+}
+
+ASTContextScope::ASTContextScope(ASTContext& context) : previous(ASTContext::current)
+{
+    ASTContext::current = &context;
+}
+
+ASTContextScope::~ASTContextScope()
+{
+    ASTContext::current = previous;
+}
+
+
+ASTNode::ASTNode(const NodeKind kind) : kind(kind)
+{
+    ast_id = ASTContext::get_current().generate_id();
 }
 
 
@@ -26,6 +99,18 @@ std::ostream& operator<<(std::ostream& os, const DataType dtype)
     {
         os << "FLOAT32";
     }
+    else if (dtype == DataType::COMPLEX64)
+    {
+        os << "COMPLEX64";
+    }
+    else if (dtype == DataType::FLOAT32X2)
+    {
+        os << "FLOAT32X2";
+    }
+    else if (dtype == DataType::FLOAT32X4)
+    {
+        os << "FLOAT32X4";
+    }
     else
     {
         std::cout << "Unknown data type \n";
@@ -36,9 +121,24 @@ std::ostream& operator<<(std::ostream& os, const DataType dtype)
 }
 
 
+int get_num_lanes(const DataType dtype)
+{
+    if (dtype == DataType::COMPLEX64 || dtype == DataType::FLOAT32X2)
+    {
+        return 2;
+    }
+    else if (dtype == DataType::FLOAT32X4)
+    {
+        return 4;
+    }
+
+    return 1;
+}
+
+
 ConstantNode::ConstantNode(
     const float value, const DataType dtype
-    ) : dtype(dtype)
+    ) : ASTNode(NodeKind::CONSTANT), dtype(dtype)
 {
     if (dtype == DataType::FLOAT32)
     {
@@ -55,20 +155,20 @@ ConstantNodePtr create_constant_node(
     const float value,
     const DataType dtype)
 {
-    return std::make_shared<ConstantNode>(value, dtype);
+    return ASTContext::get_current().create<ConstantNode>(value, dtype);
 }
 
 
 VariableNode::VariableNode(
-    const VariableType vtype, const DataType dtype, const std::string& name
-    ) : ASTNode(), vtype(vtype), dtype(dtype), name(name)
+    const NodeKind kind, const VariableType vtype, const DataType dtype, const std::string& name
+    ) : ASTNode(kind), vtype(vtype), dtype(dtype), name(name)
 {
 }
 
 
 ScalarNode::ScalarNode(
     const DataType dtype, const std::string& name
-    ) : VariableNode(VariableType::SCALAR, dtype, name)
+    ) : VariableNode(NodeKind::SCALAR, VariableType::SCALAR, dtype, name)
 {
 }
 
@@ -81,14 +181,14 @@ ScalarNodePtr create_scalar_node(
     const DataType dtype,
     const std::string& name)
 {
-    return std::make_shared<ScalarNode>(dtype, name);   
+    return ASTContext::get_current().create<ScalarNode>(dtype, name);   
 }
 
 
 TensorNode::TensorNode(
     const DataType dtype,
     const std::string& name
-    ) : VariableNode(VariableType::TENSOR, dtype, name)
+    ) : VariableNode(NodeKind::TENSOR, VariableType::TENSOR, dtype, name)
 {
 }
 
@@ -101,7 +201,7 @@ TensorNodePtr create_tensor_node(
     const DataType dtype,
     const std::string& name)
 {
-    return std::make_shared<TensorNode>(dtype, name);   
+    return ASTContext::get_current().create<TensorNode>(dtype, name);   
 }
 
 
@@ -124,10 +224,10 @@ KernelNode::KernelNode(
     const std::string& name,
     const KernelScope scope, 
     const std::vector<VariableNodePtr>& arguments,
-    const VariableNodePtr return_value
-    ) : ASTNode(), name(name), scope(scope), 
+    const std::vector<VariableNodePtr>& return_values
+    ) : ASTNode(NodeKind::KERNEL), name(name), scope(scope), 
         arguments(arguments),
-        return_value(return_value)
+        return_values(return_values)
 {
 }
 
@@ -140,16 +240,16 @@ KernelNodePtr create_kernel_node(
     const std::string& name,
     const KernelScope scope, 
     const std::vector<VariableNodePtr>& arguments,
-    const VariableNodePtr return_value)
+    const std::vector<VariableNodePtr>& return_values)
 {
-    return std::make_shared<KernelNode>(name, scope, arguments, return_value);
+    return ASTContext::get_current().create<KernelNode>(name, scope, arguments, return_values);
 }
 
 
 KernelCallNode::KernelCallNode(
     const KernelNodePtr kernel,
     const std::vector<ASTNodePtr>& arguments
-    ) : ASTNode(), kernel(kernel), 
+    ) : ASTNode(NodeKind::KERNEL_CALL), kernel(kernel), 
         arguments(arguments)
 {
 }
@@ -163,16 +263,16 @@ KernelCallNodePtr create_kernelcall_node(
     const KernelNodePtr kernel, 
     const std::vector<ASTNodePtr>& arguments)
 {
-    return std::make_shared<KernelCallNode>(kernel, arguments);
+    return ASTContext::get_current().create<KernelCallNode>(kernel, arguments);
 }
 
 
-BinaryNode::BinaryNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : ASTNode(), lhs(lhs), rhs(rhs)
+BinaryNode::BinaryNode(const NodeKind kind, const ASTNodePtr lhs, const ASTNodePtr rhs) : ASTNode(kind), lhs(lhs), rhs(rhs)
 {
 }
 
 
-AddNode::AddNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : BinaryNode(lhs, rhs)
+AddNode::AddNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : BinaryNode(NodeKind::ADD, lhs, rhs)
 {
 }
 
@@ -183,11 +283,11 @@ void AddNode::accept(ASTVisitor& visitor)
 
 AddNodePtr create_add_node(const ASTNodePtr lhs, const ASTNodePtr rhs)
 {
-    return std::make_shared<AddNode>(lhs, rhs);
+    return ASTContext::get_current().create<AddNode>(lhs, rhs);
 }
 
 
-SubNode::SubNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : BinaryNode(lhs, rhs)
+SubNode::SubNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : BinaryNode(NodeKind::SUB, lhs, rhs)
 {
 }
 
@@ -198,11 +298,11 @@ void SubNode::accept(ASTVisitor& visitor)
 
 SubNodePtr create_sub_node(const ASTNodePtr lhs, const ASTNodePtr rhs)
 {
-    return std::make_shared<SubNode>(lhs, rhs);
+    return ASTContext::get_current().create<SubNode>(lhs, rhs);
 }
 
 
-MulNode::MulNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : BinaryNode(lhs, rhs)
+MulNode::MulNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : BinaryNode(NodeKind::MUL, lhs, rhs)
 {
 }
 
@@ -213,11 +313,11 @@ void MulNode::accept(ASTVisitor& visitor)
 
 MulNodePtr create_mul_node(const ASTNodePtr lhs, const ASTNodePtr rhs)
 {
-    return std::make_shared<MulNode>(lhs, rhs);
+    return ASTContext::get_current().create<MulNode>(lhs, rhs);
 }
 
 
-DivNode::DivNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : BinaryNode(lhs, rhs)
+DivNode::DivNode(const ASTNodePtr lhs, const ASTNodePtr rhs) : BinaryNode(NodeKind::DIV, lhs, rhs)
 {
 }
 
@@ -228,16 +328,16 @@ void DivNode::accept(ASTVisitor& visitor)
 
 DivNodePtr create_div_node(const ASTNodePtr lhs, const ASTNodePtr rhs)
 {
-    return std::make_shared<DivNode>(lhs, rhs);
+    return ASTContext::get_current().create<DivNode>(lhs, rhs);
 }
 
 
-UnaryNode::UnaryNode(const ASTNodePtr x) : ASTNode(), x(x)
+UnaryNode::UnaryNode(const NodeKind kind, const ASTNodePtr x) : ASTNode(kind), x(x)
 {
 }
 
 
-AbsNode::AbsNode(const ASTNodePtr x) : UnaryNode(x)
+AbsNode::AbsNode(const ASTNodePtr x) : UnaryNode(NodeKind::ABS, x)
 {
 }
 
@@ -248,11 +348,11 @@ void AbsNode::accept(ASTVisitor& visitor)
 
 AbsNodePtr create_abs_node(const ASTNodePtr x)
 {
-    return std::make_shared<AbsNode>(x);
+    return ASTContext::get_current().create<AbsNode>(x);
 }
 
 
-SqrtNode::SqrtNode(const ASTNodePtr x) : UnaryNode(x)
+SqrtNode::SqrtNode(const ASTNodePtr x) : UnaryNode(NodeKind::SQRT, x)
 {
 }
 
@@ -263,11 +363,11 @@ void SqrtNode::accept(ASTVisitor& visitor)
 
 SqrtNodePtr create_sqrt_node(const ASTNodePtr x)
 {
-    return std::make_shared<SqrtNode>(x);
+    return ASTContext::get_current().create<SqrtNode>(x);
 }
 
 
-Log2Node::Log2Node(const ASTNodePtr x) : UnaryNode(x)
+Log2Node::Log2Node(const ASTNodePtr x) : UnaryNode(NodeKind::LOG2, x)
 {
 }
 
@@ -278,11 +378,11 @@ void Log2Node::accept(ASTVisitor& visitor)
 
 Log2NodePtr create_log2_node(const ASTNodePtr x)
 {
-    return std::make_shared<Log2Node>(x);
+    return ASTContext::get_current().create<Log2Node>(x);
 }
 
 
-Exp2Node::Exp2Node(const ASTNodePtr x) : UnaryNode(x)
+Exp2Node::Exp2Node(const ASTNodePtr x) : UnaryNode(NodeKind::EXP2, x)
 {
 }
 
@@ -293,11 +393,11 @@ void Exp2Node::accept(ASTVisitor& visitor)
 
 Exp2NodePtr create_exp2_node(const ASTNodePtr x)
 {
-    return std::make_shared<Exp2Node>(x);
+    return ASTContext::get_current().create<Exp2Node>(x);
 }
 
 
-AssignmentNode::AssignmentNode(const ASTNodePtr trg, const ASTNodePtr src) : ASTNode(), trg(trg), src(src)
+AssignmentNode::AssignmentNode(const ASTNodePtr trg, const ASTNodePtr src) : ASTNode(NodeKind::ASSIGNMENT), trg(trg), src(src)
 {
 }
 
@@ -308,11 +408,11 @@ void AssignmentNode::accept(ASTVisitor& visitor)
 
 AssignmentNodePtr create_assignment_node(const ASTNodePtr trg, const ASTNodePtr src)
 {
-    return std::make_shared<AssignmentNode>(trg, src);
+    return ASTContext::get_current().create<AssignmentNode>(trg, src);
 }
 
 
-AliasNode::AliasNode(const std::string& alias_name, const ASTNodePtr src) : ASTNode(), name(alias_name), src(src)
+AliasNode::AliasNode(const std::string& alias_name, const ASTNodePtr src) : ASTNode(NodeKind::ALIAS), name(alias_name), src(src)
 {
 }
 
@@ -323,11 +423,11 @@ void AliasNode::accept(ASTVisitor& visitor)
 
 AliasNodePtr create_alias_node(const std::string& alias_name, const ASTNodePtr src)
 {
-    return std::make_shared<AliasNode>(alias_name, src);
+    return ASTContext::get_current().create<AliasNode>(alias_name, src);
 }
 
 
-ReturnNode::ReturnNode(const ASTNodePtr return_value) : ASTNode(), return_value(return_value)
+ReturnNode::ReturnNode(const std::vector<ASTNodePtr>& return_values) : ASTNode(NodeKind::RETURN), return_values(return_values)
 {
 }
 
@@ -336,17 +436,93 @@ void ReturnNode::accept(ASTVisitor& visitor)
     visitor.apply(*this);
 }
 
-ReturnNodePtr create_return_node(const ASTNodePtr return_value)
+ReturnNodePtr create_return_node(const std::vector<ASTNodePtr>& return_values)
+{
+    return ASTContext::get_current().create<ReturnNode>(return_values);
+}
+
+
+TupleElementNode::TupleElementNode(const ASTNodePtr tuple, const int index) : ASTNode(NodeKind::TUPLE_ELEMENT), tuple(tuple), index(index)
+{
+}
+
+void TupleElementNode::accept(ASTVisitor& visitor)
+{
+    visitor.apply(*this);
+}
+
+TupleElementNodePtr create_tuple_element_node(const ASTNodePtr tuple, const int index)
+{
+    return ASTContext::get_current().create<TupleElementNode>(tuple, index);
+}
+
+LoopVarNode::LoopVarNode(const std::string& name, const ASTNodePtr init) : ASTNode(NodeKind::LOOP_VAR), name(name), init(init), next(nullptr)
+{
+}
+
+void LoopVarNode::accept(ASTVisitor& visitor)
+{
+    visitor.apply(*this);
+}
+
+LoopVarNodePtr create_loopvar_node(const std::string& name, const ASTNodePtr init)
+{
+    return ASTContext::get_current().create<LoopVarNode>(name, init);
+}
+
+
+RepeatNode::RepeatNode(
+    const int trip_count, 
+    const std::vector<LoopVarNodePtr>& loop_vars
+    ) : ASTNode(NodeKind::REPEAT), trip_count(trip_count), 
+        loop_vars(loop_vars)
+{
+}
+
+void RepeatNode::accept(ASTVisitor& visitor)
+{
+    visitor.apply(*this);
+}
+
+RepeatNodePtr create_repeat_node(const int trip_count, const std::vector<LoopVarNodePtr>& loop_vars)
 {
-    return std::make_shared<ReturnNode>(return_value);
+    return ASTContext::get_current().create<RepeatNode>(trip_count, loop_vars);
+}
+
+
+Pipeline::Pipeline(
+    const std::string& name,
+    const std::vector<VariableNodePtr>& arguments
+    ) : name(name), arguments(arguments)
+{
+}
+
+PipelinePtr create_pipeline(const std::string& name, const std::vector<VariableNodePtr>& arguments)
+{
+    return std::make_shared<Pipeline>(name, arguments);
 }
 
 // printer impl.
 
-ASTPrinter::ASTPrinter()
+ASTPrinter::ASTPrinter(const bool stable_ids) : stable_ids(stable_ids)
 {
 }
 
+int ASTPrinter::get_printed_id(const int ast_id)
+{
+    if (!stable_ids)
+        return ast_id;
+
+    // numbered in the order of the first reference
+    auto [it, inserted] = printed_ids.try_emplace(ast_id, static_cast<int>(printed_ids.size()));
+    return it->second;
+}
+
+const std::string& ASTPrinter::get_ast_string() const
+{
+    return ast_as_string;
+}
+
 void ASTPrinter::save_into_file(const std::string& out_path) const
 {
     std::ofstream out(out_path);
@@ -363,6 +539,7 @@ void ASTPrinter::save_into_file(const std::string& out_path) const
 void ASTPrinter::reset()
 {
     ast_as_string.clear();
+    printed_ids.clear();
 }
 
 void ASTPrinter::apply(KernelNode& node)
@@ -373,20 +550,25 @@ void ASTPrinter::apply(KernelNode& node)
     std::stringstream ss;
 
     ss << "-- KernelNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
     ss << "  name:  " << node.name << "\n";
     ss << "  scope: " << node.scope << "\n";
 
     ss << "  args:  ";
     for (auto& arg_ast : node.arguments)
     {
-        ss << arg_ast->ast_id << ", ";
+        ss << get_printed_id(arg_ast->ast_id) << ", ";
     }
     ss << "\n";
     
-    if (node.return_value)
+    if (!node.return_values.empty())
     {
-        ss << "  ret:   " << node.return_value->ast_id << "\n";
+        ss << "  ret:   ";
+        for (auto& ret_ast : node.return_values)
+        {
+            ss << get_printed_id(ret_ast->ast_id) << ", ";
+        }
+        ss << "\n";
     }
     else
     {
@@ -396,7 +578,7 @@ void ASTPrinter::apply(KernelNode& node)
     ss << "  body:  ";
     for (auto& body_ast : node.body)
     {
-        ss << body_ast->ast_id << ", ";
+        ss << get_printed_id(body_ast->ast_id) << ", ";
     }
     ss << "\n";
 
@@ -410,9 +592,9 @@ void ASTPrinter::apply(KernelNode& node)
         arg_ast->accept(*this);
     }
 
-    if (node.return_value)
+    for (auto& ret_ast : node.return_values)
     {
-        node.return_value->accept(*this);
+        ret_ast->accept(*this);
     }
 
     for (auto& body_ast : node.body)
@@ -431,13 +613,13 @@ void ASTPrinter::apply(KernelCallNode &node)
     std::stringstream ss;
 
     ss << "-- KernelCallNode \n";
-    ss << "  id:        " << node.ast_id << "\n";
-    ss << "  kernel:    " << node.kernel->ast_id << "\n";
+    ss << "  id:        " << get_printed_id(node.ast_id) << "\n";
+    ss << "  kernel:    " << get_printed_id(node.kernel->ast_id) << "\n";
     
     ss << "  args:  ";
     for (auto& arg_ast : node.arguments)
     {
-        ss << arg_ast->ast_id << ", ";
+        ss << get_printed_id(arg_ast->ast_id) << ", ";
     }
     ss << "\n";
     
@@ -463,10 +645,12 @@ void ASTPrinter::apply(ConstantNode &node)
     std::stringstream ss;
 
     ss << "-- ConstantNode \n";
-    ss << "  id:        " << node.ast_id << "\n";
+    ss << "  id:        " << get_printed_id(node.ast_id) << "\n";
     ss << "  data_type: " << node.dtype << "\n";
 
-    if (node.dtype == DataType::FLOAT32)
+    if (node.dtype == DataType::FLOAT32 && stable_ids)
+        ss << "  f32:       " << std::setprecision(9) << node.val_f32 << "\n";  // exact
+    else if (node.dtype == DataType::FLOAT32)
         ss << "  f32:       " << node.val_f32 << "\n";
     
     ss << "\n";
@@ -483,7 +667,7 @@ void ASTPrinter::apply(ScalarNode &node)
     std::stringstream ss;
 
     ss << "-- ScalarNode \n";
-    ss << "  id:        " << node.ast_id << "\n";
+    ss << "  id:        " << get_printed_id(node.ast_id) << "\n";
     ss << "  name:      " << node.name << "\n";
     ss << "  var_type:  " << node.vtype << "\n";
     ss << "  data_type: " << node.dtype << "\n";
@@ -502,7 +686,7 @@ void ASTPrinter::apply(TensorNode &node)
     std::stringstream ss;
 
     ss << "-- TensorNode \n";
-    ss << "  id:        " << node.ast_id << "\n";
+    ss << "  id:        " << get_printed_id(node.ast_id) << "\n";
     ss << "  name:      " << node.name << "\n";
     ss << "  var_type:  " << node.vtype << "\n";
     ss << "  data_type: " << node.dtype << "\n";
@@ -521,9 +705,9 @@ void ASTPrinter::apply(AddNode &node)
     std::stringstream ss;
 
     ss << "-- AddNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  lhs:   " << node.lhs->ast_id << "\n";
-    ss << "  rhs:   " << node.rhs ->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  lhs:   " << get_printed_id(node.lhs->ast_id) << "\n";
+    ss << "  rhs:   " << get_printed_id(node.rhs->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -542,9 +726,9 @@ void ASTPrinter::apply(SubNode &node)
     std::stringstream ss;
 
     ss << "-- SubNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  lhs:   " << node.lhs->ast_id << "\n";
-    ss << "  rhs:   " << node.rhs ->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  lhs:   " << get_printed_id(node.lhs->ast_id) << "\n";
+    ss << "  rhs:   " << get_printed_id(node.rhs->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -563,9 +747,9 @@ void ASTPrinter::apply(MulNode &node)
     std::stringstream ss;
 
     ss << "-- MulNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  lhs:   " << node.lhs->ast_id << "\n";
-    ss << "  rhs:   " << node.rhs ->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  lhs:   " << get_printed_id(node.lhs->ast_id) << "\n";
+    ss << "  rhs:   " << get_printed_id(node.rhs->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -584,9 +768,9 @@ void ASTPrinter::apply(DivNode &node)
     std::stringstream ss;
 
     ss << "-- DivNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  lhs:   " << node.lhs->ast_id << "\n";
-    ss << "  rhs:   " << node.rhs ->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  lhs:   " << get_printed_id(node.lhs->ast_id) << "\n";
+    ss << "  rhs:   " << get_printed_id(node.rhs->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -605,8 +789,8 @@ void ASTPrinter::apply(AbsNode &node)
     std::stringstream ss;
 
     ss << "-- AbsNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  x:     " << node.x->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  x:     " << get_printed_id(node.x->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -624,8 +808,8 @@ void ASTPrinter::apply(SqrtNode &node)
     std::stringstream ss;
 
     ss << "-- SqrtNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  x:     " << node.x->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  x:     " << get_printed_id(node.x->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -643,8 +827,8 @@ void ASTPrinter::apply(Log2Node &node)
     std::stringstream ss;
 
     ss << "-- Log2Node \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  x:     " << node.x->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  x:     " << get_printed_id(node.x->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -662,8 +846,8 @@ void ASTPrinter::apply(Exp2Node &node)
     std::stringstream ss;
 
     ss << "-- Exp2Node \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  x:     " << node.x->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  x:     " << get_printed_id(node.x->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -681,9 +865,9 @@ void ASTPrinter::apply(AssignmentNode &node)
     std::stringstream ss;
 
     ss << "-- AssignmentNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
-    ss << "  src:   " << node.src->ast_id << "\n";
-    ss << "  trg:   " << node.trg->ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  src:   " << get_printed_id(node.src->ast_id) << "\n";
+    ss << "  trg:   " << get_printed_id(node.trg->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -702,9 +886,9 @@ void ASTPrinter::apply(AliasNode &node)
     std::stringstream ss;
 
     ss << "-- AliasNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
     ss << "  name:  " << node.name << "\n";
-    ss << "  src:   " << node.src->ast_id << "\n";
+    ss << "  src:   " << get_printed_id(node.src->ast_id) << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
@@ -722,18 +906,352 @@ void ASTPrinter::apply(ReturnNode &node)
     std::stringstream ss;
 
     ss << "-- ReturnNode \n";
-    ss << "  id:    " << node.ast_id << "\n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
 
-    if (node.return_value)
-        ss << "  ret:   " << node.return_value->ast_id << "\n";
+    if (!node.return_values.empty())
+    {
+        ss << "  ret:   ";
+        for (auto& ret_ast : node.return_values)
+        {
+            ss << get_printed_id(ret_ast->ast_id) << ", ";
+        }
+        ss << "\n";
+    }
     else
+    {
         ss << "  ret:   " << "void" << "\n";
+    }
+    
+    ss << "\n";
+    ast_as_string.append(ss.str());
+
+    for (auto& ret_ast : node.return_values)
+    {
+        ret_ast->accept(*this);
+    }
+
+    already_printed.insert(node.ast_id);
+}
+
+void ASTPrinter::apply(TupleElementNode &node)
+{
+    if (already_printed.contains(node.ast_id))
+        return;
+
+    std::stringstream ss;
+
+    ss << "-- TupleElementNode \n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  tuple: " << get_printed_id(node.tuple->ast_id) << "\n";
+    ss << "  index: " << node.index << "\n";
     
     ss << "\n";
     ast_as_string.append(ss.str());
 
-    if (node.return_value)
-        node.return_value->accept(*this);
+    node.tuple->accept(*this);
 
     already_printed.insert(node.ast_id);
 }
+
+void ASTPrinter::apply(LoopVarNode &node)
+{
+    if (already_printed.contains(node.ast_id))
+        return;
+
+    std::stringstream ss;
+
+    ss << "-- LoopVarNode \n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  name:  " << node.name << "\n";
+    ss << "  init:  " << get_printed_id(node.init->ast_id) << "\n";
+
+    if (node.next)
+        ss << "  next:  " << get_printed_id(node.next->ast_id) << "\n";
+    else
+        ss << "  next:  " << "none" << "\n";
+    
+    ss << "\n";
+    ast_as_string.append(ss.str());
+
+    already_printed.insert(node.ast_id);
+
+    // next can refer back to the loop var itself
+    node.init->accept(*this);
+
+    if (node.next)
+        node.next->accept(*this);
+}
+
+void ASTPrinter::apply(RepeatNode &node)
+{
+    if (already_printed.contains(node.ast_id))
+        return;
+
+    std::stringstream ss;
+
+    ss << "-- RepeatNode \n";
+    ss << "  id:    " << get_printed_id(node.ast_id) << "\n";
+    ss << "  trips: " << node.trip_count << "\n";
+
+    ss << "  vars:  ";
+    for (auto& loop_var : node.loop_vars)
+    {
+        ss << get_printed_id(loop_var->ast_id) << ", ";
+    }
+    ss << "\n";
+
+    ss << "  body:  ";
+    for (auto& body_ast : node.body)
+    {
+        ss << get_printed_id(body_ast->ast_id) << ", ";
+    }
+    ss << "\n";
+    
+    ss << "\n";
+    ast_as_string.append(ss.str());
+
+    for (auto& loop_var : node.loop_vars)
+    {
+        loop_var->accept(*this);
+    }
+
+    for (auto& body_ast : node.body)
+    {
+        body_ast->accept(*this);
+    }
+
+    already_printed.insert(node.ast_id);
+}
+
+// data type inference impl.
+
+DataTypeInference::DataTypeInference()
+{
+}
+
+DataType DataTypeInference::get_dtype(const ASTNodePtr node)
+{
+    return get_dtype(*node);
+}
+
+DataType DataTypeInference::get_dtype(ASTNode& node)
+{
+    if (!dtypes.contains(node.ast_id))
+    {
+        node.accept(*this);
+    }
+
+    return dtypes.at(node.ast_id);
+}
+
+const std::string& DataTypeInference::get_error() const
+{
+    return error_msg;
+}
+
+void DataTypeInference::set_error(const std::string& msg)
+{
+    if (error_msg.empty())
+    {
+        error_msg = msg;
+    }
+}
+
+DataType DataTypeInference::unify_binary(const BinaryNode& node, const std::string& op_name)
+{
+    auto lhs_dtype = get_dtype(node.lhs);
+    auto rhs_dtype = get_dtype(node.rhs);
+
+    // f32 operands are promoted to the other type
+    if (lhs_dtype == rhs_dtype || rhs_dtype == DataType::FLOAT32)
+    {
+        return lhs_dtype;
+    }
+    else if (lhs_dtype == DataType::FLOAT32)
+    {
+        return rhs_dtype;
+    }
+
+    std::stringstream ss;
+    ss << "Mismatching data types in " << op_name << ": " << lhs_dtype << " and " << rhs_dtype;
+    set_error(ss.str());
+    return lhs_dtype;
+}
+
+DataType DataTypeInference::check_unary(const UnaryNode& node, const std::string& op_name)
+{
+    auto x_dtype = get_dtype(node.x);
+    if (x_dtype == DataType::COMPLEX64)
+    {
+        std::stringstream ss;
+        ss << op_name << " is not supported for " << x_dtype;
+        set_error(ss.str());
+    }
+
+    return x_dtype;
+}
+
+void DataTypeInference::apply(KernelNode& node)
+{
+    for (auto& body_ast : node.body)
+    {
+        get_dtype(body_ast);
+    }
+
+    dtypes.insert({node.ast_id, DataType::FLOAT32});  // not a value
+}
+
+void DataTypeInference::apply(KernelCallNode& node)
+{
+    for (int ix = 0; ix < node.arguments.size() && ix < node.kernel->arguments.size(); ++ix)
+    {
+        auto arg_dtype = get_dtype(node.arguments[ix]);
+        auto expected_dtype = node.kernel->arguments[ix]->dtype;
+        if (arg_dtype != expected_dtype)
+        {
+            std::stringstream ss;
+            ss << "Wrong argument data type in call of " << node.kernel->name << ": ";
+            ss << arg_dtype << " instead of " << expected_dtype;
+            set_error(ss.str());
+        }
+    }
+
+    // several return values are only reachable through tuple elements
+    auto dtype = DataType::FLOAT32;
+    if (node.kernel->return_values.size() == 1)
+    {
+        dtype = node.kernel->return_values[0]->dtype;
+    }
+
+    dtypes.insert({node.ast_id, dtype});
+}
+
+void DataTypeInference::apply(ConstantNode& node)
+{
+    dtypes.insert({node.ast_id, node.dtype});
+}
+
+void DataTypeInference::apply(ScalarNode& node)
+{
+    dtypes.insert({node.ast_id, node.dtype});
+}
+
+void DataTypeInference::apply(TensorNode& node)
+{
+    dtypes.insert({node.ast_id, node.dtype});
+}
+
+void DataTypeInference::apply(AddNode& node)
+{
+    dtypes.insert({node.ast_id, unify_binary(node, "add")});
+}
+
+void DataTypeInference::apply(SubNode& node)
+{
+    dtypes.insert({node.ast_id, unify_binary(node, "sub")});
+}
+
+void DataTypeInference::apply(MulNode& node)
+{
+    dtypes.insert({node.ast_id, unify_binary(node, "mul")});
+}
+
+void DataTypeInference::apply(DivNode& node)
+{
+    dtypes.insert({node.ast_id, unify_binary(node, "div")});
+}
+
+void DataTypeInference::apply(AbsNode& node)
+{
+    auto x_dtype = get_dtype(node.x);
+    auto dtype = (x_dtype == DataType::COMPLEX64 ? DataType::FLOAT32 : x_dtype);  // magnitude
+    dtypes.insert({node.ast_id, dtype});
+}
+
+void DataTypeInference::apply(SqrtNode& node)
+{
+    dtypes.insert({node.ast_id, check_unary(node, "sqrt")});
+}
+
+void DataTypeInference::apply(Log2Node& node)
+{
+    dtypes.insert({node.ast_id, check_unary(node, "log2")});
+}
+
+void DataTypeInference::apply(Exp2Node& node)
+{
+    dtypes.insert({node.ast_id, check_unary(node, "exp2")});
+}
+
+void DataTypeInference::apply(AssignmentNode& node)
+{
+    auto trg_dtype = get_dtype(node.trg);
+    auto src_dtype = get_dtype(node.src);
+
+    if (src_dtype != trg_dtype && src_dtype != DataType::FLOAT32)
+    {
+        std::stringstream ss;
+        ss << "Can not assign " << src_dtype << " to " << trg_dtype;
+        set_error(ss.str());
+    }
+
+    dtypes.insert({node.ast_id, trg_dtype});
+}
+
+void DataTypeInference::apply(AliasNode& node)
+{
+    dtypes.insert({node.ast_id, get_dtype(node.src)});
+}
+
+void DataTypeInference::apply(ReturnNode& node)
+{
+    for (auto& ret_ast : node.return_values)
+    {
+        get_dtype(ret_ast);
+    }
+
+    dtypes.insert({node.ast_id, DataType::FLOAT32});  // not a value
+}
+
+void DataTypeInference::apply(TupleElementNode& node)
+{
+    auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node.tuple);
+
+    auto dtype = DataType::FLOAT32;
+    if (call_node && node.index < call_node->kernel->return_values.size())
+    {
+        get_dtype(node.tuple);  // checks the arguments
+        dtype = call_node->kernel->return_values[node.index]->dtype;
+    }
+
+    dtypes.insert({node.ast_id, dtype});
+}
+
+void DataTypeInference::apply(LoopVarNode& node)
+{
+    auto dtype = get_dtype(node.init);
+    dtypes.insert({node.ast_id, dtype});  // before next, it can refer back to the loop var
+
+    if (node.next && get_dtype(node.next) != dtype)
+    {
+        std::stringstream ss;
+        ss << "Data type of " << node.name << " changes in the repeat block: ";
+        ss << dtype << " and " << get_dtype(node.next);
+        set_error(ss.str());
+    }
+}
+
+void DataTypeInference::apply(RepeatNode& node)
+{
+    for (auto& loop_var : node.loop_vars)
+    {
+        get_dtype(loop_var);
+    }
+
+    for (auto& body_ast : node.body)
+    {
+        get_dtype(body_ast);
+    }
+
+    dtypes.insert({node.ast_id, DataType::FLOAT32});  // not a value
+}
@@ -4,13 +4,158 @@
 
 // forward declaration
 class ASTVisitor;
+struct ASTNode;
+
+/**
+ * Bump allocator of the AST nodes. Memory is taken from large blocks,
+ * single nodes are never freed, the blocks are released together with the arena.
+ * The blocks grow from a small first one, a context of a single kernel stays small.
+ */
+class ASTArena
+{
+public:
+    void* allocate(const size_t size, const size_t alignment);
+
+private:
+    static constexpr size_t min_block_size = 4 * 1024;
+    static constexpr size_t max_block_size = 64 * 1024;
+    std::vector<std::unique_ptr<std::byte[]>> blocks;
+    std::vector<std::unique_ptr<std::byte[]>> large_blocks;
+    size_t block_capacity = 0;  // size of the last block
+    size_t block_offset = 0;    // first free byte in the last block
+};
+
+/**
+ * Allocator of std::allocate_shared. Each node (with its control block) holds
+ * the arena, so the arena lives until the last node of the context is released.
+ */
+template <typename T>
+struct ASTArenaAllocator
+{
+    using value_type = T;
+    std::shared_ptr<ASTArena> arena;
+
+    explicit ASTArenaAllocator(std::shared_ptr<ASTArena> arena) : arena(std::move(arena)) {}
+    template <typename U>
+    ASTArenaAllocator(const ASTArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(const size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, const size_t) {}  // released with the arena
+
+    template <typename U>
+    bool operator==(const ASTArenaAllocator<U>& other) const { return arena == other.arena; }
+};
+
+/**
+ * Owns the AST nodes of a compilation and gives their ids.
+ * The nodes are allocated from an arena: the nodes of a kernel are built one after the other,
+ * so they are next to each other in memory. The ids are dense (0, 1, 2, ...) within the context.
+ * A context is used by a single thread, there is no lock. The create_* functions
+ * build the nodes in the current context of the thread (see ASTContextScope).
+ */
+class ASTContext
+{
+public:
+    /**
+     * @param keep_nodes the context holds each created node, see get_kept_nodes()
+     */
+    explicit ASTContext(const bool keep_nodes = false);
+
+    int generate_id();
+
+    /**
+     * The number of ids given so far, every id is below it.
+     */
+    int get_num_ids() const;
+
+    /**
+     * Skips the ids of the nodes built in other contexts and merged into
+     * this one (e.g. kernels parsed on several threads).
+     * @return the first of the num_ids skipped ids
+     */
+    int reserve_ids(const int num_ids);
+
+    /**
+     * The nodes created so far if the context keeps them (e.g. their ids are
+     * shifted when the context is merged into another one).
+     */
+    const std::vector<std::shared_ptr<ASTNode>>& get_kept_nodes() const;
+
+    template <typename T, typename... Args>
+    std::shared_ptr<T> create(Args&&... args)
+    {
+        auto node = std::allocate_shared<T>(ASTArenaAllocator<T>(arena), std::forward<Args>(args)...);
+        if (keep_nodes)
+        {
+            kept_nodes.push_back(node);
+        }
+        return node;
+    }
+
+    /**
+     * The context of the innermost ASTContextScope of the thread,
+     * a default context of the thread if there is none.
+     */
+    static ASTContext& get_current();
+
+private:
+    std::shared_ptr<ASTArena> arena;
+    int next_id = 0;
+    bool keep_nodes;
+    std::vector<std::shared_ptr<ASTNode>> kept_nodes;
+
+    friend class ASTContextScope;
+    static thread_local ASTContext* current;
+};
+
+/**
+ * Makes a context the current one of the thread for the lifetime of the scope.
+ */
+class ASTContextScope
+{
+public:
+    explicit ASTContextScope(ASTContext& context);
+    ~ASTContextScope();
+
+    ASTContextScope(const ASTContextScope&) = delete;
+    ASTContextScope& operator=(const ASTContextScope&) = delete;
+
+private:
+    ASTContext* previous;
+};
+
+// type of the node, for dispatching without a visitor or casts
+enum class NodeKind
+{
+    KERNEL,
+    KERNEL_CALL,
+    CONSTANT,
+    SCALAR,
+    TENSOR,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    ABS,
+    SQRT,
+    LOG2,
+    EXP2,
+    ASSIGNMENT,
+    ALIAS,
+    RETURN,
+    TUPLE_ELEMENT,
+    LOOP_VAR,
+    REPEAT
+};
 
 // AST base
 struct ASTNode
 {
-    int ast_id;  // unique id
+    int ast_id;  // unique id in the context of the node
+    NodeKind kind;
+    int value_index = -1;  // dense index within the kernel being compiled, set by the code generator
 
-    explicit ASTNode();
+    explicit ASTNode(const NodeKind kind);
     virtual void accept(ASTVisitor& visitor) = 0;
 };
 
@@ -27,11 +172,19 @@ std::ostream& operator<<(std::ostream& os, const VariableType var_type);
 
 enum class DataType
 {
-    FLOAT32
+    FLOAT32,
+    COMPLEX64,  // interleaved (real, imag) f32 pair
+    FLOAT32X2,  // short vectors, elementwise ops
+    FLOAT32X4
 };
 
 std::ostream& operator<<(std::ostream& os, const DataType var_type);
 
+/**
+ * Number of f32 lanes in a value of the data type.
+ */
+int get_num_lanes(const DataType dtype);
+
 
 struct ConstantNode : public ASTNode
 {
@@ -62,6 +215,7 @@ struct VariableNode : public ASTNode
     std::string name;
 
     explicit VariableNode(
+        const NodeKind kind,
         const VariableType vtype, 
         const DataType dtype, 
         const std::string& name);
@@ -116,15 +270,17 @@ struct KernelNode : public ASTNode
     KernelScope scope;
     std::string name;  // handled as unique (no overloading)
     std::vector<VariableNodePtr> arguments;
-    VariableNodePtr return_value;  // nullptr if void
+    std::vector<VariableNodePtr> return_values;  // empty if void, several for tuple returns
 
     std::vector<ASTNodePtr> body;  // set of expressions, topological ordering
 
+    mutable std::optional<bool> side_effects;  // memoized by has_side_effects
+
     explicit KernelNode(
         const std::string& name,
         const KernelScope scope, 
         const std::vector<VariableNodePtr>& arguments,
-        const VariableNodePtr return_value);
+        const std::vector<VariableNodePtr>& return_values);
 
     virtual void accept(ASTVisitor& visitor) override;
 };
@@ -135,7 +291,7 @@ KernelNodePtr create_kernel_node(
     const std::string& name,
     const KernelScope scope, 
     const std::vector<VariableNodePtr>& arguments,
-    const VariableNodePtr return_value);
+    const std::vector<VariableNodePtr>& return_values);
 
 
 struct KernelCallNode : public ASTNode
@@ -163,7 +319,7 @@ struct BinaryNode : ASTNode
     ASTNodePtr lhs;
     ASTNodePtr rhs;
 
-    explicit BinaryNode(const ASTNodePtr lhs, const ASTNodePtr rhs);
+    explicit BinaryNode(const NodeKind kind, const ASTNodePtr lhs, const ASTNodePtr rhs);
 };
 
 
@@ -224,7 +380,7 @@ struct UnaryNode : ASTNode
 {
     ASTNodePtr x;
 
-    explicit UnaryNode(const ASTNodePtr x);
+    explicit UnaryNode(const NodeKind kind, const ASTNodePtr x);
 };
 
 
@@ -309,17 +465,88 @@ AliasNodePtr create_alias_node(
     const ASTNodePtr src);
 
 
-struct ReturnNode : ASTNode  // return d;
+struct ReturnNode : ASTNode  // return d; or return s, c;
 {
-    ASTNodePtr return_value;
+    std::vector<ASTNodePtr> return_values;  // empty if void
 
-    explicit ReturnNode(const ASTNodePtr return_value);
+    explicit ReturnNode(const std::vector<ASTNodePtr>& return_values);
     virtual void accept(ASTVisitor& visitor) override;
 };
 
 using ReturnNodePtr = std::shared_ptr<ReturnNode>;
 
-ReturnNodePtr create_return_node(const ASTNodePtr return_value);
+ReturnNodePtr create_return_node(const std::vector<ASTNodePtr>& return_values);
+
+
+struct TupleElementNode : ASTNode  // var (s, c) = f(x); s and c refers to the elements
+{
+    ASTNodePtr tuple;  // call of a kernel with several return values
+    int index;
+
+    explicit TupleElementNode(const ASTNodePtr tuple, const int index);
+    virtual void accept(ASTVisitor& visitor) override;
+};
+
+using TupleElementNodePtr = std::shared_ptr<TupleElementNode>;
+
+TupleElementNodePtr create_tuple_element_node(
+    const ASTNodePtr tuple, 
+    const int index);
+
+// control flow
+struct LoopVarNode : ASTNode  // var updated inside a repeat block
+{
+    std::string name;
+    ASTNodePtr init;  // value before the first iteration
+    ASTNodePtr next;  // value at the end of an iteration
+
+    explicit LoopVarNode(const std::string& name, const ASTNodePtr init);
+    virtual void accept(ASTVisitor& visitor) override;
+};
+
+using LoopVarNodePtr = std::shared_ptr<LoopVarNode>;
+
+LoopVarNodePtr create_loopvar_node(
+    const std::string& name, 
+    const ASTNodePtr init);
+
+
+struct RepeatNode : ASTNode  // repeat 4 { ... }
+{
+    int trip_count;
+    std::vector<LoopVarNodePtr> loop_vars;  // loop-carried bindings
+    std::vector<ASTNodePtr> body;           // executed trip_count times
+
+    explicit RepeatNode(const int trip_count, const std::vector<LoopVarNodePtr>& loop_vars);
+    virtual void accept(ASTVisitor& visitor) override;
+};
+
+using RepeatNodePtr = std::shared_ptr<RepeatNode>;
+
+RepeatNodePtr create_repeat_node(
+    const int trip_count, 
+    const std::vector<LoopVarNodePtr>& loop_vars);
+
+
+// pipeline declaration, global kernels launched one after the other
+// (not an AST node, it is turned into a fused kernel before the AST passes)
+struct Pipeline
+{
+    std::string name;
+    std::vector<VariableNodePtr> arguments;     // visible from outside
+    std::vector<TensorNodePtr> intermediates;   // f32[] t; declared in the body, not visible from outside
+    std::vector<KernelCallNodePtr> stages;      // global kernel launches, in order
+
+    explicit Pipeline(
+        const std::string& name,
+        const std::vector<VariableNodePtr>& arguments);
+};
+
+using PipelinePtr = std::shared_ptr<Pipeline>;
+
+PipelinePtr create_pipeline(
+    const std::string& name,
+    const std::vector<VariableNodePtr>& arguments);
 
 // defintion of visitor base class
 class ASTVisitor
@@ -346,6 +573,10 @@ public:
     virtual void apply(AssignmentNode& node) = 0;
     virtual void apply(AliasNode& node) = 0;
     virtual void apply(ReturnNode& node) = 0;
+    virtual void apply(TupleElementNode& node) = 0;
+
+    virtual void apply(LoopVarNode& node) = 0;
+    virtual void apply(RepeatNode& node) = 0;
 };
 
 
@@ -353,8 +584,13 @@ public:
 class ASTPrinter : public ASTVisitor
 {
 public:
-    explicit ASTPrinter();
+    /**
+     * @param stable_ids the ids are numbered in the order of printing and the constants are exact,
+     *     so the text of a kernel does not depend on the other kernels of the source (e.g. for hashing)
+     */
+    explicit ASTPrinter(const bool stable_ids = false);
     void save_into_file(const std::string& out_path) const;
+    const std::string& get_ast_string() const;
     void reset();
 
     virtual void apply(KernelNode& node);
@@ -377,9 +613,70 @@ public:
     virtual void apply(AssignmentNode& node);
     virtual void apply(AliasNode& node);
     virtual void apply(ReturnNode& node);
+    virtual void apply(TupleElementNode& node);
+
+    virtual void apply(LoopVarNode& node);
+    virtual void apply(RepeatNode& node);
 
 private:
     std::string ast_as_string;
+    bool stable_ids;
+    std::unordered_map<int, int> printed_ids;  // by the ast id, with stable ids
 
     std::unordered_set<int> already_printed;
+
+    int get_printed_id(const int ast_id);
+};
+
+
+// data type inference visitor (e.g. abs of a c64 is a f32)
+class DataTypeInference : public ASTVisitor
+{
+public:
+    explicit DataTypeInference();
+
+    /**
+     * Gives the data type of the value calculated by the node.
+     * Type errors are collected, see get_error().
+     */
+    DataType get_dtype(const ASTNodePtr node);
+    DataType get_dtype(ASTNode& node);
+
+    /**
+     * First type error found so far, empty if none.
+     */
+    const std::string& get_error() const;
+
+    virtual void apply(KernelNode& node);
+    virtual void apply(KernelCallNode& node);
+    
+    virtual void apply(ConstantNode& node);
+    virtual void apply(ScalarNode& node);
+    virtual void apply(TensorNode& node);
+
+    virtual void apply(AddNode& node);
+    virtual void apply(SubNode& node);
+    virtual void apply(MulNode& node);
+    virtual void apply(DivNode& node);
+
+    virtual void apply(AbsNode& node);
+    virtual void apply(SqrtNode& node);
+    virtual void apply(Log2Node& node);
+    virtual void apply(Exp2Node& node);
+
+    virtual void apply(AssignmentNode& node);
+    virtual void apply(AliasNode& node);
+    virtual void apply(ReturnNode& node);
+    virtual void apply(TupleElementNode& node);
+
+    virtual void apply(LoopVarNode& node);
+    virtual void apply(RepeatNode& node);
+
+private:
+    std::unordered_map<int, DataType> dtypes;
+    std::string error_msg;
+
+    DataType unify_binary(const BinaryNode& node, const std::string& op_name);
+    DataType check_unary(const UnaryNode& node, const std::string& op_name);
+    void set_error(const std::string& msg);
 };
@@ -0,0 +1,321 @@
+#include "autodiff.hpp"
+#include "transforms.hpp"
+
+static constexpr float ln2 = 0.69314718f;
+
+static ASTNodePtr create_f32_constant(const float value)
+{
+    return create_constant_node(value, DataType::FLOAT32);
+}
+
+
+AdjointBuilder::AdjointBuilder()
+{
+}
+
+void AdjointBuilder::add_adjoint(const ASTNodePtr node, const ASTNodePtr adjoint)
+{
+    if (adjoints.contains(node->ast_id))
+    {
+        adjoints[node->ast_id] = create_add_node(adjoints[node->ast_id], adjoint);
+    }
+    else
+    {
+        adjoints.insert({node->ast_id, adjoint});
+    }
+}
+
+void AdjointBuilder::propagate(const std::vector<ASTNodePtr>& roots)
+{
+    // post-order of the expressions (operands first), without recursion
+    std::vector<ASTNodePtr> ordered_nodes;
+    std::unordered_set<int> visited_ids;
+    std::vector<std::pair<ASTNodePtr, bool>> stack;
+
+    for (auto& root : roots)
+    {
+        stack.push_back({root, false});
+    }
+
+    while (!stack.empty())
+    {
+        auto [node, operands_done] = stack.back();
+        stack.pop_back();
+
+        if (operands_done)
+        {
+            ordered_nodes.push_back(node);
+            continue;
+        }
+
+        if (visited_ids.contains(node->ast_id))
+            continue;
+
+        visited_ids.insert(node->ast_id);
+        stack.push_back({node, true});
+
+        for (auto& operand : get_operands(node))
+        {
+            if (!visited_ids.contains(operand->ast_id))
+            {
+                stack.push_back({operand, false});
+            }
+        }
+    }
+
+    // users before operands
+    for (auto it = ordered_nodes.rbegin(); it != ordered_nodes.rend(); ++it)
+    {
+        if (adjoints.contains((*it)->ast_id))
+        {
+            visited_node = *it;
+            visited_node->accept(*this);
+        }
+    }
+}
+
+ASTNodePtr AdjointBuilder::get_adjoint(const int ast_id) const
+{
+    if (adjoints.contains(ast_id))
+        return adjoints.at(ast_id);
+
+    return nullptr;
+}
+
+ASTNodePtr AdjointBuilder::visited_adjoint() const
+{
+    return adjoints.at(visited_node->ast_id);
+}
+
+void AdjointBuilder::emit_unsupported(const std::string& node_name) const
+{
+    std::stringstream ss;
+    ss << "Autodiff: unexpected " << node_name << " in the inlined expressions.";
+    emit_error(ss.str());
+}
+
+void AdjointBuilder::apply(KernelNode& node)
+{
+    emit_unsupported("kernel");
+}
+
+void AdjointBuilder::apply(KernelCallNode& node)
+{
+    emit_unsupported("kernel call");
+}
+
+void AdjointBuilder::apply(ConstantNode& node)
+{
+    // leaf, no operands
+}
+
+void AdjointBuilder::apply(ScalarNode& node)
+{
+    // leaf, no operands
+}
+
+void AdjointBuilder::apply(TensorNode& node)
+{
+    // leaf, the adjoint is the gradient of the tensor
+}
+
+void AdjointBuilder::apply(AddNode& node)
+{
+    auto adjoint = visited_adjoint();
+    add_adjoint(node.lhs, adjoint);
+    add_adjoint(node.rhs, adjoint);
+}
+
+void AdjointBuilder::apply(SubNode& node)
+{
+    auto adjoint = visited_adjoint();
+    add_adjoint(node.lhs, adjoint);
+    add_adjoint(node.rhs, create_sub_node(create_f32_constant(0.0f), adjoint));
+}
+
+void AdjointBuilder::apply(MulNode& node)
+{
+    auto adjoint = visited_adjoint();
+    add_adjoint(node.lhs, create_mul_node(adjoint, node.rhs));
+    add_adjoint(node.rhs, create_mul_node(adjoint, node.lhs));
+}
+
+void AdjointBuilder::apply(DivNode& node)
+{
+    // d(l/r)/dr = -(l/r)/r
+    auto adjoint = visited_adjoint();
+    add_adjoint(node.lhs, create_div_node(adjoint, node.rhs));
+
+    auto rhs_adjoint = create_div_node(create_mul_node(adjoint, visited_node), node.rhs);
+    add_adjoint(node.rhs, create_sub_node(create_f32_constant(0.0f), rhs_adjoint));
+}
+
+void AdjointBuilder::apply(AbsNode& node)
+{
+    // x/|x|, undefined at zero
+    auto adjoint = visited_adjoint();
+    add_adjoint(node.x, create_div_node(create_mul_node(adjoint, node.x), visited_node));
+}
+
+void AdjointBuilder::apply(SqrtNode& node)
+{
+    // 0.5/sqrt(x)
+    auto adjoint = visited_adjoint();
+    add_adjoint(node.x, create_div_node(create_mul_node(adjoint, create_f32_constant(0.5f)), visited_node));
+}
+
+void AdjointBuilder::apply(Log2Node& node)
+{
+    // 1/(x*ln2)
+    auto adjoint = visited_adjoint();
+    add_adjoint(node.x, create_div_node(create_mul_node(adjoint, create_f32_constant(1.0f / ln2)), node.x));
+}
+
+void AdjointBuilder::apply(Exp2Node& node)
+{
+    // exp2(x)*ln2
+    auto adjoint = visited_adjoint();
+    add_adjoint(node.x, create_mul_node(create_mul_node(adjoint, visited_node), create_f32_constant(ln2)));
+}
+
+void AdjointBuilder::apply(AssignmentNode& node)
+{
+    emit_unsupported("assignment");
+}
+
+void AdjointBuilder::apply(AliasNode& node)
+{
+    add_adjoint(node.src, visited_adjoint());
+}
+
+void AdjointBuilder::apply(ReturnNode& node)
+{
+    emit_unsupported("return");
+}
+
+void AdjointBuilder::apply(TupleElementNode& node)
+{
+    emit_unsupported("tuple element");
+}
+
+void AdjointBuilder::apply(LoopVarNode& node)
+{
+    emit_unsupported("loop variable");
+}
+
+void AdjointBuilder::apply(RepeatNode& node)
+{
+    emit_unsupported("repeat block");
+}
+
+
+KernelNodePtr build_backward_kernel(const KernelNodePtr kernel)
+{
+    if (kernel->scope != KernelScope::GLOBAL)
+    {
+        std::stringstream ss;
+        ss << "Autodiff: backward kernels are derived only from global kernels, " << kernel->name << " is not.";
+        emit_error(ss.str());
+    }
+
+    for (auto& arg : kernel->arguments)
+    {
+        if (arg->dtype != DataType::FLOAT32)
+        {
+            std::stringstream ss;
+            ss << "Autodiff: only f32 arguments are supported, " << arg->name;
+            ss << " in " << kernel->name << " is " << arg->dtype << ".";
+            emit_error(ss.str());
+        }
+    }
+
+    KernelInliner inliner;
+    inliner.inline_kernel(*kernel);
+    auto& outputs = inliner.get_outputs();
+
+    auto arguments = kernel->arguments;
+    std::unordered_set<int> output_ids;
+
+    // seed: the incoming gradients of the assigned tensors
+    AdjointBuilder adjoint_builder;
+    std::vector<ASTNodePtr> roots;
+    for (auto& [tensor, value] : outputs)
+    {
+        auto grad_tensor = create_tensor_node(DataType::FLOAT32, "grad_" + tensor->name);
+        arguments.push_back(grad_tensor);
+        output_ids.insert(tensor->ast_id);
+
+        adjoint_builder.add_adjoint(value, grad_tensor);
+        roots.push_back(value);
+    }
+
+    adjoint_builder.propagate(roots);
+
+    std::vector<ASTNodePtr> grad_assignments;
+    for (auto& arg : kernel->arguments)
+    {
+        if (arg->vtype != VariableType::TENSOR)
+            continue;
+
+        auto adjoint = adjoint_builder.get_adjoint(arg->ast_id);
+        if (output_ids.contains(arg->ast_id))
+        {
+            if (adjoint)
+            {
+                std::stringstream ss;
+                ss << "Autodiff: tensor " << arg->name << " is read before it is assigned in " << kernel->name;
+                ss << ", it would need an incoming and an outgoing gradient.";
+                emit_error(ss.str());
+            }
+            continue;
+        }
+
+        auto grad_tensor = create_tensor_node(DataType::FLOAT32, "grad_" + arg->name);
+        arguments.push_back(grad_tensor);
+
+        if (!adjoint)
+        {
+            adjoint = create_f32_constant(0.0f);  // not used by the kernel
+        }
+        grad_assignments.push_back(create_assignment_node(grad_tensor, adjoint));
+    }
+
+    auto backward_kernel = create_kernel_node(get_backward_kernel_name(kernel->name), KernelScope::GLOBAL, arguments, {});
+    backward_kernel->body = grad_assignments;
+    backward_kernel->body.push_back(create_return_node({}));
+
+    return backward_kernel;
+}
+
+std::string get_backward_kernel_name(const std::string& kernel_name)
+{
+    return kernel_name + "_grad";
+}
+
+void check_backward_kernel_names(const std::vector<KernelNodePtr>& kernels, const std::vector<PipelinePtr>& pipelines)
+{
+    std::unordered_set<std::string> names;
+    std::vector<std::string> forward_names;
+    for (auto& kernel : kernels)
+    {
+        names.insert(kernel->name);
+        if (kernel->scope == KernelScope::GLOBAL)
+            forward_names.push_back(kernel->name);
+    }
+    for (auto& pipeline : pipelines)
+    {
+        names.insert(pipeline->name);
+        forward_names.push_back(pipeline->name);
+    }
+
+    for (auto& forward_name : forward_names)
+    {
+        if (names.contains(get_backward_kernel_name(forward_name)))
+        {
+            std::stringstream ss;
+            ss << "The backward kernel of " << forward_name << " would be named ";
+            ss << get_backward_kernel_name(forward_name) << ", which is already defined.";
+            emit_error(ss.str());
+        }
+    }
+}
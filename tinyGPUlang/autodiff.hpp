@@ -0,0 +1,85 @@
+#pragma once
+
+#include "ast.hpp"
+#include "core.hpp"
+
+/**
+ * Reverse-mode differentiation of per-element expressions.
+ * The adjoint of a node is propagated to its operands
+ * after all of its users have been visited.
+ */
+class AdjointBuilder : public ASTVisitor
+{
+public:
+    explicit AdjointBuilder();
+
+    /**
+     * Adds the adjoint to the one accumulated so far for the node.
+     */
+    void add_adjoint(const ASTNodePtr node, const ASTNodePtr adjoint);
+
+    /**
+     * Propagates the adjoints through the expressions reachable from the roots.
+     */
+    void propagate(const std::vector<ASTNodePtr>& roots);
+
+    /**
+     * Accumulated adjoint of the node, nullptr if it does not contribute to the roots.
+     */
+    ASTNodePtr get_adjoint(const int ast_id) const;
+
+    virtual void apply(KernelNode& node);
+    virtual void apply(KernelCallNode& node);
+
+    virtual void apply(ConstantNode& node);
+    virtual void apply(ScalarNode& node);
+    virtual void apply(TensorNode& node);
+
+    virtual void apply(AddNode& node);
+    virtual void apply(SubNode& node);
+    virtual void apply(MulNode& node);
+    virtual void apply(DivNode& node);
+
+    virtual void apply(AbsNode& node);
+    virtual void apply(SqrtNode& node);
+    virtual void apply(Log2Node& node);
+    virtual void apply(Exp2Node& node);
+
+    virtual void apply(AssignmentNode& node);
+    virtual void apply(AliasNode& node);
+    virtual void apply(ReturnNode& node);
+    virtual void apply(TupleElementNode& node);
+
+    virtual void apply(LoopVarNode& node);
+    virtual void apply(RepeatNode& node);
+
+private:
+    std::unordered_map<int, ASTNodePtr> adjoints;
+
+    ASTNodePtr visited_node;  // the node whose adjoint is propagated
+
+    ASTNodePtr visited_adjoint() const;
+    void emit_unsupported(const std::string& node_name) const;
+};
+
+
+/**
+ * Derives the backward kernel (name_grad) of a global kernel.
+ * Arguments: the forward arguments, then grad_<t> (incoming gradient)
+ * for each assigned tensor t, then grad_<a> (result) for each other tensor a.
+ * The forward values are recomputed in the backward kernel, device kernels
+ * are inlined and repeat blocks unrolled, so no intermediates are stored.
+ * Scalar arguments get no gradient (it would need a reduction over the elements).
+ */
+KernelNodePtr build_backward_kernel(const KernelNodePtr kernel);
+
+/**
+ * The name of the backward kernel of a global kernel (or pipeline).
+ */
+std::string get_backward_kernel_name(const std::string& kernel_name);
+
+/**
+ * Checks that the backward kernels of the global kernels and pipelines
+ * do not take the name of a kernel or pipeline of the source.
+ */
+void check_backward_kernel_names(const std::vector<KernelNodePtr>& kernels, const std::vector<PipelinePtr>& pipelines);
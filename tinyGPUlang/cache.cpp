@@ -0,0 +1,122 @@
+#include "cache.hpp"
+
+// part of every key, changed when the stored ptx of the same source and options changes:
+// 2 numbers the calls in module order (the entries of 1 depend on the threads of the build)
+static constexpr int cache_format = 2;
+
+PTXCache::PTXCache(const std::string& cache_folder, const uint64_t max_cache_size) :
+    cache_folder(cache_folder), max_cache_size(max_cache_size)
+{
+    std::error_code error;
+    std::filesystem::create_directories(cache_folder, error);
+    if (error || !std::filesystem::is_directory(cache_folder))
+    {
+        std::stringstream ss;
+        ss << "Error while creating cache folder ";
+        ss << cache_folder;
+        emit_error(ss.str());
+    }
+}
+
+std::string PTXCache::get_key(const std::string_view source, const std::string_view options_key) const
+{
+    // the sizes separate the two parts
+    std::stringstream ss;
+    ss << "cache " << cache_format << "\n";
+    ss << options_key.size() << ":" << options_key << source.size() << ":" << source;
+    return hash_to_hex(hash_string(ss.str()));
+}
+
+bool PTXCache::restore(const std::string& key, const std::string& ptx_file_path, const std::string& launch_file_path) const
+{
+    // the ptx is written last by store, it marks a complete entry
+    auto ptx_entry_path = get_entry_path(key, "ptx");
+    if (!std::filesystem::exists(ptx_entry_path))
+        return false;
+
+    auto launch_entry_path = get_entry_path(key, "launch");
+    if (std::filesystem::exists(launch_entry_path))
+    {
+        write_file_atomically(launch_file_path, read_file(launch_entry_path));
+    }
+    write_file_atomically(ptx_file_path, read_file(ptx_entry_path));
+
+    // the time of the last use for the eviction
+    std::error_code error;
+    std::filesystem::last_write_time(ptx_entry_path, std::filesystem::file_time_type::clock::now(), error);
+    return true;
+}
+
+void PTXCache::store(const std::string& key, const std::string& ptx_file_path, const std::string& launch_sequence) const
+{
+    if (!launch_sequence.empty())
+    {
+        write_file_atomically(get_entry_path(key, "launch"), launch_sequence);
+    }
+    write_file_atomically(get_entry_path(key, "ptx"), read_file(ptx_file_path));
+
+    evict_entries(key);
+}
+
+std::string PTXCache::get_entry_path(const std::string& key, const std::string& extension) const
+{
+    return (std::filesystem::path(cache_folder) / (key + "." + extension)).string();
+}
+
+void PTXCache::evict_entries(const std::string& kept_key) const
+{
+    struct CacheEntry
+    {
+        uint64_t size = 0;
+        std::filesystem::file_time_type last_use;
+    };
+
+    // <16 hex digits>.ptx and .launch, other files of the folder are not touched
+    std::map<std::string, CacheEntry> entries;  // by the key
+    uint64_t cache_size = 0;
+    std::error_code error;
+    for (auto& dir_entry : std::filesystem::directory_iterator(cache_folder, error))
+    {
+        auto key = dir_entry.path().stem().string();
+        auto extension = dir_entry.path().extension().string();
+        bool is_entry = key.size() == 16 && std::all_of(key.begin(), key.end(), ::isxdigit) && (extension == ".ptx" || extension == ".launch");
+        if (!is_entry)
+            continue;
+
+        uint64_t file_size = dir_entry.file_size(error);
+        if (error)
+            continue;  // removed by another process
+
+        auto& entry = entries[key];
+        entry.size += file_size;
+        cache_size += file_size;
+        if (extension == ".ptx")
+        {
+            entry.last_use = dir_entry.last_write_time(error);
+        }
+    }
+
+    if (cache_size <= max_cache_size)
+        return;
+
+    std::vector<std::pair<std::filesystem::file_time_type, std::string>> entries_by_use;
+    for (auto& [key, entry] : entries)
+    {
+        entries_by_use.push_back({entry.last_use, key});
+    }
+    std::sort(entries_by_use.begin(), entries_by_use.end());
+
+    for (auto& [last_use, key] : entries_by_use)
+    {
+        if (cache_size <= max_cache_size)
+            break;
+
+        if (key == kept_key)
+            continue;
+
+        // the ptx first, a launch file alone is not an entry
+        std::filesystem::remove(get_entry_path(key, "ptx"), error);
+        std::filesystem::remove(get_entry_path(key, "launch"), error);
+        cache_size -= entries.at(key).size;
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "core.hpp"
+
+/**
+ * Content-addressed cache of the outputs of whole compilations: the ptx and the launch
+ * sequence are kept in a folder by the hash of the source and of the options (<key>.ptx, <key>.launch).
+ * The files are written atomically, several tglc processes can share the folder.
+ * Above the size limit the least recently used entries are removed.
+ */
+class PTXCache
+{
+public:
+    /**
+     * @param cache_folder created if it does not exist
+     * @param max_cache_size bytes of the entries kept in the folder
+     */
+    explicit PTXCache(const std::string& cache_folder, const uint64_t max_cache_size);
+
+    /**
+     * The key of the compilation.
+     * @param options_key the options changing the outputs, in a fixed order
+     */
+    std::string get_key(const std::string_view source, const std::string_view options_key) const;
+
+    /**
+     * Copies the cached outputs of the key into the files, false if there is no entry.
+     * The launch file is written only if the entry has a launch sequence.
+     */
+    bool restore(const std::string& key, const std::string& ptx_file_path, const std::string& launch_file_path) const;
+
+    /**
+     * Adds the ptx file (and the launch sequence) as the entry of the key, then evicts
+     * the least recently used entries above the size limit.
+     */
+    void store(const std::string& key, const std::string& ptx_file_path, const std::string& launch_sequence) const;
+
+private:
+    std::string cache_folder;
+    uint64_t max_cache_size;
+
+    std::string get_entry_path(const std::string& key, const std::string& extension) const;
+
+    /**
+     * Removes the oldest entries (by the time of the last use) until the folder fits
+     * into the size limit, the entry of the key is kept.
+     */
+    void evict_entries(const std::string& kept_key) const;
+};
@@ -1,46 +1,117 @@
 #include "codegen.hpp"
+#include "transforms.hpp"
 #include "llvm/IR/IntrinsicsNVPTX.h"
+#include "llvm/IR/CFG.h"
 
-PTXGenerator::PTXGenerator()
+/**
+ * Initializes the target registry etc. once, the generators
+ * of different threads share it.
+ */
+static void initialize_targets()
+{
+    static std::once_flag is_initialized;
+    std::call_once(is_initialized, []()
+    {
+        llvm::InitializeAllTargetInfos();
+        llvm::InitializeAllTargets();
+        llvm::InitializeAllTargetMCs();
+        llvm::InitializeAllAsmParsers();
+        llvm::InitializeAllAsmPrinters();
+    });
+}
+
+PTXGenerator::PTXGenerator(std::ostream& log) : log(log)
 {
     compiler_state = std::make_shared<LLVMState>();
 
     // state related initialization
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllAsmParsers();
-    llvm::InitializeAllAsmPrinters();
+    initialize_targets();
 
     compiler_state->context = std::make_unique<llvm::LLVMContext>();
     compiler_state->ir_builder = std::make_unique<llvm::IRBuilder<>>(*compiler_state->context);
     compiler_state->gmodule = std::make_unique<llvm::Module>("TGLC", *compiler_state->context);
 }
 
-static llvm::Type* get_llvm_type_of_variable(std::unique_ptr<llvm::LLVMContext>& ctx, const VariableNodePtr var)
+static llvm::Type* get_llvm_type_of_dtype(std::unique_ptr<llvm::LLVMContext>& ctx, const DataType dtype)
 {
-    llvm::Type *var_type = nullptr;
-    if (var->vtype == VariableType::SCALAR)
+    llvm::Type* f32_type = llvm::Type::getFloatTy(*ctx);
+
+    int num_lanes = get_num_lanes(dtype);
+    if (num_lanes > 1)  // short vector values are kept in vector registers
     {
-        if (var->dtype == DataType::FLOAT32)
-        {
-            var_type = llvm::Type::getFloatTy(*ctx);
-        }
+        return llvm::FixedVectorType::get(f32_type, num_lanes);
     }
-    else
+    return f32_type;
+}
+
+/**
+ * Device kernels with tensor arguments receive the
+ * element index from the caller (last argument).
+ */
+static bool takes_element_index(const KernelNode& kernel)
+{
+    if (kernel.scope != KernelScope::DEVICE)
+        return false;
+
+    return std::any_of(kernel.arguments.begin(), kernel.arguments.end(),
+        [](const VariableNodePtr& arg) { return arg->vtype == VariableType::TENSOR; });
+}
+
+static llvm::Type* get_llvm_type_of_variable(std::unique_ptr<llvm::LLVMContext>& ctx, const VariableNodePtr var)
+{
+    llvm::Type *var_type = get_llvm_type_of_dtype(ctx, var->dtype);
+    if (var->vtype == VariableType::TENSOR)
     {
-        if (var->dtype == DataType::FLOAT32)
-        {
-            var_type = llvm::PointerType::get(llvm::Type::getFloatTy(*ctx), 1U);  // address space is 1, refers to global memory in gpu
-        }
+        var_type = llvm::PointerType::get(var_type, 1U);  // address space is 1, refers to global memory in gpu
     }
     return var_type;
 }
 
-void PTXGenerator::build_ir_from_kernel(const KernelNodePtr kernel)
+/**
+ * Marks the function as a global kernel (nvvm annotation).
+ */
+static void annotate_global_kernel(std::shared_ptr<LLVMState> compiler_state, llvm::Function* kernel_llvm_fn)
 {
     auto& ctx = compiler_state->context;
-    auto& irb = compiler_state->ir_builder;
     auto& lmod = compiler_state->gmodule;
 
+    std::vector<llvm::Metadata*> metadata_fields =
+    {
+        llvm::ValueAsMetadata::get(kernel_llvm_fn),
+        llvm::MDString::get(*ctx, "kernel"),
+        llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(llvm::Type::getInt32Ty(*ctx), 1))
+    };
+
+    llvm::NamedMDNode* nnvm_meta_node = lmod->getOrInsertNamedMetadata("nvvm.annotations");
+    nnvm_meta_node->addOperand(llvm::MDNode::get(*ctx, metadata_fields));
+}
+
+AsyncCopy select_async_copy(const std::string& sm_xx)
+{
+    // sm_86 -> 86, sm_90a -> 90
+    int sm_version = 0;
+    if (sm_xx.starts_with("sm_"))
+    {
+        std::string digits = sm_xx.substr(3);
+        digits.erase(std::find_if(digits.begin(), digits.end(), [](char c) { return !std::isdigit(c); }), digits.end());
+        sm_version = digits.empty() ? 0 : std::stoi(digits);
+    }
+
+    if (sm_version < 80)
+    {
+        std::stringstream ss;
+        ss << "Asynchronous copies require sm_80 or newer (--sm 80), the target is ";
+        ss << (sm_xx.empty() ? "the llvm default" : sm_xx) << ".";
+        emit_error(ss.str());
+    }
+    return sm_version >= 90 ? AsyncCopy::BULK_COPY : AsyncCopy::CP_ASYNC;
+}
+
+void PTXGenerator::build_ir_from_kernel(const KernelNodePtr kernel, const int elems_per_thread, const AsyncCopy async_copy)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+
     /*
         The function to be defined
     */
@@ -53,10 +124,24 @@ void PTXGenerator::build_ir_from_kernel(const KernelNodePtr kernel)
         arg_types.push_back(arg_type);
     }
 
+    if (takes_element_index(*kernel))
+    {
+        arg_types.push_back(llvm::Type::getInt32Ty(*ctx));
+    }
+
     llvm::Type* ret_type = nullptr;
-    if (kernel->return_value)
+    if (kernel->return_values.size() == 1)
+    {
+        ret_type = get_llvm_type_of_variable(ctx, kernel->return_values[0]);
+    }
+    else if (kernel->return_values.size() > 1)  // several values are returned in a struct
     {
-        ret_type = get_llvm_type_of_variable(ctx, kernel->return_value);
+        std::vector<llvm::Type*> element_types;
+        for (auto ret : kernel->return_values)
+        {
+            element_types.push_back(get_llvm_type_of_variable(ctx, ret));
+        }
+        ret_type = llvm::StructType::get(*ctx, element_types);
     }
     else  // void
     {
@@ -80,61 +165,300 @@ void PTXGenerator::build_ir_from_kernel(const KernelNodePtr kernel)
     irb->SetInsertPoint(BB);
     
     // insert values
-    std::unordered_map<int, llvm::Value*> values;
-    for (int ix = 0; ix < kernel_llvm_fn->arg_size(); ++ix)
+    ValueTable values(index_kernel_values(*kernel));
+    for (int ix = 0; ix < kernel->arguments.size(); ++ix)
     {
-        values.insert({kernel->arguments[ix]->ast_id, kernel_llvm_fn->getArg(ix)});
+        values.insert(*kernel->arguments[ix], kernel_llvm_fn->getArg(ix));
     }
 
     // build IR for the ASTNodes from the kernel body
-    NVIRBuilder builder(compiler_state, defined_functions, values);
+    NVIRBuilder builder(compiler_state, defined_functions, values, elems_per_thread, async_copy);
     kernel->accept(builder);
+
+    uses_bulk_copies = uses_bulk_copies || (async_copy == AsyncCopy::BULK_COPY && kernel->scope == KernelScope::GLOBAL);
     
     // if the kernel is global, annotation is required
     if (kernel->scope == KernelScope::GLOBAL)
     {
-        std::vector<llvm::Metadata*> metadata_fields =
+        annotate_global_kernel(compiler_state, kernel_llvm_fn);
+    }
+
+    log << "Kernel was built in IR " << func_name << "\n";
+}
+
+std::string PTXGenerator::build_ir_from_kernel_group(const std::string& group_name, const std::vector<KernelNodePtr>& kernels)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+    auto& lmod = compiler_state->gmodule;
+
+    auto* i32_type = llvm::Type::getInt32Ty(*ctx);
+
+    if (defined_functions.contains(group_name))
+    {
+        std::stringstream ess;
+        ess << "Kernel group " << group_name << " has the name of an existing kernel.";
+        emit_error(ess.str());
+    }
+
+    std::stringstream ss;
+    ss << group_name << ": horizontal fusion, the same block size for all, ";
+    ss << "blocks = sum of ceil(n_<kernel> / block size)\n";
+
+    // the arguments of the kernels one after the other, then the element counts
+    std::vector<llvm::Type*> arg_types;
+    std::vector<int> first_args;
+    for (auto& kernel : kernels)
+    {
+        if (kernel->scope != KernelScope::GLOBAL)
+        {
+            std::stringstream ess;
+            ess << "Only global kernels can be fused horizontally, " << kernel->name << " is not.";
+            emit_error(ess.str());
+        }
+
+        first_args.push_back(static_cast<int>(arg_types.size()));
+        for (auto& arg : kernel->arguments)
+        {
+            arg_types.push_back(get_llvm_type_of_variable(ctx, arg));
+        }
+    }
+    int first_count_arg = static_cast<int>(arg_types.size());
+    arg_types.insert(arg_types.end(), kernels.size(), i32_type);
+
+    llvm::FunctionType* func_type = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(*ctx), arg_types, false);
+
+    auto* group_llvm_fn = llvm::Function::Create(
+        func_type,
+        llvm::Function::ExternalLinkage,
+        group_name,
+        lmod.get()
+    );
+
+    defined_functions.insert({group_name, group_llvm_fn});
+
+    llvm::BasicBlock* BB = llvm::BasicBlock::Create(*ctx, "entry", group_llvm_fn);
+    irb->SetInsertPoint(BB);
+
+    auto* tid = irb->CreateIntrinsic(i32_type, llvm::Intrinsic::nvvm_read_ptx_sreg_tid_x, {});
+    auto* ntid = irb->CreateIntrinsic(i32_type, llvm::Intrinsic::nvvm_read_ptx_sreg_ntid_x, {});
+    auto* ctaid = irb->CreateIntrinsic(i32_type, llvm::Intrinsic::nvvm_read_ptx_sreg_ctaid_x, {});
+
+    auto* exit_bb = llvm::BasicBlock::Create(*ctx, "exit", group_llvm_fn);
+
+    // kernel k runs on the blocks [first_block, first_block + ceil(n_k / ntid))
+    llvm::Value* first_block = llvm::ConstantInt::get(i32_type, 0);
+    for (size_t k = 0; k < kernels.size(); ++k)
+    {
+        auto& kernel = kernels[k];
+        auto* num_elems = group_llvm_fn->getArg(first_count_arg + k);
+
+        auto* num_blocks = irb->CreateUDiv(irb->CreateAdd(num_elems, irb->CreateSub(ntid, llvm::ConstantInt::get(i32_type, 1))), ntid);
+        auto* end_block = irb->CreateAdd(first_block, num_blocks);
+
+        auto* range_bb = llvm::BasicBlock::Create(*ctx, kernel->name + ".range", group_llvm_fn);
+        auto* body_bb = llvm::BasicBlock::Create(*ctx, kernel->name, group_llvm_fn);
+        auto* next_bb = llvm::BasicBlock::Create(*ctx, "dispatch", group_llvm_fn);
+        irb->CreateCondBr(irb->CreateICmpULT(ctaid, end_block), range_bb, next_bb);
+
+        // the last block of the range can be partial
+        irb->SetInsertPoint(range_bb);
+        auto* elem = irb->CreateAdd(irb->CreateMul(irb->CreateSub(ctaid, first_block), ntid), tid);
+        irb->CreateCondBr(irb->CreateICmpULT(elem, num_elems), body_bb, exit_bb);
+
+        irb->SetInsertPoint(body_bb);
+        ValueTable values(index_kernel_values(*kernel));
+        for (int ix = 0; ix < kernel->arguments.size(); ++ix)
         {
-            llvm::ValueAsMetadata::get(kernel_llvm_fn),
-            llvm::MDString::get(*ctx, "kernel"),
-            llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(llvm::Type::getInt32Ty(*ctx), 1))
-        };
+            values.insert(*kernel->arguments[ix], group_llvm_fn->getArg(first_args[k] + ix));
+        }
+
+        NVIRBuilder builder(compiler_state, defined_functions, values);
+        builder.set_element_index(elem);
+        kernel->accept(builder);  // the body ends with a return
 
-        llvm::NamedMDNode* nnvm_meta_node = lmod->getOrInsertNamedMetadata("nvvm.annotations");
-        nnvm_meta_node->addOperand(llvm::MDNode::get(*ctx, metadata_fields));
+        irb->SetInsertPoint(next_bb);
+        first_block = end_block;
+
+        ss << "    " << kernel->name << "(";
+        for (int ix = 0; ix < kernel->arguments.size(); ++ix)
+        {
+            ss << (ix > 0 ? ", " : "") << first_args[k] + ix << ": " << kernel->arguments[ix]->name;
+        }
+        ss << "), " << first_count_arg + k << ": n_" << kernel->name << "\n";
     }
+    irb->CreateBr(exit_bb);
+
+    irb->SetInsertPoint(exit_bb);
+    irb->CreateRetVoid();
 
-    std::cout << "Kernel was built in IR " << func_name << "\n";
+    annotate_global_kernel(compiler_state, group_llvm_fn);
+
+    log << "Kernel group was built in IR " << group_name << "\n";
+    return ss.str();
 }
 
-void PTXGenerator::generate_ptx(const std::string& ptx_file, const std::string& sm_xx, const bool save_temps)
+std::string PTXGenerator::build_ir_from_multi_tensor_kernel(const KernelNodePtr kernel)
 {
-    // Initialize the target registry etc.
-    llvm::InitializeAllTargetInfos();
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllTargetMCs();
-    llvm::InitializeAllAsmParsers();
-    llvm::InitializeAllAsmPrinters();
-    
-    if (save_temps)
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+    auto& lmod = compiler_state->gmodule;
+
+    auto* i32_type = llvm::Type::getInt32Ty(*ctx);
+    std::string func_name = kernel->name + "_multi";
+
+    if (kernel->scope != KernelScope::GLOBAL)
     {
-        auto ll_file_path = replace_extension(ptx_file, "ll");
-        std::ofstream ll_file(ll_file_path);
+        std::stringstream ss;
+        ss << "Only global kernels have a multi-tensor variant, " << kernel->name << " is not.";
+        emit_error(ss.str());
+    }
 
-        if (!ll_file)
+    // a chunk of the table: the pointers of the tensor arguments, then the number of elements
+    std::vector<VariableNodePtr> tensor_args;
+    std::vector<VariableNodePtr> scalar_args;
+    std::vector<llvm::Type*> chunk_fields;
+    for (auto& arg : kernel->arguments)
+    {
+        if (arg->vtype == VariableType::TENSOR)
         {
-            std::stringstream ss;
-            ss << "Error while opening ll file ";
-            ss << ll_file_path;
-            emit_error(ss.str());
+            tensor_args.push_back(arg);
+            chunk_fields.push_back(get_llvm_type_of_variable(ctx, arg));
         }
-
-        llvm::raw_os_ostream llvm_ostream(ll_file);
-        for (auto& name_func : defined_functions)
+        else
         {
-            name_func.second->print(llvm_ostream);
+            scalar_args.push_back(arg);
         }
     }
+    chunk_fields.push_back(i32_type);
+    auto* chunk_type = llvm::StructType::get(*ctx, chunk_fields);
+
+    std::vector<llvm::Type*> arg_types = {llvm::PointerType::get(chunk_type, 1U)};
+    for (auto& arg : scalar_args)
+    {
+        arg_types.push_back(get_llvm_type_of_variable(ctx, arg));
+    }
+
+    llvm::FunctionType* func_type = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(*ctx), arg_types, false);
+
+    auto* multi_llvm_fn = llvm::Function::Create(
+        func_type,
+        llvm::Function::ExternalLinkage,
+        func_name,
+        lmod.get()
+    );
+
+    defined_functions.insert({func_name, multi_llvm_fn});
+
+    llvm::BasicBlock* BB = llvm::BasicBlock::Create(*ctx, "entry", multi_llvm_fn);
+    irb->SetInsertPoint(BB);
+
+    // each block processes the chunk at its block index
+    auto* tid = irb->CreateIntrinsic(i32_type, llvm::Intrinsic::nvvm_read_ptx_sreg_tid_x, {});
+    auto* ctaid = irb->CreateIntrinsic(i32_type, llvm::Intrinsic::nvvm_read_ptx_sreg_ctaid_x, {});
+    auto* chunk = irb->CreateGEP(chunk_type, multi_llvm_fn->getArg(0), ctaid);
+
+    ValueTable values(index_kernel_values(*kernel));
+    for (int ix = 0; ix < tensor_args.size(); ++ix)
+    {
+        auto* ptr_field = irb->CreateStructGEP(chunk_type, chunk, ix);
+        values.insert(*tensor_args[ix], irb->CreateLoad(chunk_fields[ix], ptr_field));
+    }
+    for (int ix = 0; ix < scalar_args.size(); ++ix)
+    {
+        values.insert(*scalar_args[ix], multi_llvm_fn->getArg(ix + 1));
+    }
+
+    auto* len_field = irb->CreateStructGEP(chunk_type, chunk, tensor_args.size());
+    auto* chunk_len = irb->CreateLoad(i32_type, len_field);
+
+    auto* body_bb = llvm::BasicBlock::Create(*ctx, "body", multi_llvm_fn);
+    auto* exit_bb = llvm::BasicBlock::Create(*ctx, "exit", multi_llvm_fn);
+    irb->CreateCondBr(irb->CreateICmpULT(tid, chunk_len), body_bb, exit_bb);
+
+    irb->SetInsertPoint(exit_bb);
+    irb->CreateRetVoid();
+
+    irb->SetInsertPoint(body_bb);
+    NVIRBuilder builder(compiler_state, defined_functions, values);
+    builder.set_element_index(tid);
+    kernel->accept(builder);  // the body ends with a return
+
+    annotate_global_kernel(compiler_state, multi_llvm_fn);
+
+    std::stringstream ss;
+    ss << func_name << ": multi-tensor apply of " << kernel->name << ", one chunk per block, ";
+    ss << "chunk elements <= block size\n";
+    ss << "    chunk {";
+    for (auto& arg : tensor_args)
+    {
+        ss << "ptr " << arg->name << ", ";
+    }
+    ss << "i32 length}\n";
+    ss << "    " << func_name << "(chunk table";
+    for (auto& arg : scalar_args)
+    {
+        ss << ", " << arg->name;
+    }
+    ss << ")\n";
+
+    log << "Multi-tensor kernel was built in IR " << func_name << "\n";
+    return ss.str();
+}
+
+/**
+ * Opens the .ll file next to the ptx file.
+ */
+static std::ofstream open_ll_file(const std::string& ptx_file)
+{
+    auto ll_file_path = replace_extension(ptx_file, "ll");
+    std::ofstream ll_file(ll_file_path);
+
+    if (!ll_file)
+    {
+        std::stringstream ss;
+        ss << "Error while opening ll file ";
+        ss << ll_file_path;
+        emit_error(ss.str());
+    }
+    return ll_file;
+}
+
+static void write_ptx_file(const std::string& ptx_file, const std::string& ptx_code)
+{
+    std::error_code EC;
+    llvm::raw_fd_ostream dest(ptx_file, EC, llvm::sys::fs::OF_None);
+
+    if (EC) 
+    {
+        std::stringstream ss;
+        ss << "Could not open file: ";
+        ss << EC.message();
+        emit_error(ss.str());
+    }
+
+    dest << ptx_code;
+    dest.flush();
+}
+
+void PTXGenerator::generate_ptx(const std::string& ptx_file, const std::string& sm_xx, const bool save_temps)
+{
+    if (save_temps)
+    {
+        auto ll_file = open_ll_file(ptx_file);
+        print_ir(ll_file);
+    }
+
+    write_ptx_file(ptx_file, generate_ptx_code(sm_xx, uses_bulk_copies));
+
+    log << "Ptx was generated into " << ptx_file << "\n";
+}
+
+std::string PTXGenerator::generate_ptx_code(const std::string& sm_xx, const bool uses_bulk_copies)
+{
+    initialize_targets();
 
     auto target_triple = "nvptx64-nvidia-cuda";
 
@@ -144,95 +468,1125 @@ void PTXGenerator::generate_ptx(const std::string& ptx_file, const std::string&
     // Print an error and exit if we couldn't find the requested target.
     // This generally occurs if we've forgotten to initialise the
     // TargetRegistry or we have a bogus target triple.
-    if (!target) {
-        llvm::errs() << Error;
-        return;
+    if (!target) 
+    {
+        std::stringstream ss;
+        ss << "Could not find the nvptx target: ";
+        ss << Error;
+        emit_error(ss.str());
+    }
+
+    // this will make possible to use the right intrinsics when possible
+    auto CPU = sm_xx;  // to set the sm version (https://reviews.llvm.org/D141054)
+    auto Features = uses_bulk_copies ? "+ptx80" : "";
+
+    llvm::TargetOptions opt;
+    auto RM = std::optional<llvm::Reloc::Model>();
+    
+    std::unique_ptr<llvm::TargetMachine> nv_target_machine(target->createTargetMachine(
+        target_triple, CPU, Features, opt, RM));
+
+    compiler_state->gmodule->setDataLayout(nv_target_machine->createDataLayout());
+
+    llvm::SmallString<0> ptx_code;
+    llvm::raw_svector_ostream dest(ptx_code);
+
+    llvm::legacy::PassManager pass;
+    auto FileType = llvm::CodeGenFileType::AssemblyFile;
+
+    if (nv_target_machine->addPassesToEmitFile(pass, dest, nullptr, FileType)) 
+    {
+        std::stringstream ss;
+        ss << "nv_target_machine can't emit a file of this type";
+        emit_error(ss.str());
+    }
+
+    pass.run(*compiler_state->gmodule);
+
+    // the calls are numbered from 0 in each module, the code of a module does not depend on the process building it
+    int first_call_seq = 0;
+    return renumber_call_sequences(ptx_code.str(), first_call_seq);
+}
+
+void PTXGenerator::print_ir(std::ostream& os) const
+{
+    // in the order of the module (as in the ptx), the map of the functions has no fixed order
+    llvm::raw_os_ostream llvm_ostream(os);
+    for (auto& func : compiler_state->gmodule->functions())
+    {
+        if (!func.isDeclaration())
+        {
+            func.print(llvm_ostream);
+        }
+    }
+}
+
+/**
+ * Backward liveness over the blocks, iterated until nothing changes.
+ * The incoming values of a phi are live at the end of the predecessor only.
+ */
+static int calc_max_live_values(llvm::Function& func)
+{
+    auto is_tracked = [](llvm::Value* val)
+    {
+        return (llvm::isa<llvm::Instruction>(val) || llvm::isa<llvm::Argument>(val)) && !val->getType()->isVoidTy();
+    };
+
+    std::unordered_map<llvm::BasicBlock*, std::unordered_set<llvm::Value*>> live_ins;
+    int max_live = 0;
+
+    auto scan_block = [&](llvm::BasicBlock& block) -> std::unordered_set<llvm::Value*>
+    {
+        std::unordered_set<llvm::Value*> live;
+        for (auto* succ : llvm::successors(&block))
+        {
+            for (auto* val : live_ins[succ])
+            {
+                auto* phi = llvm::dyn_cast<llvm::PHINode>(val);
+                if (!phi || phi->getParent() != succ)
+                    live.insert(val);
+            }
+            for (auto& phi : succ->phis())
+            {
+                auto* incoming = phi.getIncomingValueForBlock(&block);
+                if (is_tracked(incoming))
+                    live.insert(incoming);
+            }
+        }
+        max_live = std::max(max_live, static_cast<int>(live.size()));
+
+        for (auto it = block.rbegin(); it != block.rend(); ++it)
+        {
+            live.erase(&*it);
+            if (!llvm::isa<llvm::PHINode>(*it))
+            {
+                for (auto& operand : it->operands())
+                {
+                    if (is_tracked(operand.get()))
+                        live.insert(operand.get());
+                }
+            }
+            max_live = std::max(max_live, static_cast<int>(live.size()));
+        }
+
+        // the phis of the block are defined at its start
+        for (auto& phi : block.phis())
+        {
+            live.insert(&phi);
+        }
+        return live;
+    };
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (auto& block : llvm::reverse(func))
+        {
+            auto live = scan_block(block);
+            if (live != live_ins[&block])
+            {
+                live_ins[&block] = live;
+                changed = true;
+            }
+        }
+    }
+
+    return max_live;
+}
+
+int PTXGenerator::get_max_live_values(const std::string& kernel_name) const
+{
+    return calc_max_live_values(*defined_functions.at(kernel_name));
+}
+
+std::vector<CodegenUnit> split_into_codegen_units(
+    const std::vector<KernelNodePtr>& kernels,
+    const std::vector<std::pair<std::string, std::vector<KernelNodePtr>>>& kernel_groups,
+    const std::vector<KernelNodePtr>& multi_tensor_kernels)
+{
+    // the root is the first kernel of the unit
+    DisjointSets kernel_sets(static_cast<int>(kernels.size()));
+
+    std::unordered_map<const KernelNode*, int> kernel_indices;
+    for (int ix = 0; ix < kernels.size(); ++ix)
+    {
+        kernel_indices.insert({kernels[ix].get(), ix});
+    }
+
+    // the value indices are stored in the nodes, a node is built only in one unit
+    std::unordered_map<const ASTNode*, int> node_kernels;
+    for (int ix = 0; ix < kernels.size(); ++ix)
+    {
+        std::vector<ASTNodePtr> roots(kernels[ix]->arguments.begin(), kernels[ix]->arguments.end());
+        roots.insert(roots.end(), kernels[ix]->body.begin(), kernels[ix]->body.end());
+
+        for_each_reachable_node(roots, [&](const ASTNodePtr& node)
+        {
+            auto [node_kernel, inserted] = node_kernels.try_emplace(node.get(), ix);
+            if (!inserted)
+            {
+                kernel_sets.unite(node_kernel->second, ix);
+            }
+
+            if (node->kind == NodeKind::KERNEL_CALL)
+            {
+                auto callee = kernel_indices.find(static_cast<const KernelCallNode&>(*node).kernel.get());
+                if (callee != kernel_indices.end())
+                {
+                    kernel_sets.unite(callee->second, ix);
+                }
+            }
+        });
+    }
+
+    for (auto& [group_name, group_kernels] : kernel_groups)
+    {
+        bool is_defined = std::any_of(kernels.begin(), kernels.end(),
+            [&](const KernelNodePtr& kernel) { return kernel->name == group_name; });
+        if (is_defined)
+        {
+            std::stringstream ss;
+            ss << "Kernel group " << group_name << " has the name of an existing kernel.";
+            emit_error(ss.str());
+        }
+
+        for (auto& kernel : group_kernels)
+        {
+            kernel_sets.unite(kernel_indices.at(group_kernels[0].get()), kernel_indices.at(kernel.get()));
+        }
     }
 
-    // this will make possible to use the right intrinsics when possible
-    auto CPU = sm_xx;  // to set the sm version (https://reviews.llvm.org/D141054)
-    auto Features = "";
+    std::vector<CodegenUnit> units;
+    std::vector<int> unit_indices(kernels.size(), -1);  // by the root kernel
+    for (int ix = 0; ix < kernels.size(); ++ix)
+    {
+        int root = kernel_sets.find_root(ix);
+        if (unit_indices[root] < 0)
+        {
+            unit_indices[root] = static_cast<int>(units.size());
+            units.emplace_back();
+        }
+        units[unit_indices[root]].kernels.push_back(kernels[ix]);
+    }
+
+    for (int ix = 0; ix < kernel_groups.size(); ++ix)
+    {
+        int root = kernel_sets.find_root(kernel_indices.at(kernel_groups[ix].second[0].get()));
+        units[unit_indices[root]].kernel_groups.push_back(ix);
+    }
+
+    for (int ix = 0; ix < multi_tensor_kernels.size(); ++ix)
+    {
+        int root = kernel_sets.find_root(kernel_indices.at(multi_tensor_kernels[ix].get()));
+        units[unit_indices[root]].multi_tensor_kernels.push_back(ix);
+    }
+
+    if (units.empty())  // the ptx file still gets its header
+    {
+        units.emplace_back();
+    }
+    return units;
+}
+
+std::string_view remove_ptx_header(const std::string_view ptx_code)
+{
+    size_t header_end = ptx_code.find('\n', ptx_code.find(".address_size"));
+    return header_end == std::string_view::npos ? ptx_code : ptx_code.substr(header_end + 1);
+}
+
+std::string renumber_call_sequences(const std::string_view ptx_code, int& next_call_seq)
+{
+    // "{ // callseq N, 0" opens a call and "} // callseq N" closes it
+    constexpr std::string_view marker = "// callseq ";
+    std::unordered_map<std::string_view, int> call_seqs;  // by the number of llvm
+    std::string renumbered_code;
+    renumbered_code.reserve(ptx_code.size());
+
+    size_t pos = 0;
+    for (size_t marker_pos = ptx_code.find(marker); marker_pos != std::string_view::npos; marker_pos = ptx_code.find(marker, pos))
+    {
+        size_t number_pos = marker_pos + marker.size();
+        size_t number_end = number_pos;
+        while (number_end < ptx_code.size() && ::isdigit(ptx_code[number_end]))
+        {
+            ++number_end;
+        }
+
+        renumbered_code.append(ptx_code, pos, number_pos - pos);
+        auto [it, is_new] = call_seqs.emplace(ptx_code.substr(number_pos, number_end - number_pos), next_call_seq);
+        if (is_new)
+        {
+            ++next_call_seq;
+        }
+        renumbered_code += std::to_string(it->second);
+        pos = number_end;
+    }
+    renumbered_code.append(ptx_code, pos);
+    return renumbered_code;
+}
+
+bool needs_bulk_copies(const std::vector<KernelNodePtr>& kernels, const AsyncCopy async_copy)
+{
+    return async_copy == AsyncCopy::BULK_COPY && std::any_of(kernels.begin(), kernels.end(),
+        [](const KernelNodePtr& kernel) { return kernel->scope == KernelScope::GLOBAL; });
+}
+
+void generate_ptx(
+    const std::vector<std::unique_ptr<PTXGenerator>>& ptx_generators,
+    ThreadPool& thread_pool,
+    const std::string& ptx_file,
+    const std::string& sm_xx,
+    const bool save_temps,
+    const bool uses_bulk_copies,
+    std::vector<std::string>& module_codes)
+{
+    if (save_temps)
+    {
+        auto ll_file = open_ll_file(ptx_file);
+        for (auto& ptx_generator : ptx_generators)
+        {
+            ptx_generator->print_ir(ll_file);
+        }
+    }
+
+    // the modules are in the same ptx file, their ptx version has to be the same
+    thread_pool.parallel_for(static_cast<int>(ptx_generators.size()), [&](const int ix)
+    {
+        if (module_codes[ix].empty())
+        {
+            module_codes[ix] = ptx_generators[ix]->generate_ptx_code(sm_xx, uses_bulk_copies);
+        }
+    });
+
+    // the header is kept only from the first module, the calls are numbered in the order of the modules
+    std::string ptx_code;
+    int next_call_seq = 0;
+    for (int ix = 0; ix < module_codes.size(); ++ix)
+    {
+        ptx_code += renumber_call_sequences(ix == 0 ? module_codes[ix] : remove_ptx_header(module_codes[ix]), next_call_seq);
+    }
+
+    write_ptx_file(ptx_file, ptx_code);
+
+    std::cout << "Ptx was generated into " << ptx_file << "\n";
+}
+
+int index_kernel_values(const KernelNode& kernel)
+{
+    // a node is indexed, if its index points back to it
+    std::vector<ASTNode*> indexed_nodes;
+    auto index_node = [&](ASTNode* node)
+    {
+        int ix = node->value_index;
+        if (ix >= 0 && ix < indexed_nodes.size() && indexed_nodes[ix] == node)
+            return false;
+
+        node->value_index = static_cast<int>(indexed_nodes.size());
+        indexed_nodes.push_back(node);
+        return true;
+    };
+
+    for (auto& arg : kernel.arguments)
+    {
+        index_node(arg.get());
+    }
+
+    std::vector<ASTNode*> work_list;
+    for (auto& ast_node : kernel.body)
+    {
+        work_list.push_back(ast_node.get());
+    }
+
+    auto push = [&](const ASTNodePtr& node)
+    {
+        if (node)
+            work_list.push_back(node.get());
+    };
+
+    while (!work_list.empty())
+    {
+        auto* node = work_list.back();
+        work_list.pop_back();
+
+        if (!index_node(node))
+            continue;
+
+        switch (node->kind)
+        {
+        case NodeKind::ADD:
+        case NodeKind::SUB:
+        case NodeKind::MUL:
+        case NodeKind::DIV:
+            push(static_cast<BinaryNode*>(node)->lhs);
+            push(static_cast<BinaryNode*>(node)->rhs);
+            break;
+
+        case NodeKind::ABS:
+        case NodeKind::SQRT:
+        case NodeKind::LOG2:
+        case NodeKind::EXP2:
+            push(static_cast<UnaryNode*>(node)->x);
+            break;
+
+        case NodeKind::KERNEL_CALL:
+            for (auto& arg : static_cast<KernelCallNode*>(node)->arguments)
+                push(arg);
+            break;
+
+        case NodeKind::ASSIGNMENT:
+            push(static_cast<AssignmentNode*>(node)->trg);
+            push(static_cast<AssignmentNode*>(node)->src);
+            break;
+
+        case NodeKind::ALIAS:
+            push(static_cast<AliasNode*>(node)->src);
+            break;
+
+        case NodeKind::RETURN:
+            for (auto& ret : static_cast<ReturnNode*>(node)->return_values)
+                push(ret);
+            break;
+
+        case NodeKind::TUPLE_ELEMENT:
+            push(static_cast<TupleElementNode*>(node)->tuple);
+            break;
+
+        case NodeKind::LOOP_VAR:
+            push(static_cast<LoopVarNode*>(node)->init);
+            push(static_cast<LoopVarNode*>(node)->next);
+            break;
+
+        case NodeKind::REPEAT:
+            for (auto& ast_node : static_cast<RepeatNode*>(node)->body)
+                push(ast_node);
+            for (auto& loop_var : static_cast<RepeatNode*>(node)->loop_vars)
+                push(loop_var);
+            break;
+
+        default:  // constants, variables, the called kernel is indexed on its own
+            break;
+        }
+    }
+
+    return static_cast<int>(indexed_nodes.size());
+}
+
+
+ValueTable::ValueTable(const int num_values) : slots(num_values, nullptr), is_defined(num_values, 0)
+{
+}
+
+bool ValueTable::contains(const ASTNode& node) const
+{
+    return is_defined[node.value_index];
+}
+
+llvm::Value* ValueTable::at(const ASTNode& node) const
+{
+    if (!is_defined[node.value_index])
+    {
+        std::stringstream ss;
+        ss << "The value of node " << node.ast_id << " is used before it is built.";
+        emit_error(ss.str());
+    }
+    return slots[node.value_index];
+}
+
+void ValueTable::insert(const ASTNode& node, llvm::Value* value)
+{
+    if (!is_defined[node.value_index])
+    {
+        insert_or_assign(node, value);
+    }
+}
+
+void ValueTable::insert_or_assign(const ASTNode& node, llvm::Value* value)
+{
+    if (!is_defined[node.value_index])
+    {
+        is_defined[node.value_index] = 1;
+        defined_order.push_back(node.value_index);
+    }
+    slots[node.value_index] = value;
+}
+
+void ValueTable::erase(const ASTNode& node)
+{
+    is_defined[node.value_index] = 0;
+    slots[node.value_index] = nullptr;
+}
+
+int ValueTable::get_num_values() const
+{
+    return static_cast<int>(slots.size());
+}
+
+ValueTable::Checkpoint ValueTable::get_checkpoint() const
+{
+    return {is_defined, defined_order.size()};
+}
+
+void ValueTable::restore(const Checkpoint& checkpoint)
+{
+    // only the nodes defined since the checkpoint can be new
+    for (size_t ix = checkpoint.num_defined_order; ix < defined_order.size(); ++ix)
+    {
+        int value_index = defined_order[ix];
+        if (!checkpoint.is_defined[value_index])
+        {
+            is_defined[value_index] = 0;
+            slots[value_index] = nullptr;
+        }
+    }
+    defined_order.resize(checkpoint.num_defined_order);
+}
+
+
+// IR builder for NVIDIA gpus
+
+NVIRBuilder::NVIRBuilder(
+    std::shared_ptr<LLVMState> compiler_state,
+    const std::unordered_map<std::string, llvm::Function*>& defined_functions,
+    ValueTable& values,
+    const int elems_per_thread,
+    const AsyncCopy async_copy
+    ) : compiler_state(compiler_state), 
+        defined_functions(defined_functions),
+        values(values),
+        loaded_tensors(values.get_num_values()),
+        elems_per_thread(elems_per_thread),
+        async_copy(async_copy)
+{
+
+}
+
+void NVIRBuilder::set_element_index(llvm::Value* idx)
+{
+    preset_elem_idx = idx;
+}
+
+llvm::Value* NVIRBuilder::calc_ptr_from_offset(
+    llvm::Type* ltype, 
+    llvm::Value* ptr,
+    llvm::Value* idx)
+{
+    auto& irb = compiler_state->ir_builder;
+
+    llvm::Value* ptr_element = irb->CreateGEP(ltype, ptr, idx, "ptr");
+    return ptr_element;
+}
+
+llvm::Value* NVIRBuilder::load_operand(const ASTNodePtr& node)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+
+    if (loaded_tensors.contains(*node))  // loaded ahead of the arithmetic
+    {
+        return loaded_tensors.at(*node);
+    }
+
+    auto* value = values.at(*node);
+
+    if (rematerialized_aliases[node->value_index])
+    {
+        // the next use computes it again, instead of keeping the value alive until then
+        // (an alias of a tensor is loaded again, the tensor argument itself is kept)
+        auto& src = static_cast<AliasNode&>(*node).src;
+        values.erase(*node);
+        if (!std::dynamic_pointer_cast<VariableNode>(src))
+        {
+            values.erase(*src);
+        }
+    }
+
+    if (node->kind != NodeKind::TENSOR)
+    {
+        return value;
+    }
+
+    // one (vector) load per element, e.g. ld.global.v4.f32 for f32x4
+    auto* tensor = static_cast<TensorNode*>(node.get());
+    auto* elem_type = get_llvm_type_of_dtype(ctx, tensor->dtype);
+    auto* elem_ptr = calc_ptr_from_offset(elem_type, value, elem_idx);
+    return irb->CreateAlignedLoad(elem_type, elem_ptr, llvm::Align(4 * get_num_lanes(tensor->dtype)));
+}
+
+llvm::Value* NVIRBuilder::promote_value(llvm::Value* val, const DataType from, const DataType to)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+
+    if (from == to || from != DataType::FLOAT32)
+    {
+        return val;
+    }
+
+    if (to == DataType::COMPLEX64)  // real number: (x, 0)
+    {
+        auto* zero = llvm::Constant::getNullValue(get_llvm_type_of_dtype(ctx, to));
+        return irb->CreateInsertElement(zero, val, uint64_t(0));
+    }
+
+    return irb->CreateVectorSplat(get_num_lanes(to), val);
+}
+
+llvm::Value* NVIRBuilder::apply_per_lane(llvm::Value* x_val, const llvm::Intrinsic::ID intrinsic)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+
+    auto* f32_type = llvm::Type::getFloatTy(*ctx);
+
+    auto* vec_type = llvm::dyn_cast<llvm::FixedVectorType>(x_val->getType());
+    if (!vec_type)
+    {
+        return irb->CreateIntrinsic(f32_type, intrinsic, x_val);
+    }
+
+    // the nvvm intrinsics are scalar
+    llvm::Value* ret = llvm::UndefValue::get(vec_type);
+    for (unsigned lane = 0; lane < vec_type->getNumElements(); ++lane)
+    {
+        auto* x_lane = irb->CreateExtractElement(x_val, uint64_t(lane));
+        auto* ret_lane = irb->CreateIntrinsic(f32_type, intrinsic, x_lane);
+        ret = irb->CreateInsertElement(ret, ret_lane, uint64_t(lane));
+    }
+    return ret;
+}
+
+llvm::Value* NVIRBuilder::build_complex_mul(llvm::Value* lhs_val, llvm::Value* rhs_val)
+{
+    auto& irb = compiler_state->ir_builder;
+
+    // (a + bi) * (c + di) = (ac - bd) + (ad + bc)i
+    auto* a = irb->CreateExtractElement(lhs_val, uint64_t(0));
+    auto* b = irb->CreateExtractElement(lhs_val, uint64_t(1));
+    auto* c = irb->CreateExtractElement(rhs_val, uint64_t(0));
+    auto* d = irb->CreateExtractElement(rhs_val, uint64_t(1));
+
+    auto* re = irb->CreateFSub(irb->CreateFMul(a, c), irb->CreateFMul(b, d));
+    auto* im = irb->CreateFAdd(irb->CreateFMul(a, d), irb->CreateFMul(b, c));
+
+    auto* ret = irb->CreateInsertElement(llvm::UndefValue::get(lhs_val->getType()), re, uint64_t(0));
+    return irb->CreateInsertElement(ret, im, uint64_t(1));
+}
+
+llvm::Value* NVIRBuilder::build_complex_div(llvm::Value* lhs_val, llvm::Value* rhs_val)
+{
+    auto& irb = compiler_state->ir_builder;
+
+    // (a + bi) / (c + di) = ((ac + bd) + (bc - ad)i) / (c^2 + d^2)
+    auto* a = irb->CreateExtractElement(lhs_val, uint64_t(0));
+    auto* b = irb->CreateExtractElement(lhs_val, uint64_t(1));
+    auto* c = irb->CreateExtractElement(rhs_val, uint64_t(0));
+    auto* d = irb->CreateExtractElement(rhs_val, uint64_t(1));
+
+    auto* den = irb->CreateFAdd(irb->CreateFMul(c, c), irb->CreateFMul(d, d));
+    auto* re = irb->CreateFAdd(irb->CreateFMul(a, c), irb->CreateFMul(b, d));
+    auto* im = irb->CreateFSub(irb->CreateFMul(b, c), irb->CreateFMul(a, d));
+
+    auto* ret = irb->CreateInsertElement(llvm::UndefValue::get(lhs_val->getType()), irb->CreateFDiv(re, den), uint64_t(0));
+    return irb->CreateInsertElement(ret, irb->CreateFDiv(im, den), uint64_t(1));
+}
+
+std::pair<llvm::Value*, llvm::Value*> NVIRBuilder::get_binary_operands(BinaryNode& node, const std::string& op_name)
+{
+    // while the second operand is built, the first one occupies a register
+    bool rhs_first = register_need.get_need(node.rhs) > register_need.get_need(node.lhs)
+        && register_need.can_reorder(node.lhs) && register_need.can_reorder(node.rhs);
+
+    if (rhs_first)
+    {
+        node.rhs->accept(*this);
+        node.lhs->accept(*this);
+    }
+    else
+    {
+        node.lhs->accept(*this);
+        node.rhs->accept(*this);
+    }
+
+    // x * x is loaded once, a rematerialized alias is released by its first load
+    auto* lhs_val = load_operand(node.lhs);
+    auto* rhs_val = node.rhs == node.lhs ? lhs_val : load_operand(node.rhs);
+
+    if (lhs_val == nullptr || rhs_val == nullptr)
+    {
+        std::stringstream ss;
+        ss << "In " << op_name << " node, one of the operands are nullptr.";
+        emit_error(ss.str());
+    }
+
+    return {lhs_val, rhs_val};
+}
+
+llvm::Value* NVIRBuilder::get_unary_operand(UnaryNode& node, const std::string& op_name)
+{
+    node.x->accept(*this);
+
+    auto* x_val = load_operand(node.x);
+
+    if (x_val == nullptr)
+    {
+        std::stringstream ss;
+        ss << "In " << op_name << " node, the operand is nullptr.";
+        emit_error(ss.str());
+    }
+
+    return x_val;
+}
+
+void NVIRBuilder::apply(KernelNode& node)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+
+    if (preset_elem_idx)
+    {
+        elem_idx = preset_elem_idx;
+    }
+    else if (takes_element_index(node))
+    {
+        elem_idx = irb->GetInsertBlock()->getParent()->getArg(node.arguments.size());
+    }
+    else
+    {
+        elem_idx = irb->CreateIntrinsic(
+            llvm::Type::getInt32Ty(*ctx), 
+            llvm::Intrinsic::nvvm_read_ptx_sreg_tid_x, 
+            {}
+        );
+    }
+
+    rematerialized_aliases = find_rematerialized_aliases(node);
+
+    if (node.scope == KernelScope::GLOBAL)
+    {
+        // uniform values are computed once per thread, ahead of the per-element work
+        UniformityAnalysis uniformity;
+        for (auto& uniform_node : uniformity.find_hoistable_nodes(node))
+        {
+            uniform_node->accept(*this);
+        }
+    }
+
+    if (node.scope == KernelScope::GLOBAL && (elems_per_thread > 1 || async_copy != AsyncCopy::NONE))
+    {
+        build_coarsened_body(node);
+        return;
+    }
+
+    for (auto ast_node : node.body)
+    {
+        ast_node->accept(*this);
+    }
+}
+
+void NVIRBuilder::build_coarsened_body(KernelNode& node)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+
+    auto* i32_type = llvm::Type::getInt32Ty(*ctx);
+    auto* tid = elem_idx;
+    auto* ntid = irb->CreateIntrinsic(i32_type, llvm::Intrinsic::nvvm_read_ptx_sreg_ntid_x, {});
+
+    // element k of a thread is at tid + k * ntid, neighbouring threads access neighbouring elements
+    std::vector<llvm::Value*> elem_indices = {tid};
+    for (int elem = 1; elem < elems_per_thread; ++elem)
+    {
+        elem_indices.push_back(irb->CreateAdd(elem_indices.back(), ntid));
+    }
+
+    // all loads are issued before the arithmetic of any element
+    auto read_only_tensors = find_read_only_tensors(node);
+    std::vector<ValueTable> elem_loads(elems_per_thread, ValueTable(values.get_num_values()));
+    std::vector<std::vector<llvm::Value*>> staged_ptrs;
+    if (async_copy != AsyncCopy::NONE && !read_only_tensors.empty())
+    {
+        staged_ptrs = issue_async_copies(node, read_only_tensors, elem_indices, ntid);
+    }
+    else
+    {
+        for (int elem = 0; elem < elems_per_thread; ++elem)
+        {
+            elem_idx = elem_indices[elem];
+            for (auto& tensor : read_only_tensors)
+            {
+                elem_loads[elem].insert(*tensor, load_operand(tensor));
+            }
+        }
+    }
+
+    auto outer_values = values.get_checkpoint();
+
+    // the body is replicated for each element, the single return closes the kernel
+    for (int elem = 0; elem < elems_per_thread; ++elem)
+    {
+        elem_idx = elem_indices[elem];
+        loaded_tensors = staged_ptrs.empty() ? elem_loads[elem] : wait_for_stage(elem, read_only_tensors, staged_ptrs[elem]);
+
+        for (auto& ast_node : node.body)
+        {
+            if (ast_node->kind != NodeKind::RETURN)
+                ast_node->accept(*this);
+        }
+
+        values.restore(outer_values);
+    }
+
+    loaded_tensors = ValueTable(values.get_num_values());
+    irb->CreateRetVoid();
+}
+
+std::vector<std::vector<llvm::Value*>> NVIRBuilder::issue_async_copies(
+    const KernelNode& node,
+    const std::vector<TensorNodePtr>& tensors,
+    const std::vector<llvm::Value*>& elem_indices,
+    llvm::Value* ntid)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+    auto& lmod = compiler_state->gmodule;
+
+    auto* i32_type = llvm::Type::getInt32Ty(*ctx);
+    auto* void_type = llvm::Type::getVoidTy(*ctx);
+    auto* kernel_llvm_fn = irb->GetInsertBlock()->getParent();
+
+    // a tile of each tensor per element: the threads of the block, at most max_threads
+    int bytes_per_thread = 0;
+    for (auto& tensor : tensors)
+    {
+        bytes_per_thread += 4 * get_num_lanes(tensor->dtype) * elems_per_thread;
+    }
+    int max_threads = 1024;
+    while (max_threads > 32 && max_threads * bytes_per_thread > max_staging_bytes)
+    {
+        max_threads /= 2;
+    }
+
+    std::vector<llvm::Metadata*> metadata_fields =
+    {
+        llvm::ValueAsMetadata::get(kernel_llvm_fn),
+        llvm::MDString::get(*ctx, "maxntidx"),
+        llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(i32_type, max_threads))
+    };
+    lmod->getOrInsertNamedMetadata("nvvm.annotations")->addOperand(llvm::MDNode::get(*ctx, metadata_fields));
+
+    std::vector<llvm::GlobalVariable*> tiles;
+    for (auto& tensor : tensors)
+    {
+        auto* tile_type = llvm::ArrayType::get(get_llvm_type_of_dtype(ctx, tensor->dtype), max_threads * elems_per_thread);
+        auto* tile = new llvm::GlobalVariable(
+            *lmod, tile_type, false, llvm::GlobalValue::InternalLinkage,
+            llvm::UndefValue::get(tile_type), node.name + "_stage_" + tensor->name,
+            nullptr, llvm::GlobalValue::NotThreadLocal, 3U);  // address space 3 is the shared memory
+        tile->setAlignment(llvm::Align(16));
+        tiles.push_back(tile);
+    }
+
+    // element k of the threads is the tile k: tid + k * max_threads
+    std::vector<std::vector<llvm::Value*>> staged_ptrs(elems_per_thread);
+    for (int elem = 0; elem < elems_per_thread; ++elem)
+    {
+        auto* slot_idx = irb->CreateAdd(elem_indices[0], llvm::ConstantInt::get(i32_type, elem * max_threads));
+        for (int ix = 0; ix < tensors.size(); ++ix)
+        {
+            auto* tile_ptr = irb->CreateGEP(tiles[ix]->getValueType(), tiles[ix], {llvm::ConstantInt::get(i32_type, 0), slot_idx});
+            staged_ptrs[elem].push_back(tile_ptr);
+        }
+    }
+
+    if (async_copy == AsyncCopy::CP_ASYNC)
+    {
+        // each thread copies its own elements, a commit group per element
+        for (int elem = 0; elem < elems_per_thread; ++elem)
+        {
+            for (int ix = 0; ix < tensors.size(); ++ix)
+            {
+                auto& tensor = tensors[ix];
+                auto* elem_type = get_llvm_type_of_dtype(ctx, tensor->dtype);
+                auto* src_ptr = calc_ptr_from_offset(elem_type, values.at(*tensor), elem_indices[elem]);
+
+                int num_bytes = 4 * get_num_lanes(tensor->dtype);
+                auto intrinsic = num_bytes == 16 ? llvm::Intrinsic::nvvm_cp_async_ca_shared_global_16
+                    : num_bytes == 8 ? llvm::Intrinsic::nvvm_cp_async_ca_shared_global_8
+                    : llvm::Intrinsic::nvvm_cp_async_ca_shared_global_4;
+                irb->CreateIntrinsic(void_type, intrinsic, {staged_ptrs[elem][ix], src_ptr});
+            }
+            irb->CreateIntrinsic(void_type, llvm::Intrinsic::nvvm_cp_async_commit_group, {});
+        }
+        return staged_ptrs;
+    }
+
+    // bulk copies: thread 0 copies the whole tile k (ntid elements from k * ntid), completed on the mbarrier k
+    auto* shared_ptr_type = llvm::PointerType::get(*ctx, 3U);
+    auto* global_ptr_type = llvm::PointerType::get(*ctx, 1U);
+
+    auto* barriers_type = llvm::ArrayType::get(llvm::Type::getInt64Ty(*ctx), elems_per_thread);
+    auto* barriers = new llvm::GlobalVariable(
+        *lmod, barriers_type, false, llvm::GlobalValue::InternalLinkage,
+        llvm::UndefValue::get(barriers_type), node.name + "_stage_mbarriers",
+        nullptr, llvm::GlobalValue::NotThreadLocal, 3U);
+    barriers->setAlignment(llvm::Align(8));
+
+    stage_barriers.clear();
+    for (int elem = 0; elem < elems_per_thread; ++elem)
+    {
+        stage_barriers.push_back(irb->CreateGEP(barriers_type, barriers,
+            {llvm::ConstantInt::get(i32_type, 0), llvm::ConstantInt::get(i32_type, elem)}));
+    }
+
+    auto* expect_tx = llvm::InlineAsm::get(
+        llvm::FunctionType::get(void_type, {shared_ptr_type, i32_type}, false),
+        "mbarrier.arrive.expect_tx.shared.b64 _, [$0], $1;", "l,r", true);
+    auto* bulk_copy = llvm::InlineAsm::get(
+        llvm::FunctionType::get(void_type, {shared_ptr_type, global_ptr_type, i32_type, shared_ptr_type}, false),
+        "cp.async.bulk.shared::cluster.global.mbarrier::complete_tx::bytes [$0], [$1], $2, [$3];", "l,l,r,l", true);
+
+    auto* is_first_thread = irb->CreateICmpEQ(elem_indices[0], llvm::ConstantInt::get(i32_type, 0));
+    auto* init_bb = llvm::BasicBlock::Create(*ctx, "stage.init", kernel_llvm_fn);
+    auto* sync_bb = llvm::BasicBlock::Create(*ctx, "stage.sync", kernel_llvm_fn);
+    irb->CreateCondBr(is_first_thread, init_bb, sync_bb);
+
+    irb->SetInsertPoint(init_bb);
+    for (auto* barrier : stage_barriers)
+    {
+        irb->CreateIntrinsic(void_type, llvm::Intrinsic::nvvm_mbarrier_init_shared, {barrier, llvm::ConstantInt::get(i32_type, 1)});
+    }
+
+    // the inits are made visible to the async proxy, which completes the bulk copies on the barriers
+    auto* init_fence = llvm::InlineAsm::get(
+        llvm::FunctionType::get(void_type, {}, false),
+        "fence.mbarrier_init.release.cluster;\n\tfence.proxy.async.shared::cta;", "", true);
+    irb->CreateCall(init_fence, {});
+    irb->CreateBr(sync_bb);
+
+    // the barriers are initialized before anyone waits on them
+    irb->SetInsertPoint(sync_bb);
+    irb->CreateIntrinsic(void_type, llvm::Intrinsic::nvvm_barrier0, {});
+
+    auto* copy_bb = llvm::BasicBlock::Create(*ctx, "stage.copy", kernel_llvm_fn);
+    auto* staged_bb = llvm::BasicBlock::Create(*ctx, "stage.issued", kernel_llvm_fn);
+    irb->CreateCondBr(is_first_thread, copy_bb, staged_bb);
+
+    irb->SetInsertPoint(copy_bb);
+    for (int elem = 0; elem < elems_per_thread; ++elem)
+    {
+        auto* tile_start = irb->CreateMul(ntid, llvm::ConstantInt::get(i32_type, elem));
+        auto* tile_offset = llvm::ConstantInt::get(i32_type, elem * max_threads);
+
+        llvm::Value* stage_bytes = llvm::ConstantInt::get(i32_type, 0);
+        for (auto& tensor : tensors)
+        {
+            auto* tile_bytes = irb->CreateMul(ntid, llvm::ConstantInt::get(i32_type, 4 * get_num_lanes(tensor->dtype)));
+            stage_bytes = irb->CreateAdd(stage_bytes, tile_bytes);
+        }
+        irb->CreateCall(expect_tx, {stage_barriers[elem], stage_bytes});
+
+        for (int ix = 0; ix < tensors.size(); ++ix)
+        {
+            auto& tensor = tensors[ix];
+            auto* elem_type = get_llvm_type_of_dtype(ctx, tensor->dtype);
+            auto* src_ptr = calc_ptr_from_offset(elem_type, values.at(*tensor), tile_start);
+            auto* dst_ptr = irb->CreateGEP(tiles[ix]->getValueType(), tiles[ix], {llvm::ConstantInt::get(i32_type, 0), tile_offset});
+            auto* tile_bytes = irb->CreateMul(ntid, llvm::ConstantInt::get(i32_type, 4 * get_num_lanes(tensor->dtype)));
+            irb->CreateCall(bulk_copy, {dst_ptr, src_ptr, tile_bytes, stage_barriers[elem]});
+        }
+    }
+    irb->CreateBr(staged_bb);
+
+    irb->SetInsertPoint(staged_bb);
+    return staged_ptrs;
+}
+
+ValueTable NVIRBuilder::wait_for_stage(
+    const int elem,
+    const std::vector<TensorNodePtr>& tensors,
+    const std::vector<llvm::Value*>& staged_ptrs)
+{
+    auto& ctx = compiler_state->context;
+    auto& irb = compiler_state->ir_builder;
+
+    auto* i32_type = llvm::Type::getInt32Ty(*ctx);
 
-    llvm::TargetOptions opt;
-    auto RM = std::optional<llvm::Reloc::Model>();
-    
-    auto nv_target_machine = target->createTargetMachine(
-        target_triple, CPU, Features, opt, RM);
+    if (async_copy == AsyncCopy::CP_ASYNC)
+    {
+        // the groups are completed in order, the later elements can be still in flight
+        irb->CreateIntrinsic(llvm::Type::getVoidTy(*ctx), llvm::Intrinsic::nvvm_cp_async_wait_group,
+            {llvm::ConstantInt::get(i32_type, elems_per_thread - 1 - elem)});
+    }
+    else
+    {
+        auto* try_wait = llvm::InlineAsm::get(
+            llvm::FunctionType::get(i32_type, {llvm::PointerType::get(*ctx, 3U)}, false),
+            "{ .reg .pred p; mbarrier.try_wait.parity.shared.b64 p, [$1], 0; selp.u32 $0, 1, 0, p; }", "=r,l", true);
 
-    compiler_state->gmodule->setDataLayout(nv_target_machine->createDataLayout());
+        auto* kernel_llvm_fn = irb->GetInsertBlock()->getParent();
+        auto* wait_bb = llvm::BasicBlock::Create(*ctx, "stage.wait", kernel_llvm_fn);
+        auto* ready_bb = llvm::BasicBlock::Create(*ctx, "stage.ready", kernel_llvm_fn);
+        irb->CreateBr(wait_bb);
 
-    std::error_code EC;
-    llvm::raw_fd_ostream dest(ptx_file, EC, llvm::sys::fs::OF_None);
+        irb->SetInsertPoint(wait_bb);
+        auto* is_ready = irb->CreateCall(try_wait, {stage_barriers[elem]});
+        irb->CreateCondBr(irb->CreateICmpNE(is_ready, llvm::ConstantInt::get(i32_type, 0)), ready_bb, wait_bb);
 
-    if (EC) 
+        irb->SetInsertPoint(ready_bb);
+    }
+
+    ValueTable staged_values(values.get_num_values());
+    for (int ix = 0; ix < tensors.size(); ++ix)
     {
-        std::stringstream ss;
-        ss << "Could not open file: ";
-        ss << EC.message();
-        emit_error(ss.str());
+        auto* elem_type = get_llvm_type_of_dtype(ctx, tensors[ix]->dtype);
+        staged_values.insert(*tensors[ix], irb->CreateLoad(elem_type, staged_ptrs[ix]));
     }
+    return staged_values;
+}
 
-    llvm::legacy::PassManager pass;
-    auto FileType = llvm::CodeGenFileType::AssemblyFile;
+std::vector<TensorNodePtr> NVIRBuilder::find_read_only_tensors(const KernelNode& node) const
+{
+    // flags at the value index
+    std::vector<uint8_t> is_read(values.get_num_values(), 0);
+    std::vector<uint8_t> is_written(values.get_num_values(), 0);  // assigned, or passed to a kernel (can be assigned there)
+    std::vector<uint8_t> is_visited(values.get_num_values(), 0);
 
-    if (nv_target_machine->addPassesToEmitFile(pass, dest, nullptr, FileType)) 
+    std::vector<ASTNodePtr> work_list(node.body.begin(), node.body.end());
+    while (!work_list.empty())
     {
-        std::stringstream ss;
-        ss << "nv_target_machine can't emit a file of this type";
-        emit_error(ss.str());
-    }
+        auto ast_node = work_list.back();
+        work_list.pop_back();
 
-    pass.run(*compiler_state->gmodule);
-    dest.flush();
+        if (!ast_node || is_visited[ast_node->value_index])
+            continue;
+        is_visited[ast_node->value_index] = 1;
 
-    std::cout << "Ptx was generated into " << ptx_file << "\n";
-}
+        switch (ast_node->kind)
+        {
+        case NodeKind::TENSOR:
+            is_read[ast_node->value_index] = 1;
+            break;
+
+        case NodeKind::ASSIGNMENT:
+            is_written[static_cast<AssignmentNode&>(*ast_node).trg->value_index] = 1;
+            break;
+
+        case NodeKind::KERNEL_CALL:
+            for (auto& arg : static_cast<KernelCallNode&>(*ast_node).arguments)
+            {
+                is_written[arg->value_index] = 1;
+            }
+            continue;
+
+        case NodeKind::REPEAT:
+        {
+            auto& repeat_node = static_cast<RepeatNode&>(*ast_node);
+            work_list.insert(work_list.end(), repeat_node.body.begin(), repeat_node.body.end());
+            for (auto& loop_var : repeat_node.loop_vars)
+            {
+                work_list.push_back(loop_var->next);
+            }
+            break;
+        }
 
-// IR builder for NVIDIA gpus
+        default:
+            break;
+        }
 
-NVIRBuilder::NVIRBuilder(
-    std::shared_ptr<LLVMState> compiler_state,
-    const std::unordered_map<std::string, llvm::Function*>& defined_functions,
-    std::unordered_map<int, llvm::Value*>& values
-    ) : compiler_state(compiler_state), 
-        defined_functions(defined_functions),
-        values(values)
-{
+        auto operands = get_operands(ast_node);
+        work_list.insert(work_list.end(), operands.begin(), operands.end());
+    }
+
+    // in argument order, for a stable load order
+    std::vector<TensorNodePtr> read_only_tensors;
+    for (auto& arg : node.arguments)
+    {
+        if (is_read[arg->value_index] && !is_written[arg->value_index])
+        {
+            read_only_tensors.push_back(std::static_pointer_cast<TensorNode>(arg));
+        }
+    }
 
+    return read_only_tensors;
 }
 
-llvm::Value* NVIRBuilder::calc_ptr_from_offset(
-    const llvm::Type* ltype, 
-    llvm::Value* ptr,
-    llvm::Value* idx)
+std::vector<bool> NVIRBuilder::find_rematerialized_aliases(const KernelNode& node) const
 {
-    auto& irb = compiler_state->ir_builder;
-    auto& ctx = compiler_state->context;
+    std::unordered_set<int> read_only_ids;
+    for (auto& tensor : find_read_only_tensors(node))
+    {
+        read_only_ids.insert(tensor->ast_id);
+    }
 
-    llvm::Type* llvm_type = llvm::Type::getFloatTy(*ctx);
-    llvm::Value* ptr_element = irb->CreateGEP(llvm_type, ptr, idx, "ptr");
-    return ptr_element;
-}
+    auto is_cheap_operand = [&](const ASTNodePtr& operand)
+    {
+        return std::dynamic_pointer_cast<ConstantNode>(operand)
+            || std::dynamic_pointer_cast<ScalarNode>(operand)
+            || read_only_ids.contains(operand->ast_id);
+    };
+
+    // the alias is defined by its statement, it is live until the last statement using it
+    std::unordered_map<int, int> def_positions;
+    std::unordered_map<int, int> last_uses;
+    std::unordered_set<int> candidates;
+    for (int pos = 0; pos < node.body.size(); ++pos)
+    {
+        auto alias_node = std::dynamic_pointer_cast<AliasNode>(node.body[pos]);
+        if (alias_node)
+        {
+            def_positions.insert({alias_node->ast_id, pos});
+
+            auto operands = get_operands(alias_node->src);
+            bool is_op = std::dynamic_pointer_cast<BinaryNode>(alias_node->src) || std::dynamic_pointer_cast<UnaryNode>(alias_node->src);
+            bool reads_tensor = std::any_of(operands.begin(), operands.end(),
+                [&](const ASTNodePtr& operand) { return read_only_ids.contains(operand->ast_id); });
+
+            if ((read_only_ids.contains(alias_node->src->ast_id) || (is_op && reads_tensor))
+                && std::all_of(operands.begin(), operands.end(), is_cheap_operand))
+            {
+                candidates.insert(alias_node->ast_id);
+            }
+        }
 
-void NVIRBuilder::apply(KernelNode& node)
-{
-    auto& ctx = compiler_state->context;
-    auto& irb = compiler_state->ir_builder;
+        for_each_reachable_node({node.body[pos]}, [&](const ASTNodePtr& used)
+        {
+            if (used->ast_id != node.body[pos]->ast_id && std::dynamic_pointer_cast<AliasNode>(used))
+                last_uses.insert_or_assign(used->ast_id, pos);
+        });
+    }
 
-    tid = irb->CreateIntrinsic(
-        llvm::Type::getInt32Ty(*ctx), 
-        llvm::Intrinsic::nvvm_read_ptx_sreg_tid_x, 
-        {}
-    );
+    int max_live = 0;
+    for (int pos = 0; pos < node.body.size(); ++pos)
+    {
+        int live = 0;
+        for (auto& [alias_id, last_use] : last_uses)
+        {
+            if (def_positions.contains(alias_id) && def_positions.at(alias_id) <= pos && pos < last_use)
+                ++live;
+        }
+        max_live = std::max(max_live, live);
+    }
 
-    for (auto ast_node : node.body)
+    std::vector<bool> rematerialized(values.get_num_values(), false);
+    if (max_live < max_live_aliases)
     {
-        ast_node->accept(*this);
+        return rematerialized;
+    }
+
+    for (int pos = 0; pos < node.body.size(); ++pos)
+    {
+        if (candidates.contains(node.body[pos]->ast_id))
+            rematerialized[node.body[pos]->value_index] = true;
     }
+    return rematerialized;
 }
 
 void NVIRBuilder::apply(KernelCallNode &node)
 {
+    if (values.contains(node))
+        return;
+
     auto& ctx = compiler_state->context;
     auto& irb = compiler_state->ir_builder;
 
@@ -242,26 +1596,34 @@ void NVIRBuilder::apply(KernelCallNode &node)
     std::vector<llvm::Value*> llvm_args;
     for (auto& arg : node.arguments)
     {
-        auto* llvm_arg = values.at(arg->ast_id);
+        // e.g. a specialized scalar, or a rematerialized alias released by an earlier use
+        arg->accept(*this);
+
+        auto* llvm_arg = values.at(*arg);
         llvm_args.push_back(llvm_arg);
     }
 
+    if (takes_element_index(*node.kernel))
+    {
+        llvm_args.push_back(elem_idx);
+    }
+
     llvm::Value* ret = nullptr;     // if void
-    if (node.kernel->return_value)  // if not void
+    if (!node.kernel->return_values.empty())  // if not void
         ret = irb->CreateCall(kernel, llvm_args);
 
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(ConstantNode &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
     auto& ctx = compiler_state->context;
     llvm::Value* const_float = llvm::ConstantFP::get(*ctx, llvm::APFloat(node.val_f32));
 
-    values.insert({node.ast_id, const_float});
+    values.insert(node, const_float);
 }
 
 void NVIRBuilder::apply(ScalarNode &node)
@@ -276,286 +1638,154 @@ void NVIRBuilder::apply(TensorNode &node)
 
 void NVIRBuilder::apply(AddNode &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
-    node.lhs->accept(*this);
-    node.rhs->accept(*this);
-    
-    auto& ctx = compiler_state->context;
     auto& irb = compiler_state->ir_builder;
 
-    auto* lhs = values.at(node.lhs->ast_id);
-    auto* rhs = values.at(node.rhs->ast_id);
-    
-    llvm::Value* lhs_val = lhs;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.lhs))
-    {
-        auto* lhs_ptr = calc_ptr_from_offset(lhs->getType(), lhs, tid);
-        lhs_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), lhs_ptr);
-    }
-
-    llvm::Value* rhs_val = rhs;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.rhs))
-    { 
-        auto* rhs_ptr = calc_ptr_from_offset(rhs->getType(), rhs, tid);
-        rhs_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), rhs_ptr);
-    }
+    auto [lhs_val, rhs_val] = get_binary_operands(node, "add");
 
-    if (lhs_val == nullptr || rhs_val == nullptr)
-    {
-        std::stringstream ss;
-        ss << "In add node, one of the operands are nullptr.";
-        emit_error(ss.str());
-    }
+    auto dtype = dtype_inference.get_dtype(node);
+    lhs_val = promote_value(lhs_val, dtype_inference.get_dtype(node.lhs), dtype);
+    rhs_val = promote_value(rhs_val, dtype_inference.get_dtype(node.rhs), dtype);
 
     auto* ret = irb->CreateFAdd(lhs_val, rhs_val);
 
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(SubNode &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
-    node.lhs->accept(*this);
-    node.rhs->accept(*this);
-    
-    auto& ctx = compiler_state->context;
     auto& irb = compiler_state->ir_builder;
 
-    auto* lhs = values.at(node.lhs->ast_id);
-    auto* rhs = values.at(node.rhs->ast_id);
-    
-    llvm::Value* lhs_val = lhs;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.lhs))
-    {
-        auto* lhs_ptr = calc_ptr_from_offset(lhs->getType(), lhs, tid);
-        lhs_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), lhs_ptr);
-    }
-
-    llvm::Value* rhs_val = rhs;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.rhs))
-    { 
-        auto* rhs_ptr = calc_ptr_from_offset(rhs->getType(), rhs, tid);
-        rhs_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), rhs_ptr);
-    }
+    auto [lhs_val, rhs_val] = get_binary_operands(node, "sub");
 
-    if (lhs_val == nullptr || rhs_val == nullptr)
-    {
-        std::stringstream ss;
-        ss << "In sub node, one of the operands are nullptr.";
-        emit_error(ss.str());
-    }
+    auto dtype = dtype_inference.get_dtype(node);
+    lhs_val = promote_value(lhs_val, dtype_inference.get_dtype(node.lhs), dtype);
+    rhs_val = promote_value(rhs_val, dtype_inference.get_dtype(node.rhs), dtype);
 
     auto* ret = irb->CreateFSub(lhs_val, rhs_val);
 
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(MulNode &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
-    node.lhs->accept(*this);
-    node.rhs->accept(*this);
-    
-    auto& ctx = compiler_state->context;
     auto& irb = compiler_state->ir_builder;
 
-    auto* lhs = values.at(node.lhs->ast_id);
-    auto* rhs = values.at(node.rhs->ast_id);
-    
-    llvm::Value* lhs_val = lhs;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.lhs))
-    {
-        auto* lhs_ptr = calc_ptr_from_offset(lhs->getType(), lhs, tid);
-        lhs_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), lhs_ptr);
-    }
+    auto [lhs_val, rhs_val] = get_binary_operands(node, "mul");
 
-    llvm::Value* rhs_val = rhs;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.rhs))
-    { 
-        auto* rhs_ptr = calc_ptr_from_offset(rhs->getType(), rhs, tid);
-        rhs_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), rhs_ptr);
-    }
+    auto dtype = dtype_inference.get_dtype(node);
+    auto lhs_dtype = dtype_inference.get_dtype(node.lhs);
+    auto rhs_dtype = dtype_inference.get_dtype(node.rhs);
 
-    if (lhs_val == nullptr || rhs_val == nullptr)
+    llvm::Value* ret = nullptr;
+    if (lhs_dtype == DataType::COMPLEX64 && rhs_dtype == DataType::COMPLEX64)
     {
-        std::stringstream ss;
-        ss << "In mul node, one of the operands are nullptr.";
-        emit_error(ss.str());
+        ret = build_complex_mul(lhs_val, rhs_val);
+    }
+    else  // elementwise, a real scales both parts of a complex
+    {
+        lhs_val = (lhs_dtype == dtype ? lhs_val : irb->CreateVectorSplat(get_num_lanes(dtype), lhs_val));
+        rhs_val = (rhs_dtype == dtype ? rhs_val : irb->CreateVectorSplat(get_num_lanes(dtype), rhs_val));
+        ret = irb->CreateFMul(lhs_val, rhs_val);
     }
 
-    auto* ret = irb->CreateFMul(lhs_val, rhs_val);
-
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(DivNode &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
-    node.lhs->accept(*this);
-    node.rhs->accept(*this);
-    
-    auto& ctx = compiler_state->context;
     auto& irb = compiler_state->ir_builder;
 
-    auto* lhs = values.at(node.lhs->ast_id);
-    auto* rhs = values.at(node.rhs->ast_id);
-    
-    llvm::Value* lhs_val = lhs;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.lhs))
-    {
-        auto* lhs_ptr = calc_ptr_from_offset(lhs->getType(), lhs, tid);
-        lhs_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), lhs_ptr);
-    }
+    auto [lhs_val, rhs_val] = get_binary_operands(node, "div");
 
-    llvm::Value* rhs_val = rhs;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.rhs))
-    { 
-        auto* rhs_ptr = calc_ptr_from_offset(rhs->getType(), rhs, tid);
-        rhs_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), rhs_ptr);
-    }
+    auto dtype = dtype_inference.get_dtype(node);
+    auto lhs_dtype = dtype_inference.get_dtype(node.lhs);
+    auto rhs_dtype = dtype_inference.get_dtype(node.rhs);
 
-    if (lhs_val == nullptr || rhs_val == nullptr)
+    llvm::Value* ret = nullptr;
+    if (rhs_dtype == DataType::COMPLEX64)
     {
-        std::stringstream ss;
-        ss << "In div node, one of the operands are nullptr.";
-        emit_error(ss.str());
+        lhs_val = promote_value(lhs_val, lhs_dtype, dtype);
+        ret = build_complex_div(lhs_val, rhs_val);
+    }
+    else  // elementwise, a real divides both parts of a complex
+    {
+        lhs_val = (lhs_dtype == dtype ? lhs_val : irb->CreateVectorSplat(get_num_lanes(dtype), lhs_val));
+        rhs_val = (rhs_dtype == dtype ? rhs_val : irb->CreateVectorSplat(get_num_lanes(dtype), rhs_val));
+        ret = irb->CreateFDiv(lhs_val, rhs_val);
     }
 
-    auto* ret = irb->CreateFDiv(lhs_val, rhs_val);
-
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(AbsNode &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
-    node.x->accept(*this);
-    
     auto& ctx = compiler_state->context;
     auto& irb = compiler_state->ir_builder;
 
-    auto* x = values.at(node.x->ast_id);
-    
-    llvm::Value* x_val = x;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.x))
+    auto* x_val = get_unary_operand(node, "abs");
+
+    llvm::Value* ret = nullptr;
+    if (dtype_inference.get_dtype(node.x) == DataType::COMPLEX64)  // magnitude
     {
-        auto* x_ptr = calc_ptr_from_offset(x->getType(), x, tid);
-        x_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), x_ptr);
+        auto* re = irb->CreateExtractElement(x_val, uint64_t(0));
+        auto* im = irb->CreateExtractElement(x_val, uint64_t(1));
+        auto* sq = irb->CreateFAdd(irb->CreateFMul(re, re), irb->CreateFMul(im, im));
+        ret = irb->CreateIntrinsic(llvm::Type::getFloatTy(*ctx), llvm::Intrinsic::nvvm_sqrt_f, sq);
     }
-
-    if (x_val == nullptr)
+    else
     {
-        std::stringstream ss;
-        ss << "In abs node, the operand is nullptr.";
-        emit_error(ss.str());
+        ret = apply_per_lane(x_val, llvm::Intrinsic::nvvm_fabs_f);
     }
 
-    auto* ret = irb->CreateIntrinsic(x_val->getType(), llvm::Intrinsic::nvvm_fabs_f, x_val);
-
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(SqrtNode &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
-    node.x->accept(*this);
-    
-    auto& ctx = compiler_state->context;
-    auto& irb = compiler_state->ir_builder;
-
-    auto* x = values.at(node.x->ast_id);
-    
-    llvm::Value* x_val = x;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.x))
-    {
-        auto* x_ptr = calc_ptr_from_offset(x->getType(), x, tid);
-        x_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), x_ptr);
-    }
+    auto* x_val = get_unary_operand(node, "sqrt");
+    auto* ret = apply_per_lane(x_val, llvm::Intrinsic::nvvm_sqrt_f);
 
-    if (x_val == nullptr)
-    {
-        std::stringstream ss;
-        ss << "In sqrt node, the operand is nullptr.";
-        emit_error(ss.str());
-    }
-
-    auto* ret = irb->CreateIntrinsic(x_val->getType(), llvm::Intrinsic::nvvm_sqrt_f, x_val);
-
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(Log2Node &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
-    node.x->accept(*this);
-    
-    auto& ctx = compiler_state->context;
-    auto& irb = compiler_state->ir_builder;
-
-    auto* x = values.at(node.x->ast_id);
-    
-    llvm::Value* x_val = x;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.x))
-    {
-        auto* x_ptr = calc_ptr_from_offset(x->getType(), x, tid);
-        x_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), x_ptr);
-    }
-
-    if (x_val == nullptr)
-    {
-        std::stringstream ss;
-        ss << "In log2 node, the operand is nullptr.";
-        emit_error(ss.str());
-    }
-
-    auto* ret = irb->CreateIntrinsic(x_val->getType(), llvm::Intrinsic::nvvm_lg2_approx_f, x_val);
+    auto* x_val = get_unary_operand(node, "log2");
+    auto* ret = apply_per_lane(x_val, llvm::Intrinsic::nvvm_lg2_approx_f);
 
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(Exp2Node &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
 
-    node.x->accept(*this);
-    
-    auto& ctx = compiler_state->context;
-    auto& irb = compiler_state->ir_builder;
-
-    auto* x = values.at(node.x->ast_id);
-    
-    llvm::Value* x_val = x;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.x))
-    {
-        auto* x_ptr = calc_ptr_from_offset(x->getType(), x, tid);
-        x_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), x_ptr);
-    }
-
-    if (x_val == nullptr)
-    {
-        std::stringstream ss;
-        ss << "In exp2 node, the operand is nullptr.";
-        emit_error(ss.str());
-    }
-
-    auto* ret = irb->CreateIntrinsic(x_val->getType(), llvm::Intrinsic::nvvm_ex2_approx_f, x_val);
+    auto* x_val = get_unary_operand(node, "exp2");
+    auto* ret = apply_per_lane(x_val, llvm::Intrinsic::nvvm_ex2_approx_f);
 
-    values.insert({node.ast_id, ret});
+    values.insert(node, ret);
 }
 
 void NVIRBuilder::apply(AssignmentNode &node)
@@ -565,15 +1795,8 @@ void NVIRBuilder::apply(AssignmentNode &node)
     auto& ctx = compiler_state->context;
     auto& irb = compiler_state->ir_builder;
 
-    auto* src = values.at(node.src->ast_id);
-    auto* trg = values.at(node.trg->ast_id);
-    
-    llvm::Value* src_val = src;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.src))
-    {
-        auto* src_ptr = calc_ptr_from_offset(src->getType(), src, tid);
-        src_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), src_ptr);
-    }
+    auto* src_val = load_operand(node.src);
+    auto* trg = values.at(*node.trg);
 
     if (src_val == nullptr)
     {
@@ -582,27 +1805,22 @@ void NVIRBuilder::apply(AssignmentNode &node)
         emit_error(ss.str());
     }
 
-    auto* trg_ptr = calc_ptr_from_offset(trg->getType(), trg, tid);
-    irb->CreateStore(src, trg_ptr);
+    auto trg_dtype = dtype_inference.get_dtype(node.trg);
+    src_val = promote_value(src_val, dtype_inference.get_dtype(node.src), trg_dtype);
+
+    auto* elem_type = get_llvm_type_of_dtype(ctx, trg_dtype);
+    auto* trg_ptr = calc_ptr_from_offset(elem_type, trg, elem_idx);
+    irb->CreateAlignedStore(src_val, trg_ptr, llvm::Align(4 * get_num_lanes(trg_dtype)));
 }
 
 void NVIRBuilder::apply(AliasNode &node)
 {
-    if (values.contains(node.ast_id))
+    if (values.contains(node))
         return;
     
     node.src->accept(*this);
-    
-    auto& ctx = compiler_state->context;
-    auto& irb = compiler_state->ir_builder;
 
-    auto src = values.at(node.src->ast_id);
-    llvm::Value* src_val = src;  // if not a tensor
-    if (std::dynamic_pointer_cast<TensorNode>(node.src))
-    {
-        auto* src_ptr = calc_ptr_from_offset(src->getType(), src, tid);
-        src_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), src_ptr);
-    }
+    auto* src_val = load_operand(node.src);
 
     if (src_val == nullptr)
     {
@@ -611,31 +1829,163 @@ void NVIRBuilder::apply(AliasNode &node)
         emit_error(ss.str());
     }
 
-    values.insert({node.ast_id, src_val});
+    values.insert(node, src_val);
 }
 
 void NVIRBuilder::apply(ReturnNode &node)
+{
+    auto& irb = compiler_state->ir_builder;
+
+    std::vector<llvm::Value*> return_values;
+    for (auto& ret : node.return_values)
+    {
+        ret->accept(*this);
+        return_values.push_back(load_operand(ret));
+    }
+
+    if (return_values.size() == 1)
+    {
+        irb->CreateRet(return_values[0]);
+    }
+    else if (return_values.size() > 1)  // the elements of the returned struct
+    {
+        irb->CreateAggregateRet(return_values.data(), static_cast<unsigned>(return_values.size()));
+    }
+    else
+    {
+        irb->CreateRetVoid();
+    }
+}
+
+void NVIRBuilder::apply(TupleElementNode &node)
+{
+    if (values.contains(node))
+        return;
+
+    node.tuple->accept(*this);
+
+    auto& irb = compiler_state->ir_builder;
+
+    auto* tuple = values.at(*node.tuple);
+    auto* ret = irb->CreateExtractValue(tuple, {static_cast<unsigned>(node.index)});
+
+    values.insert(node, ret);
+}
+
+void NVIRBuilder::apply(LoopVarNode &node)
+{
+    // the value is set by the enclosing repeat node
+}
+
+void NVIRBuilder::apply(RepeatNode &node)
 {
     auto& ctx = compiler_state->context;
     auto& irb = compiler_state->ir_builder;
 
-    if (node.return_value)
+    // values existing before the block, the rest is local to an iteration
+    auto outer_values = values.get_checkpoint();
+
+    // helper for reading the value of a carried variable at the end of the iteration
+    auto get_carried_value = [&](const ASTNodePtr& src) -> llvm::Value*
     {
-        node.return_value->accept(*this);
+        src->accept(*this);
+        auto* src_val = load_operand(src);
 
-        auto* return_value = values.at(node.return_value->ast_id);
-    
-        llvm::Value* return_value_val = return_value;  // if not a tensor
-        if (std::dynamic_pointer_cast<TensorNode>(node.return_value))
+        if (src_val == nullptr)
         {
-            auto* return_value_ptr = calc_ptr_from_offset(return_value->getType(), return_value, tid);
-            return_value_val = irb->CreateLoad(llvm::Type::getFloatTy(*ctx), return_value_ptr);
+            std::stringstream ss;
+            ss << "In repeat node, a carried value is nullptr. (E.g. func node with void return)";
+            emit_error(ss.str());
         }
+        return src_val;
+    };
+
+    std::vector<llvm::Value*> carried_vals;
+    for (auto& loop_var : node.loop_vars)
+    {
+        carried_vals.push_back(get_carried_value(loop_var->init));
+    }
 
-        irb->CreateRet(return_value_val);
+    if (node.trip_count <= max_unrolled_trip_count)
+    {
+        // full unroll, the body is emitted once per iteration
+        for (int iter = 0; iter < node.trip_count; ++iter)
+        {
+            for (size_t ix = 0; ix < node.loop_vars.size(); ++ix)
+            {
+                values.insert_or_assign(*node.loop_vars[ix], carried_vals[ix]);
+            }
+
+            for (auto& ast_node : node.body)
+            {
+                ast_node->accept(*this);
+            }
+
+            for (size_t ix = 0; ix < node.loop_vars.size(); ++ix)
+            {
+                if (node.loop_vars[ix]->next)
+                    carried_vals[ix] = get_carried_value(node.loop_vars[ix]->next);
+            }
+
+            values.restore(outer_values);
+        }
     }
     else
     {
-        irb->CreateRetVoid();
+        // counted loop, carried variables are phi nodes in the header
+        auto* func = irb->GetInsertBlock()->getParent();
+        auto* preheader_bb = irb->GetInsertBlock();
+        auto* loop_bb = llvm::BasicBlock::Create(*ctx, "repeat", func);
+
+        irb->CreateBr(loop_bb);
+        irb->SetInsertPoint(loop_bb);
+
+        auto* i32_type = llvm::Type::getInt32Ty(*ctx);
+        auto* counter = irb->CreatePHI(i32_type, 2, "iter");
+        counter->addIncoming(llvm::ConstantInt::get(i32_type, 0), preheader_bb);
+
+        std::vector<llvm::PHINode*> phis;
+        for (size_t ix = 0; ix < node.loop_vars.size(); ++ix)
+        {
+            auto* phi = irb->CreatePHI(carried_vals[ix]->getType(), 2, node.loop_vars[ix]->name);
+            phi->addIncoming(carried_vals[ix], preheader_bb);
+            values.insert_or_assign(*node.loop_vars[ix], phi);
+            phis.push_back(phi);
+        }
+
+        for (auto& ast_node : node.body)
+        {
+            ast_node->accept(*this);
+        }
+
+        for (size_t ix = 0; ix < node.loop_vars.size(); ++ix)
+        {
+            carried_vals[ix] = phis[ix];
+            if (node.loop_vars[ix]->next)
+                carried_vals[ix] = get_carried_value(node.loop_vars[ix]->next);
+        }
+
+        // the body can contain nested loops, the latch is the current block
+        auto* latch_bb = irb->GetInsertBlock();
+        auto* next_counter = irb->CreateAdd(counter, llvm::ConstantInt::get(i32_type, 1));
+        auto* cond = irb->CreateICmpSLT(next_counter, llvm::ConstantInt::get(i32_type, node.trip_count));
+        
+        auto* exit_bb = llvm::BasicBlock::Create(*ctx, "repeat.end", func);
+        irb->CreateCondBr(cond, loop_bb, exit_bb);
+
+        counter->addIncoming(next_counter, latch_bb);
+        for (size_t ix = 0; ix < phis.size(); ++ix)
+        {
+            phis[ix]->addIncoming(carried_vals[ix], latch_bb);
+        }
+
+        irb->SetInsertPoint(exit_bb);
+        values.restore(outer_values);
+    }
+
+    // after the block the carried variables hold the last values
+    for (size_t ix = 0; ix < node.loop_vars.size(); ++ix)
+    {
+        values.insert_or_assign(*node.loop_vars[ix], carried_vals[ix]);
     }
 }
@@ -2,6 +2,7 @@
 
 #include "ast.hpp"
 #include "core.hpp"
+#include "transforms.hpp"
 
 /*
     LLVM requires a large number of
@@ -19,6 +20,7 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/IR/InlineAsm.h"
 
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
@@ -56,6 +58,23 @@ struct LLVMState
 };
 
 
+/**
+ * Staging of the read-only tensors into shared memory
+ * with asynchronous copies (global kernels).
+ */
+enum class AsyncCopy
+{
+    NONE,
+    CP_ASYNC,     // per-thread cp.async, sm_80+
+    BULK_COPY     // a bulk copy of each tile, completed on an mbarrier, sm_90+
+};
+
+/**
+ * The staging strategy available for the sm version (e.g. sm_86),
+ * stops with an error below sm_80.
+ */
+AsyncCopy select_async_copy(const std::string& sm_xx);
+
 /**
  * Generates the ptx code from
  * the LLVM IR.
@@ -63,18 +82,173 @@ struct LLVMState
 class PTXGenerator
 {
 public:
-    explicit PTXGenerator();
+    /**
+     * Each generator has its own LLVMContext, generators can work on different threads.
+     * @param log the progress messages are printed here
+     */
+    explicit PTXGenerator(std::ostream& log = std::cout);
     
-    void build_ir_from_kernel(const KernelNodePtr kernel);
+    /**
+     * Builds the LLVM function of the kernel.
+     * @param elems_per_thread global kernels process this many elements per thread (thread coarsening)
+     * @param async_copy the read-only tensors of global kernels are staged with asynchronous copies
+     */
+    void build_ir_from_kernel(const KernelNodePtr kernel, const int elems_per_thread = 1, const AsyncCopy async_copy = AsyncCopy::NONE);
     
     void generate_ptx(
         const std::string& ptx_file, 
         const std::string& sm_xx, 
         const bool save_temps);
 
+    /**
+     * The ptx code of the module, its calls are numbered from 0 (see renumber_call_sequences).
+     * @param uses_bulk_copies selects the ptx version of the bulk copies
+     *     (also needed if another module of the same ptx file uses them)
+     */
+    std::string generate_ptx_code(const std::string& sm_xx, const bool uses_bulk_copies);
+
+    /**
+     * Prints the IR of the built functions.
+     */
+    void print_ir(std::ostream& os) const;
+
+    /**
+     * Horizontal fusion: builds a global kernel which runs each of the (already built)
+     * global kernels on its own range of blocks, dispatched by the block index.
+     * Arguments: the arguments of the kernels in order, then the i32 element count of each kernel.
+     * @return the descriptor of the argument list and of the block ranges
+     */
+    std::string build_ir_from_kernel_group(const std::string& group_name, const std::vector<KernelNodePtr>& kernels);
+
+    /**
+     * Multi-tensor apply: builds the global kernel name_multi, the kernel over a table of chunks.
+     * Each block processes a chunk, the chunk at the block index: the pointers of the tensor arguments
+     * (in order) and the i32 number of elements (at most the block size).
+     * Arguments: the chunk table, then the scalar arguments of the kernel.
+     * @return the descriptor of the chunk layout and of the argument list
+     */
+    std::string build_ir_from_multi_tensor_kernel(const KernelNodePtr kernel);
+
+    /**
+     * The largest number of values (instruction results and arguments)
+     * live at the same time in the IR of the kernel. Registers needed, before allocation.
+     */
+    int get_max_live_values(const std::string& kernel_name) const;
+
 private:
     std::shared_ptr<LLVMState> compiler_state;
     std::unordered_map<std::string, llvm::Function*> defined_functions;
+    bool uses_bulk_copies = false;  // requires ptx 8.0
+    std::ostream& log;
+};
+
+
+/**
+ * Kernels built into the same llvm module, the modules are built and emitted
+ * independently. The kernels calling each other (also through common device kernels),
+ * the kernels with common nodes (e.g. the arguments of a backward kernel)
+ * and the kernels of a horizontal fusion are in the same unit.
+ */
+struct CodegenUnit
+{
+    std::vector<KernelNodePtr> kernels;     // in the order of the kernel list
+    std::vector<int> kernel_groups;         // indices of the horizontal fusions built in the unit
+    std::vector<int> multi_tensor_kernels;  // indices of the multi-tensor variants built in the unit
+};
+
+/**
+ * Splits the kernels into codegen units, the units are ordered by their first kernel.
+ */
+std::vector<CodegenUnit> split_into_codegen_units(
+    const std::vector<KernelNodePtr>& kernels,
+    const std::vector<std::pair<std::string, std::vector<KernelNodePtr>>>& kernel_groups,
+    const std::vector<KernelNodePtr>& multi_tensor_kernels);
+
+/**
+ * The ptx code without its header (.version, .target, .address_size),
+ * for appending the code of a module to the ptx of another one.
+ */
+std::string_view remove_ptx_header(const std::string_view ptx_code);
+
+/**
+ * Numbers the calls of the ptx code ("// callseq N" comments) from next_call_seq on, in their order.
+ * llvm numbers them from a counter of the process, which depends on the modules built before
+ * (on other threads too), the renumbered code does not.
+ * @param next_call_seq the number of the next call, advanced past the calls of the code
+ */
+std::string renumber_call_sequences(const std::string_view ptx_code, int& next_call_seq);
+
+/**
+ * Whether the ptx of the kernels uses bulk copies (sm_90 async copies of global kernels),
+ * it selects the ptx version of every module of the ptx file.
+ */
+bool needs_bulk_copies(const std::vector<KernelNodePtr>& kernels, const AsyncCopy async_copy);
+
+/**
+ * Generates the ptx of the modules of the generators into a single file (the modules in parallel),
+ * the code of the modules follows the order of the generators. With save_temps
+ * the .ll file has the IR of the modules in the same order.
+ * @param uses_bulk_copies see needs_bulk_copies, the same for each module
+ * @param module_codes the ptx code of each module: a given code is used as it is (e.g. from a cache),
+ *     the empty ones are generated from their generator and returned in it
+ */
+void generate_ptx(
+    const std::vector<std::unique_ptr<PTXGenerator>>& ptx_generators,
+    ThreadPool& thread_pool,
+    const std::string& ptx_file,
+    const std::string& sm_xx,
+    const bool save_temps,
+    const bool uses_bulk_copies,
+    std::vector<std::string>& module_codes);
+
+
+/**
+ * Numbers the nodes reachable from the kernel (arguments first) densely from 0,
+ * sets their value_index. The indices of an earlier kernel are overwritten.
+ * @return the number of indexed nodes
+ */
+int index_kernel_values(const KernelNode& kernel);
+
+/**
+ * The llvm values of the nodes of a kernel in a flat vector,
+ * at the value index of the node (see index_kernel_values).
+ * A node can be defined with nullptr (call of a void kernel).
+ */
+class ValueTable
+{
+public:
+    explicit ValueTable(const int num_values);
+
+    bool contains(const ASTNode& node) const;
+    llvm::Value* at(const ASTNode& node) const;
+
+    void insert(const ASTNode& node, llvm::Value* value);  // an existing value is kept
+    void insert_or_assign(const ASTNode& node, llvm::Value* value);
+    void erase(const ASTNode& node);
+
+    int get_num_values() const;
+
+    /**
+     * The nodes defined at a point of the building, the values of the other
+     * nodes can be dropped later (e.g. the values local to a repeat iteration).
+     */
+    struct Checkpoint
+    {
+        std::vector<uint8_t> is_defined;
+        size_t num_defined_order;
+    };
+
+    Checkpoint get_checkpoint() const;
+
+    /**
+     * Drops the values of the nodes not defined at the checkpoint.
+     */
+    void restore(const Checkpoint& checkpoint);
+
+private:
+    std::vector<llvm::Value*> slots;
+    std::vector<uint8_t> is_defined;
+    std::vector<int> defined_order;  // value indices in the order of definition, can have erased ones
 };
 
 
@@ -88,9 +262,17 @@ public:
     explicit NVIRBuilder(
         std::shared_ptr<LLVMState> compiler_state,
         const std::unordered_map<std::string, llvm::Function*>& defined_functions,
-        std::unordered_map<int, llvm::Value*>& values
+        ValueTable& values,
+        const int elems_per_thread = 1,
+        const AsyncCopy async_copy = AsyncCopy::NONE
     );
 
+    /**
+     * The global kernel processes this element instead of the one at the thread index
+     * (e.g. a block range of a horizontally fused kernel).
+     */
+    void set_element_index(llvm::Value* idx);
+
     virtual void apply(KernelNode& node);
     virtual void apply(KernelCallNode& node);
     
@@ -111,16 +293,104 @@ public:
     virtual void apply(AssignmentNode& node);
     virtual void apply(AliasNode& node);
     virtual void apply(ReturnNode& node);
+    virtual void apply(TupleElementNode& node);
+
+    virtual void apply(LoopVarNode& node);
+    virtual void apply(RepeatNode& node);
+
+    // repeat blocks up to this trip count are fully unrolled,
+    // longer ones are lowered to a counted loop
+    static constexpr int max_unrolled_trip_count = 8;
+
+    // above this number of live aliases cheap aliases are recomputed at each use
+    static constexpr int max_live_aliases = 16;
+
+    // static shared memory available for the staged tiles
+    static constexpr int max_staging_bytes = 48 * 1024;
 
 private:
     std::shared_ptr<LLVMState> compiler_state;
     const std::unordered_map<std::string, llvm::Function*>& defined_functions;
-    std::unordered_map<int, llvm::Value*>& values;
+    ValueTable& values;
+
+    DataTypeInference dtype_inference;
+    RegisterNeedAnalysis register_need;
+
+    std::vector<bool> rematerialized_aliases;  // at the value index, recomputed at each use instead of kept alive
+
+    int elems_per_thread;
+    llvm::Value* elem_idx;  // index of the processed element
+    llvm::Value* preset_elem_idx = nullptr;
+    ValueTable loaded_tensors;  // tensor loads of the element, issued ahead
+
+    AsyncCopy async_copy;
+    std::vector<llvm::Value*> stage_barriers;  // mbarrier of each element (bulk copies)
+
+    /**
+     * Replicates the body of a global kernel for each element of the thread.
+     * The loads of the read-only tensors are issued first for all of the elements.
+     */
+    void build_coarsened_body(KernelNode& node);
 
-    llvm::Value* tid;
+    /**
+     * Copies the read-only tensors into shared memory tiles, one stage (commit group
+     * or mbarrier) per element of the thread, so the first element can be computed
+     * while the later ones are in flight. The block size is limited by the tiles (maxntid).
+     * @return the staged address of each tensor (in the order of the tensors), per element
+     */
+    std::vector<std::vector<llvm::Value*>> issue_async_copies(
+        const KernelNode& node,
+        const std::vector<TensorNodePtr>& tensors,
+        const std::vector<llvm::Value*>& elem_indices,
+        llvm::Value* ntid);
+
+    /**
+     * Waits for the stage of the element, then reads the staged values.
+     */
+    ValueTable wait_for_stage(
+        const int elem,
+        const std::vector<TensorNodePtr>& tensors,
+        const std::vector<llvm::Value*>& staged_ptrs);
+
+    /**
+     * Tensors read, but not assigned (or passed to a kernel) in the body.
+     */
+    std::vector<TensorNodePtr> find_read_only_tensors(const KernelNode& node) const;
+
+    /**
+     * Aliases of a single operation on constants, scalars and read-only tensors
+     * (at least one tensor, uniform values stay hoisted). Empty, if the estimated
+     * number of live aliases is below max_live_aliases. Flags at the value index.
+     */
+    std::vector<bool> find_rematerialized_aliases(const KernelNode& node) const;
 
     llvm::Value* calc_ptr_from_offset(
-        const llvm::Type* ltype, 
+        llvm::Type* ltype, 
         llvm::Value* ptr,
         llvm::Value* idx);
+
+    /**
+     * Gives the value of an operand, tensors are loaded at the element index.
+     */
+    llvm::Value* load_operand(const ASTNodePtr& node);
+
+    /**
+     * Converts a f32 value to the short vector type (broadcast, or real part of a c64).
+     */
+    llvm::Value* promote_value(llvm::Value* val, const DataType from, const DataType to);
+
+    /**
+     * Applies a scalar f32 intrinsic on each lane of a short vector value.
+     */
+    llvm::Value* apply_per_lane(llvm::Value* x_val, const llvm::Intrinsic::ID intrinsic);
+
+    llvm::Value* build_complex_mul(llvm::Value* lhs_val, llvm::Value* rhs_val);
+    llvm::Value* build_complex_div(llvm::Value* lhs_val, llvm::Value* rhs_val);
+
+    /**
+     * Builds the operands, then checks them (void calls can not be operands).
+     * The operand needing more registers is built first (Sethi-Ullman order).
+     */
+    std::pair<llvm::Value*, llvm::Value*> get_binary_operands(BinaryNode& node, const std::string& op_name);
+    llvm::Value* get_unary_operand(UnaryNode& node, const std::string& op_name);
 };
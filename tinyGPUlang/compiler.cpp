@@ -1,17 +1,103 @@
 #include "core.hpp"
 #include "parser.hpp"
 #include "codegen.hpp"
+#include "autodiff.hpp"
+#include "passes.hpp"
+#include "fission.hpp"
+#include "fusion.hpp"
+#include "specialize.hpp"
+#include "incremental.hpp"
+#include "cache.hpp"
+
+static constexpr std::string_view tglc_version = "v1.0.0";
+
+// options of the compilation, set from the command line
+struct CompileOptions
+{
+    Target target = Target::NVIDIA_GPU;
+    bool save_temps = false;
+    std::string out_folder_path = "";
+    std::string sm_xx = "";
+    bool autodiff = false;
+    int elems_per_thread = 1;  // thread coarsening of the global kernels
+    std::unordered_map<std::string, int> kernel_elems_per_thread;  // per-kernel overrides
+    bool ast_opt = true;     // AST passes between parsing and codegen
+    bool pass_stats = false;
+    bool live_report = false;  // max live values of each kernel in the IR
+    int max_live_values = 0;   // global kernels above it are split, 0 turns off the fission
+    std::vector<std::pair<std::string, std::vector<std::string>>> kernel_groups;  // horizontal fusion: name -> kernels
+    std::vector<std::string> multi_tensor_kernels;  // get a variant over a chunk table
+    std::vector<SpecializationKey> specializations;  // compiled into separate (cached) ptx files
+    bool async_copy = false;  // staging of the read-only tensors, the kind is selected by the sm version
+    int num_threads = 0;      // threads of the parser and of the codegen, 0 for the number of cores
+    bool streaming = false;   // the units of the source are parsed, built and released one after the other
+    std::vector<std::string> selected_kernels;  // only these global kernels, pipelines (and their callees) are compiled
+    std::string build_folder = "";  // ptx of the codegen units kept between the runs, empty turns off the incremental build
+    std::string cache_folder = "";  // ptx of whole compilations by the hash of the source and the options
+    uint64_t max_cache_size = 256ull << 20;  // bytes, the least recently used entries are evicted above it
+};
 
 static void print_version_info();
 
 static void print_help_info();
 
+static void parse_elems_per_thread(const std::string& arg_value, CompileOptions& options);
+
+static void parse_kernel_group(const std::string& arg_value, CompileOptions& options);
+
+static void parse_specialization(const std::string& arg_value, CompileOptions& options);
+
+static int get_elems_per_thread(const CompileOptions& options, const std::string& kernel_name);
+
+/**
+ * Checks that the per-kernel overrides of --elems-per-thread name global kernels of the source
+ * (pipelines and, with --autodiff, the <name>_grad backward kernels included).
+ */
+static void check_kernel_elems_per_thread(
+    const std::vector<KernelNodePtr>& kernels,
+    const std::vector<PipelinePtr>& pipelines,
+    const CompileOptions& options);
+
+/**
+ * The options changing the outputs (all but the paths and the number of threads) in a fixed order.
+ */
+static std::string get_options_key(const CompileOptions& options);
+
+static KernelNodePtr find_kernel(
+    const std::vector<KernelNodePtr>& kernels,
+    const std::string& kernel_name,
+    const std::string& option);
+
+static std::vector<KernelNodePtr> transform_kernels(
+    const std::vector<KernelNodePtr>& parsed_kernels,
+    const std::vector<PipelinePtr>& pipelines,
+    const CompileOptions& options,
+    ASTPassManager& pass_manager,
+    std::string& launch_sequence);
+
+static std::ofstream open_output_file(const std::string& file_path, const std::string& file_kind);
+
+static void save_launch_sequence(const std::string& launch_file_path, const std::string& launch_sequence);
+
 static void compile_source_file(
     const std::string& tgl_path, 
-    const Target target, 
-    const bool save_temps,
-    const std::string& out_folder_path,
-    const std::string& sm_xx);
+    const CompileOptions& options);
+
+/**
+ * Compiles the source into the ptx (and the other outputs), gives the launch sequence.
+ */
+static std::string build_source_file(
+    const std::string& tgl_path,
+    const std::string& temp_path,
+    const CompileOptions& options);
+
+/**
+ * Compiles the units of the source one after the other (--stream), gives the launch sequence.
+ */
+static std::string stream_source_file(
+    const std::string& tgl_path,
+    const std::string& temp_path,
+    const CompileOptions& options);
 
 int main(int argc, char** argv)
 {
@@ -37,10 +123,7 @@ int main(int argc, char** argv)
     else
     {
         std::string path_to_tgl = "";
-        Target target = Target::NVIDIA_GPU;
-        bool save_temps = false;
-        std::string out_folder_path = "";
-        std::string sm_xx = "";
+        CompileOptions options;
 
         int arg_ix = 1;
         while (arg_ix < argc)
@@ -68,7 +151,7 @@ int main(int argc, char** argv)
                 
                 if (trg_str == "nvidia")
                 {
-                    target = Target::NVIDIA_GPU;
+                    options.target = Target::NVIDIA_GPU;
                 }
                 else
                 {
@@ -83,17 +166,130 @@ int main(int argc, char** argv)
             }
             else if (arg_str == "--save-temps")
             {
-                save_temps = true;
+                options.save_temps = true;
                 arg_ix += 1;
             }
             else if (arg_str == "--out")
             {
-                out_folder_path = argv[arg_ix + 1];
+                options.out_folder_path = argv[arg_ix + 1];
                 arg_ix += 2;
             }
             else if (arg_str == "--sm")
             {
-                sm_xx = "sm_" + std::string(argv[arg_ix + 1]);
+                options.sm_xx = "sm_" + std::string(argv[arg_ix + 1]);
+                arg_ix += 2;
+            }
+            else if (arg_str == "--autodiff")
+            {
+                options.autodiff = true;
+                arg_ix += 1;
+            }
+            else if (arg_str == "--no-ast-opt")
+            {
+                options.ast_opt = false;
+                arg_ix += 1;
+            }
+            else if (arg_str == "--pass-stats")
+            {
+                options.pass_stats = true;
+                arg_ix += 1;
+            }
+            else if (arg_str == "--async-copy")
+            {
+                options.async_copy = true;
+                arg_ix += 1;
+            }
+            else if (arg_str == "--live-report")
+            {
+                options.live_report = true;
+                arg_ix += 1;
+            }
+            else if (arg_str == "--max-live")
+            {
+                std::string limit_str = argv[arg_ix + 1];
+                bool is_count = !limit_str.empty() && limit_str.size() < 5 && std::all_of(limit_str.begin(), limit_str.end(), ::isdigit);
+                if (!is_count || std::stoi(limit_str) < 1)
+                {
+                    std::stringstream ss;
+                    ss << "Expected a positive number of live values for --max-live. Instead got ";
+                    ss << limit_str;
+                    ss << ". See --help for details!";
+                    emit_error(ss.str());
+                }
+
+                options.max_live_values = std::stoi(limit_str);
+                arg_ix += 2;
+            }
+            else if (arg_str == "--jobs")
+            {
+                std::string jobs_str = argv[arg_ix + 1];
+                bool is_count = !jobs_str.empty() && jobs_str.size() < 5 && std::all_of(jobs_str.begin(), jobs_str.end(), ::isdigit);
+                if (!is_count || std::stoi(jobs_str) < 1)
+                {
+                    std::stringstream ss;
+                    ss << "Expected a positive number of threads for --jobs. Instead got ";
+                    ss << jobs_str;
+                    ss << ". See --help for details!";
+                    emit_error(ss.str());
+                }
+
+                options.num_threads = std::stoi(jobs_str);
+                arg_ix += 2;
+            }
+            else if (arg_str == "--build-dir")
+            {
+                options.build_folder = argv[arg_ix + 1];
+                arg_ix += 2;
+            }
+            else if (arg_str == "--cache-dir")
+            {
+                options.cache_folder = argv[arg_ix + 1];
+                arg_ix += 2;
+            }
+            else if (arg_str == "--cache-size")
+            {
+                std::string size_str = argv[arg_ix + 1];
+                bool is_size = !size_str.empty() && size_str.size() < 7 && std::all_of(size_str.begin(), size_str.end(), ::isdigit);
+                if (!is_size || std::stoi(size_str) < 1)
+                {
+                    std::stringstream ss;
+                    ss << "Expected a positive size in MB for --cache-size. Instead got ";
+                    ss << size_str;
+                    ss << ". See --help for details!";
+                    emit_error(ss.str());
+                }
+
+                options.max_cache_size = uint64_t(std::stoi(size_str)) << 20;
+                arg_ix += 2;
+            }
+            else if (arg_str == "--kernel")
+            {
+                options.selected_kernels.push_back(argv[arg_ix + 1]);
+                arg_ix += 2;
+            }
+            else if (arg_str == "--stream")
+            {
+                options.streaming = true;
+                arg_ix += 1;
+            }
+            else if (arg_str == "--elems-per-thread")
+            {
+                parse_elems_per_thread(argv[arg_ix + 1], options);
+                arg_ix += 2;
+            }
+            else if (arg_str == "--multi-tensor")
+            {
+                options.multi_tensor_kernels.push_back(argv[arg_ix + 1]);
+                arg_ix += 2;
+            }
+            else if (arg_str == "--specialize")
+            {
+                parse_specialization(argv[arg_ix + 1], options);
+                arg_ix += 2;
+            }
+            else if (arg_str == "--hfuse")
+            {
+                parse_kernel_group(argv[arg_ix + 1], options);
                 arg_ix += 2;
             }
             else
@@ -106,9 +302,15 @@ int main(int argc, char** argv)
             }
         }
 
+        bool needs_all_kernels = !options.kernel_groups.empty() || !options.multi_tensor_kernels.empty() || !options.specializations.empty();
+        if (options.streaming && (needs_all_kernels || !options.selected_kernels.empty() || !options.build_folder.empty()))
+        {
+            emit_error("--stream can not be combined with --hfuse, --multi-tensor, --specialize, --kernel or --build-dir. See --help for details!");
+        }
+
         if (path_to_tgl != "")
         {
-            compile_source_file(path_to_tgl, target, save_temps, out_folder_path, sm_xx);
+            compile_source_file(path_to_tgl, options);
         }
         else
         {
@@ -125,7 +327,7 @@ int main(int argc, char** argv)
 
 void print_version_info()
 {
-    std::cout << "Tiny GPU language compiler (TGLC) - v1.0.0 \n"; 
+    std::cout << "Tiny GPU language compiler (TGLC) - " << tglc_version << " \n"; 
 }
 
 void print_help_info()
@@ -142,33 +344,404 @@ void print_help_info()
     ss << "    --save-temps  : if present, saves the ll and ast files (defaults to false) \n";
     ss << "    --out         : if present, it has to be a folder path for saving files \n";
     ss << "    --sm          : if present, it will set the .target directive in the output ptx (default is given by llvm, regularly sm_30) \n";
+    ss << "    --autodiff    : if present, a backward kernel (<name>_grad) is generated for each global kernel \n";
+    ss << "    --elems-per-thread : N or kernel_name=N, each thread of the global kernels processes N elements (defaults to 1) \n";
+    ss << "    --no-ast-opt  : if present, the AST optimization passes are skipped \n";
+    ss << "    --pass-stats  : if present, prints the number of rewrites of each AST pass \n";
+    ss << "    --async-copy  : if present, global kernels stage their inputs in shared memory (cp.async from sm_80, bulk copies from sm_90) \n";
+    ss << "    --live-report : if present, prints the maximum number of live values of each kernel \n";
+    ss << "    --max-live    : N, global kernels with more estimated live values are split into several kernels \n";
+    ss << "    --hfuse       : name=kernel1,kernel2,..., adds a global kernel running the listed global kernels in one launch \n";
+    ss << "    --multi-tensor : kernel name, adds a variant (<name>_multi) of the global kernel over a table of tensor chunks \n";
+    ss << "    --specialize  : kernel[N]:scalar=value,..., compiles the kernel for N elements and the given scalars into a cached ptx \n";
+    ss << "    --jobs        : N, the kernels are parsed and built on N threads (defaults to the number of cores) \n";
+    ss << "    --kernel      : global kernel or pipeline name, only the listed ones and the kernels they call are compiled (repeatable) \n";
+    ss << "    --build-dir   : folder path, keeps the ptx of the kernels between the runs, only the changed kernels are built again \n";
+    ss << "    --cache-dir   : folder path, the ptx of the same source and options is taken from there without compiling \n";
+    ss << "    --cache-size  : N, the cache folder is kept below N MB, the least recently used entries are removed (defaults to 256) \n";
+    ss << "    --stream      : if present, the independent units of the source are parsed, built and released one by one (less memory) \n";
     ss << "\n";
 
     std::cout << ss.str();
 }
 
+void parse_elems_per_thread(const std::string& arg_value, CompileOptions& options)
+{
+    // either N (all of the global kernels) or kernel_name=N
+    auto sep_pos = arg_value.find('=');
+    std::string kernel_name = sep_pos == std::string::npos ? "" : arg_value.substr(0, sep_pos);
+    std::string count_str = sep_pos == std::string::npos ? arg_value : arg_value.substr(sep_pos + 1);
+
+    bool is_count = !count_str.empty() && count_str.size() < 4 && std::all_of(count_str.begin(), count_str.end(), ::isdigit);
+    if (!is_count || std::stoi(count_str) < 1)
+    {
+        std::stringstream ss;
+        ss << "Expected a positive element count for --elems-per-thread. Instead got ";
+        ss << arg_value;
+        ss << ". See --help for details!";
+        emit_error(ss.str());
+    }
+
+    if (kernel_name.empty())
+    {
+        options.elems_per_thread = std::stoi(count_str);
+    }
+    else
+    {
+        options.kernel_elems_per_thread.insert_or_assign(kernel_name, std::stoi(count_str));
+    }
+}
+
+void parse_kernel_group(const std::string& arg_value, CompileOptions& options)
+{
+    // group_name=kernel1,kernel2,...
+    auto sep_pos = arg_value.find('=');
+    std::string group_name = sep_pos == std::string::npos ? "" : arg_value.substr(0, sep_pos);
+
+    std::vector<std::string> kernel_names;
+    if (sep_pos != std::string::npos)
+    {
+        std::stringstream names(arg_value.substr(sep_pos + 1));
+        std::string kernel_name;
+        while (std::getline(names, kernel_name, ','))
+        {
+            kernel_names.push_back(kernel_name);
+        }
+    }
+
+    bool has_empty = std::any_of(kernel_names.begin(), kernel_names.end(), [](const std::string& name) { return name.empty(); });
+    if (group_name.empty() || kernel_names.size() < 2 || has_empty)
+    {
+        std::stringstream ss;
+        ss << "Expected a name and at least two kernels for --hfuse (name=kernel1,kernel2). Instead got ";
+        ss << arg_value;
+        ss << ". See --help for details!";
+        emit_error(ss.str());
+    }
+
+    options.kernel_groups.push_back({group_name, kernel_names});
+}
+
+void parse_specialization(const std::string& arg_value, CompileOptions& options)
+{
+    // kernel_name[N]:scalar1=value1,scalar2=value2, both parts are optional
+    auto emit_format_error = [&]()
+    {
+        std::stringstream ss;
+        ss << "Expected kernel[N]:scalar=value,... for --specialize. Instead got ";
+        ss << arg_value;
+        ss << ". See --help for details!";
+        emit_error(ss.str());
+    };
+
+    SpecializationKey key;
+    auto sep_pos = arg_value.find(':');
+    std::string kernel_str = arg_value.substr(0, sep_pos);
+
+    auto size_pos = kernel_str.find('[');
+    key.kernel_name = kernel_str.substr(0, size_pos);
+    if (size_pos != std::string::npos)
+    {
+        std::string count_str = kernel_str.substr(size_pos + 1);
+        if (count_str.size() < 2 || count_str.back() != ']')
+            emit_format_error();
+
+        count_str.pop_back();
+        bool is_count = count_str.size() < 10 && std::all_of(count_str.begin(), count_str.end(), ::isdigit);
+        if (!is_count || std::stoi(count_str) < 1)
+            emit_format_error();
+
+        key.num_elements = std::stoi(count_str);
+    }
+
+    if (sep_pos != std::string::npos)
+    {
+        std::stringstream values(arg_value.substr(sep_pos + 1));
+        std::string item;
+        while (std::getline(values, item, ','))
+        {
+            auto eq_pos = item.find('=');
+            if (eq_pos == std::string::npos || eq_pos == 0)
+                emit_format_error();
+
+            std::istringstream value_stream(item.substr(eq_pos + 1));
+            float value = 0.f;
+            value_stream >> value;
+            if (value_stream.fail() || !value_stream.eof())
+                emit_format_error();
+
+            key.scalar_values.insert_or_assign(item.substr(0, eq_pos), value);
+        }
+    }
+
+    if (key.kernel_name.empty() || (key.num_elements == 0 && key.scalar_values.empty()))
+        emit_format_error();
+
+    options.specializations.push_back(key);
+}
+
+int get_elems_per_thread(const CompileOptions& options, const std::string& kernel_name)
+{
+    auto kernel_elems = options.kernel_elems_per_thread.find(kernel_name);
+    return kernel_elems == options.kernel_elems_per_thread.end() ? options.elems_per_thread : kernel_elems->second;
+}
+
+void check_kernel_elems_per_thread(
+    const std::vector<KernelNodePtr>& kernels,
+    const std::vector<PipelinePtr>& pipelines,
+    const CompileOptions& options)
+{
+    auto is_kernel = [&](const std::string& name)
+    {
+        return std::any_of(kernels.begin(), kernels.end(), [&](const KernelNodePtr& k) { return k->name == name; });
+    };
+    auto is_pipeline = [&](const std::string& name)
+    {
+        return std::any_of(pipelines.begin(), pipelines.end(), [&](const PipelinePtr& p) { return p->name == name; });
+    };
+
+    // in the order of the names, the map has no fixed order
+    std::map<std::string, int> kernel_elems_per_thread(options.kernel_elems_per_thread.begin(), options.kernel_elems_per_thread.end());
+    for (auto& [kernel_name, elems_per_thread] : kernel_elems_per_thread)
+    {
+        // a backward kernel is checked by its forward kernel
+        std::string forward_name = kernel_name;
+        if (options.autodiff && kernel_name.ends_with("_grad") && !is_kernel(kernel_name) && !is_pipeline(kernel_name))
+        {
+            forward_name = kernel_name.substr(0, kernel_name.size() - 5);
+        }
+
+        if (is_pipeline(forward_name))
+            continue;
+
+        if (find_kernel(kernels, forward_name, "--elems-per-thread")->scope != KernelScope::GLOBAL)
+        {
+            std::stringstream ss;
+            ss << "Expected a global kernel for --elems-per-thread. Instead got the device kernel ";
+            ss << forward_name;
+            ss << ". See --help for details!";
+            emit_error(ss.str());
+        }
+    }
+}
+
+std::string get_options_key(const CompileOptions& options)
+{
+    std::stringstream ss;
+    ss << "tglc " << tglc_version << "\n";
+    ss << "target " << static_cast<int>(options.target) << ", " << options.sm_xx << "\n";
+    ss << "autodiff " << options.autodiff << ", ast opt " << options.ast_opt << ", max live " << options.max_live_values << "\n";
+    ss << "async copy " << options.async_copy << ", stream " << options.streaming << "\n";
+
+    // ordered by the kernel name, the map has no fixed order
+    std::map<std::string, int> kernel_elems_per_thread(options.kernel_elems_per_thread.begin(), options.kernel_elems_per_thread.end());
+    ss << "elems per thread " << options.elems_per_thread;
+    for (auto& [kernel_name, elems_per_thread] : kernel_elems_per_thread)
+    {
+        ss << ", " << kernel_name << "=" << elems_per_thread;
+    }
+    ss << "\n";
+
+    for (auto& [group_name, kernel_names] : options.kernel_groups)
+    {
+        ss << "hfuse " << group_name << "=";
+        for (auto& kernel_name : kernel_names)
+        {
+            ss << kernel_name << ",";
+        }
+        ss << "\n";
+    }
+
+    for (auto& kernel_name : options.multi_tensor_kernels)
+    {
+        ss << "multi tensor " << kernel_name << "\n";
+    }
+
+    for (auto& kernel_name : options.selected_kernels)
+    {
+        ss << "kernel " << kernel_name << "\n";
+    }
+    return ss.str();
+}
+
+KernelNodePtr find_kernel(
+    const std::vector<KernelNodePtr>& kernels,
+    const std::string& kernel_name,
+    const std::string& option)
+{
+    auto kernel = std::find_if(kernels.begin(), kernels.end(), [&](const KernelNodePtr& k) { return k->name == kernel_name; });
+    if (kernel == kernels.end())
+    {
+        std::stringstream ss;
+        ss << "Unknown kernel " << kernel_name << " in " << option << ".";
+        emit_error(ss.str());
+    }
+    return *kernel;
+}
+
+std::vector<KernelNodePtr> transform_kernels(
+    const std::vector<KernelNodePtr>& parsed_kernels,
+    const std::vector<PipelinePtr>& pipelines,
+    const CompileOptions& options,
+    ASTPassManager& pass_manager,
+    std::string& launch_sequence)
+{
+    auto kernels = parsed_kernels;
+
+    // each pipeline becomes a single global kernel
+    for (auto pipeline : pipelines)
+    {
+        kernels.push_back(fuse_pipeline(*pipeline));
+    }
+
+    if (options.autodiff)
+    {
+        // the backward kernel follows its forward kernel
+        std::vector<KernelNodePtr> all_kernels;
+        for (auto kernel : kernels)
+        {
+            all_kernels.push_back(kernel);
+            if (kernel->scope == KernelScope::GLOBAL)
+            {
+                all_kernels.push_back(build_backward_kernel(kernel));
+            }
+        }
+        kernels = all_kernels;
+    }
+
+    if (options.ast_opt)
+    {
+        pass_manager.run(kernels);
+    }
+
+    if (options.max_live_values > 0)
+    {
+        // the parts replace the split kernel
+        KernelFission fission(options.max_live_values);
+        std::vector<KernelNodePtr> all_kernels;
+        for (auto kernel : kernels)
+        {
+            auto parts = fission.split_kernel(kernel);
+            all_kernels.insert(all_kernels.end(), parts.begin(), parts.end());
+        }
+        kernels = all_kernels;
+        launch_sequence += fission.get_launch_sequence();
+    }
+    return kernels;
+}
+
+std::ofstream open_output_file(const std::string& file_path, const std::string& file_kind)
+{
+    std::ofstream out_file(file_path, std::ios::binary);
+    if (!out_file)
+    {
+        std::stringstream ss;
+        ss << "Error while opening " << file_kind << " file ";
+        ss << file_path;
+        emit_error(ss.str());
+    }
+    return out_file;
+}
+
+void save_launch_sequence(const std::string& launch_file_path, const std::string& launch_sequence)
+{
+    if (!launch_sequence.empty())
+    {
+        auto launch_file = open_output_file(launch_file_path, "launch");
+        launch_file << launch_sequence;
+        std::cout << "Launch sequence was saved into " << launch_file_path << "\n";
+    }
+}
+
 void compile_source_file(
     const std::string& tgl_path, 
-    const Target target, 
-    const bool save_temps,
-    const std::string& out_folder_path,
-    const std::string& sm_xx)
+    const CompileOptions& options)
 {
     std::cout << "TinyGPUlang compiler \n";
-    
+
     std::string temp_path = tgl_path;
-    if (out_folder_path != "")
+    if (options.out_folder_path != "")
     {
-        temp_path = replace_folder_path(tgl_path, out_folder_path);
+        temp_path = replace_folder_path(tgl_path, options.out_folder_path);
     }
 
-    std::string ast_file_path = replace_extension(temp_path, "ast");;
     std::string ptx_file_path = replace_extension(temp_path, "ptx");
+    std::string launch_file_path = replace_extension(temp_path, "launch");
+
+    // the cached ptx of the same source and options, the other outputs (e.g. the temps) are not kept
+    bool needs_all_outputs = options.save_temps || options.pass_stats || options.live_report || !options.specializations.empty();
+    std::optional<PTXCache> ptx_cache;
+    std::string cache_key;
+    if (!options.cache_folder.empty() && !needs_all_outputs)
+    {
+        ptx_cache.emplace(options.cache_folder, options.max_cache_size);
+        cache_key = ptx_cache->get_key(read_file(tgl_path), get_options_key(options));
+        if (ptx_cache->restore(cache_key, ptx_file_path, launch_file_path))
+        {
+            std::cout << "Ptx was found in the cache " << options.cache_folder << "\n";
+            std::cout << "Ptx was generated into " << ptx_file_path << "\n";
+            return;
+        }
+    }
+
+    // the nodes of the source file (ids from 0), freed together at the end
+    ASTContext ast_context;
+    ASTContextScope ast_context_scope(ast_context);
 
-    TGLparser parser(tgl_path);
-    auto kernels = parser.get_all_kernels();
+    std::string launch_sequence = options.streaming ?
+        stream_source_file(tgl_path, temp_path, options) : build_source_file(tgl_path, temp_path, options);
+
+    if (ptx_cache)
+    {
+        ptx_cache->store(cache_key, ptx_file_path, launch_sequence);
+    }
+}
+
+std::string build_source_file(
+    const std::string& tgl_path,
+    const std::string& temp_path,
+    const CompileOptions& options)
+{
+    std::string ast_file_path = replace_extension(temp_path, "ast");
+    std::string ptx_file_path = replace_extension(temp_path, "ptx");
+    std::string launch_file_path = replace_extension(temp_path, "launch");
+    std::string launch_sequence;
+
+    // with selected kernels only the bodies needed by them are parsed
+    bool is_selective = !options.selected_kernels.empty();
+    TGLparser parser(tgl_path, options.num_threads, is_selective);
+    SourceUnit source = {parser.get_all_kernels(), parser.get_all_pipelines()};
+    check_kernel_elems_per_thread(source.kernels, source.pipelines, options);
+    if (options.autodiff)
+    {
+        check_backward_kernel_names(source.kernels, source.pipelines);
+    }
+    if (is_selective)
+    {
+        for (auto& kernel_name : options.selected_kernels)
+        {
+            bool is_pipeline = std::any_of(source.pipelines.begin(), source.pipelines.end(),
+                [&](const PipelinePtr& pipeline) { return pipeline->name == kernel_name; });
+            if (!is_pipeline && find_kernel(source.kernels, kernel_name, "--kernel")->scope != KernelScope::GLOBAL)
+            {
+                std::stringstream ss;
+                ss << "Expected a global kernel or a pipeline for --kernel. Instead got the device kernel ";
+                ss << kernel_name;
+                ss << ". See --help for details!";
+                emit_error(ss.str());
+            }
+        }
+        source = parser.parse_selected_kernels(options.selected_kernels);
+    }
+
+    auto pass_manager = ASTPassManager::create_default_pipeline();
+    auto kernels = transform_kernels(source.kernels, source.pipelines, options, pass_manager, launch_sequence);
+    if (options.ast_opt && options.pass_stats)
+    {
+        std::cout << pass_manager.get_statistics();
+    }
     
-    if (save_temps)
+    if (options.save_temps)
     {
         auto printer = std::make_shared<ASTPrinter>();
         for (auto kernel : kernels)
@@ -178,10 +751,259 @@ void compile_source_file(
         printer->save_into_file(ast_file_path);
     }
     
-    PTXGenerator ptx_generator;
-    for (auto kernel : kernels)
+    AsyncCopy async_copy = options.async_copy ? select_async_copy(options.sm_xx) : AsyncCopy::NONE;
+
+    std::vector<std::pair<std::string, std::vector<KernelNodePtr>>> kernel_groups;
+    for (auto& [group_name, kernel_names] : options.kernel_groups)
+    {
+        std::vector<KernelNodePtr> group_kernels;
+        for (auto& kernel_name : kernel_names)
+        {
+            group_kernels.push_back(find_kernel(kernels, kernel_name, "--hfuse " + group_name));
+        }
+        kernel_groups.push_back({group_name, group_kernels});
+    }
+
+    std::vector<KernelNodePtr> multi_tensor_kernels;
+    for (auto& kernel_name : options.multi_tensor_kernels)
+    {
+        multi_tensor_kernels.push_back(find_kernel(kernels, kernel_name, "--multi-tensor"));
+    }
+
+    // independent kernels are built in parallel, each unit into its own llvm context
+    auto units = split_into_codegen_units(kernels, kernel_groups, multi_tensor_kernels);
+    std::vector<std::stringstream> unit_logs(units.size());
+    std::vector<std::unique_ptr<PTXGenerator>> ptx_generators;
+    for (auto& unit_log : unit_logs)
+    {
+        ptx_generators.push_back(std::make_unique<PTXGenerator>(unit_log));
+    }
+
+    std::vector<std::string> group_launches(kernel_groups.size());
+    std::vector<std::string> multi_tensor_launches(multi_tensor_kernels.size());
+    bool uses_bulk_copies = needs_bulk_copies(kernels, async_copy);
+
+    // the ptx of the unchanged units is taken from the build folder (empty code: the unit is built)
+    std::optional<IncrementalBuild> incremental_build;
+    std::vector<std::string> unit_hashes(units.size());  // empty if the unit is not kept
+    std::vector<std::string> module_codes(units.size());
+    std::vector<bool> is_reused(units.size(), false);
+    if (!options.build_folder.empty())
+    {
+        std::stringstream ss;
+        ss << "tglc " << tglc_version << ", target " << static_cast<int>(options.target) << ", " << options.sm_xx;
+        ss << ", async copy " << static_cast<int>(async_copy) << ", bulk copies " << uses_bulk_copies;
+        incremental_build.emplace(options.build_folder, tgl_path, ss.str());
+
+        for (int unit_ix = 0; unit_ix < units.size(); ++unit_ix)
+        {
+            // the launches of the fused kernels are not kept, these units are always built
+            auto& unit = units[unit_ix];
+            if (!unit.kernel_groups.empty() || !unit.multi_tensor_kernels.empty())
+                continue;
+
+            std::vector<int> elems_per_thread;
+            for (auto& kernel : unit.kernels)
+            {
+                elems_per_thread.push_back(get_elems_per_thread(options, kernel->name));
+            }
+            unit_hashes[unit_ix] = incremental_build->get_unit_hash(unit.kernels, elems_per_thread);
+            module_codes[unit_ix] = incremental_build->load_unit_ptx(unit_hashes[unit_ix]);
+            is_reused[unit_ix] = !module_codes[unit_ix].empty();
+        }
+    }
+
+    // the IR of the reused units is needed only for the .ll file and the live report
+    bool needs_all_ir = options.save_temps || options.live_report;
+
+    ThreadPool thread_pool(options.num_threads);
+    thread_pool.parallel_for(static_cast<int>(units.size()), [&](const int unit_ix)
+    {
+        if (is_reused[unit_ix] && !needs_all_ir)
+            return;
+
+        auto& ptx_generator = *ptx_generators[unit_ix];
+        for (auto kernel : units[unit_ix].kernels)
+        {
+            ptx_generator.build_ir_from_kernel(kernel, get_elems_per_thread(options, kernel->name), async_copy);
+        }
+
+        for (int group_ix : units[unit_ix].kernel_groups)
+        {
+            auto& [group_name, group_kernels] = kernel_groups[group_ix];
+            group_launches[group_ix] = ptx_generator.build_ir_from_kernel_group(group_name, group_kernels);
+        }
+
+        for (int multi_ix : units[unit_ix].multi_tensor_kernels)
+        {
+            multi_tensor_launches[multi_ix] = ptx_generator.build_ir_from_multi_tensor_kernel(multi_tensor_kernels[multi_ix]);
+        }
+    });
+
+    std::unordered_map<std::string, int> kernel_units;
+    for (int unit_ix = 0; unit_ix < units.size(); ++unit_ix)
+    {
+        std::cout << unit_logs[unit_ix].str();
+        for (auto& kernel : units[unit_ix].kernels)
+        {
+            kernel_units.insert({kernel->name, unit_ix});
+        }
+    }
+
+    for (auto& group_launch : group_launches)
     {
-        ptx_generator.build_ir_from_kernel(kernel);
+        launch_sequence += group_launch;
     }
-    ptx_generator.generate_ptx(ptx_file_path, sm_xx, save_temps);
+
+    for (auto& multi_tensor_launch : multi_tensor_launches)
+    {
+        launch_sequence += multi_tensor_launch;
+    }
+
+    if (!options.specializations.empty())
+    {
+        auto cache_folder = std::filesystem::path(temp_path).parent_path().string();
+        KernelSpecializer specializer(kernels, ptx_file_path, cache_folder, options.sm_xx);
+        for (auto& key : options.specializations)
+        {
+            auto specialized = specializer.specialize(key);
+            std::cout << "Specialized kernel " << key.to_string();
+            std::cout << (specializer.was_cache_hit() ? " was found in the cache " : " was saved into ");
+            std::cout << specialized.ptx_file_path << "\n";
+
+            std::stringstream ss;
+            ss << key.to_string() << ": " << specialized.ptx_file_path;
+            if (specialized.num_threads > 0)
+            {
+                ss << ", " << specialized.num_threads << " threads x " << specialized.elems_per_thread << " elements";
+            }
+            ss << "\n";
+            launch_sequence += ss.str();
+        }
+    }
+
+    save_launch_sequence(launch_file_path, launch_sequence);
+
+    if (options.live_report)
+    {
+        for (auto kernel : kernels)
+        {
+            std::cout << "Max live values in " << kernel->name << ": ";
+            std::cout << ptx_generators[kernel_units.at(kernel->name)]->get_max_live_values(kernel->name) << "\n";
+        }
+    }
+    generate_ptx(ptx_generators, thread_pool, ptx_file_path, options.sm_xx, options.save_temps, uses_bulk_copies, module_codes);
+
+    if (incremental_build)
+    {
+        int num_reused_units = static_cast<int>(std::count(is_reused.begin(), is_reused.end(), true));
+        for (int unit_ix = 0; unit_ix < units.size(); ++unit_ix)
+        {
+            if (!unit_hashes[unit_ix].empty() && !is_reused[unit_ix])
+            {
+                incremental_build->save_unit_ptx(unit_hashes[unit_ix], module_codes[unit_ix]);
+            }
+        }
+        incremental_build->remove_unused_fragments(unit_hashes);
+
+        std::cout << "Reused " << num_reused_units << " of " << units.size() << " units from " << options.build_folder << "\n";
+    }
+    return launch_sequence;
+}
+
+std::string stream_source_file(
+    const std::string& tgl_path,
+    const std::string& temp_path,
+    const CompileOptions& options)
+{
+    std::string ast_file_path = replace_extension(temp_path, "ast");
+    std::string ll_file_path = replace_extension(temp_path, "ll");
+    std::string ptx_file_path = replace_extension(temp_path, "ptx");
+    std::string launch_file_path = replace_extension(temp_path, "launch");
+    std::string launch_sequence;
+
+    // only the kernel headers and the pipelines are kept for the whole source
+    TGLparser parser(tgl_path, options.num_threads, true);
+    check_kernel_elems_per_thread(parser.get_all_kernels(), parser.get_all_pipelines(), options);
+    if (options.autodiff)
+    {
+        check_backward_kernel_names(parser.get_all_kernels(), parser.get_all_pipelines());
+    }
+    auto pass_manager = ASTPassManager::create_default_pipeline();
+    AsyncCopy async_copy = options.async_copy ? select_async_copy(options.sm_xx) : AsyncCopy::NONE;
+
+    // the ptx version of the units has to be the same, it can not wait for the last unit
+    bool uses_bulk_copies = async_copy == AsyncCopy::BULK_COPY;
+
+    std::ofstream ast_file;
+    std::ofstream ll_file;
+    if (options.save_temps)
+    {
+        ast_file = open_output_file(ast_file_path, "ast");
+        ll_file = open_output_file(ll_file_path, "ll");
+    }
+    auto ptx_file = open_output_file(ptx_file_path, "ptx");
+
+    if (parser.get_num_units() == 0)
+    {
+        // still a valid ptx file with its header
+        ptx_file << PTXGenerator().generate_ptx_code(options.sm_xx, uses_bulk_copies);
+    }
+
+    int next_call_seq = 0;
+    for (int unit_ix = 0; unit_ix < parser.get_num_units(); ++unit_ix)
+    {
+        // the nodes of the unit are freed with its context, their ids follow the ids of the headers
+        ASTContext unit_context;
+        unit_context.reserve_ids(ASTContext::get_current().get_num_ids());
+        ASTContextScope unit_context_scope(unit_context);
+
+        auto unit = parser.parse_unit(unit_ix);
+        auto kernels = transform_kernels(unit.kernels, unit.pipelines, options, pass_manager, launch_sequence);
+
+        if (options.save_temps)
+        {
+            ASTPrinter printer;
+            for (auto kernel : kernels)
+            {
+                kernel->accept(printer);
+            }
+            ast_file << printer.get_ast_string();
+        }
+
+        PTXGenerator ptx_generator;
+        for (auto kernel : kernels)
+        {
+            ptx_generator.build_ir_from_kernel(kernel, get_elems_per_thread(options, kernel->name), async_copy);
+        }
+
+        if (options.save_temps)
+        {
+            ptx_generator.print_ir(ll_file);
+        }
+
+        if (options.live_report)
+        {
+            for (auto kernel : kernels)
+            {
+                std::cout << "Max live values in " << kernel->name << ": ";
+                std::cout << ptx_generator.get_max_live_values(kernel->name) << "\n";
+            }
+        }
+
+        // the header is kept only from the first unit, the calls are numbered in the order of the units
+        auto ptx_code = ptx_generator.generate_ptx_code(options.sm_xx, uses_bulk_copies);
+        ptx_file << renumber_call_sequences(unit_ix == 0 ? std::string_view(ptx_code) : remove_ptx_header(ptx_code), next_call_seq);
+
+        parser.release_unit(unit_ix);
+    }
+
+    if (options.ast_opt && options.pass_stats)
+    {
+        std::cout << pass_manager.get_statistics();
+    }
+
+    save_launch_sequence(launch_file_path, launch_sequence);
+    std::cout << "Ptx was generated into " << ptx_file_path << "\n";
+    return launch_sequence;
 }
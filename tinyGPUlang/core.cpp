@@ -1,26 +1,6 @@
 #include "core.hpp"
 
-int GlobalUUIDGenerator::generate_uuid()
-{
-    int id = 0;
-    lock_obj.lock();
-    id = next_id++;
-    lock_obj.unlock();
-    return id;
-}
-
-void GlobalUUIDGenerator::reset()
-{
-    next_id = 0;
-}
-
-// statics
-
-int GlobalUUIDGenerator::next_id = 0;
-std::mutex GlobalUUIDGenerator::lock_obj;
-
-
-bool is_float_number(const std::string& value_as_str)
+bool is_float_number(const std::string_view value_as_str)
 {
     bool first_dot_found = false;
     bool is_float = true;
@@ -69,4 +49,193 @@ void emit_error(const std::string& error_msg, const int line, const int pos)
 
     std::cerr << error_msg << "\n"; 
     exit(1);
-}
\ No newline at end of file
+}
+
+
+
+uint64_t hash_string(const std::string_view str)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : str)
+    {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string hash_to_hex(const uint64_t hash)
+{
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return ss.str();
+}
+
+std::string read_file(const std::string& file_path)
+{
+    std::ifstream in_file(file_path, std::ios::binary);
+    if (!in_file)
+    {
+        std::stringstream ss;
+        ss << "Error while opening file ";
+        ss << file_path;
+        emit_error(ss.str());
+    }
+
+    std::stringstream buffer;
+    buffer << in_file.rdbuf();
+    return buffer.str();
+}
+
+void write_file_atomically(const std::string& file_path, const std::string_view content)
+{
+    // unique between the processes writing the same file
+    std::random_device random_source;
+    std::string temp_path = file_path + ".tmp" + hash_to_hex((uint64_t(random_source()) << 32) | random_source());
+
+    {
+        std::ofstream temp_file(temp_path, std::ios::binary);
+        temp_file << content;
+        if (!temp_file)
+        {
+            std::stringstream ss;
+            ss << "Error while writing file ";
+            ss << temp_path;
+            emit_error(ss.str());
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_path, file_path, error);
+    if (error)
+    {
+        std::filesystem::remove(temp_path, error);
+
+        std::stringstream ss;
+        ss << "Error while saving file ";
+        ss << file_path;
+        emit_error(ss.str());
+    }
+}
+
+
+DisjointSets::DisjointSets(const int num_elements) : parents(num_elements)
+{
+    for (int ix = 0; ix < num_elements; ++ix)
+    {
+        parents[ix] = ix;
+    }
+}
+
+int DisjointSets::find_root(int element)
+{
+    while (parents[element] != element)
+    {
+        parents[element] = parents[parents[element]];  // path halving
+        element = parents[element];
+    }
+    return element;
+}
+
+void DisjointSets::unite(const int lhs, const int rhs)
+{
+    int lhs_root = find_root(lhs);
+    int rhs_root = find_root(rhs);
+    parents[std::max(lhs_root, rhs_root)] = std::min(lhs_root, rhs_root);
+}
+
+ThreadPool::ThreadPool(const int num_threads)
+{
+    int num_all_threads = num_threads > 0 ? num_threads : static_cast<int>(std::thread::hardware_concurrency());
+    for (int ix = 1; ix < num_all_threads; ++ix)  // the calling thread is one of them
+    {
+        workers.emplace_back([this]() { run_worker(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(lock_obj);
+        is_stopping = true;
+    }
+    work_ready.notify_all();
+
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallel_for(const int num_tasks, const std::function<void(const int)>& task)
+{
+    std::unique_lock<std::mutex> lock(lock_obj);
+    current_task = &task;
+    this->num_tasks = num_tasks;
+    next_task = 0;
+    num_finished_tasks = 0;
+    first_exception = nullptr;
+    job_generation += 1;
+    work_ready.notify_all();
+
+    run_tasks(lock);
+    work_done.wait(lock, [this]() { return num_finished_tasks == this->num_tasks; });
+    current_task = nullptr;
+
+    if (first_exception)
+    {
+        std::rethrow_exception(first_exception);
+    }
+}
+
+int ThreadPool::get_num_threads() const
+{
+    return static_cast<int>(workers.size()) + 1;
+}
+
+void ThreadPool::run_worker()
+{
+    int seen_generation = 0;
+    std::unique_lock<std::mutex> lock(lock_obj);
+    while (true)
+    {
+        work_ready.wait(lock, [&]() { return is_stopping || job_generation != seen_generation; });
+        if (is_stopping)
+            return;
+
+        seen_generation = job_generation;
+        run_tasks(lock);
+    }
+}
+
+void ThreadPool::run_tasks(std::unique_lock<std::mutex>& lock)
+{
+    while (current_task && next_task < num_tasks)
+    {
+        int task_ix = next_task++;
+        auto& task = *current_task;
+
+        lock.unlock();
+        std::exception_ptr exception;
+        try
+        {
+            task(task_ix);
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+        }
+        lock.lock();
+
+        if (exception && !first_exception)
+        {
+            first_exception = exception;
+        }
+
+        num_finished_tasks += 1;
+        if (num_finished_tasks == num_tasks)
+        {
+            work_done.notify_all();
+        }
+    }
+}
@@ -3,15 +3,28 @@
 // includes
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <filesystem>
+#include <functional>
+#include <cmath>
+#include <optional>
+#include <tuple>
+#include <random>
 
 #include <vector>
+#include <array>
+#include <algorithm>
 #include <unordered_set>
 #include <unordered_map>
+#include <map>
 
 
 /*
@@ -23,30 +36,10 @@ enum class Target
 };
 
 
-/*
-    Thread-safe uuid generator.
-    This is global. Creates an
-    id unique overall the system
-    and the execution time.
-
-    Typically used for get the ID
-    for the operators and variables.
-*/
-class GlobalUUIDGenerator
-{
-public:
-    static int generate_uuid();
-    static void reset();
-
-private:
-    static int next_id;
-    static std::mutex lock_obj;
-};
-
 /**
  * Checks if a string can be a float.
  */
-bool is_float_number(const std::string& value_as_str);
+bool is_float_number(const std::string_view value_as_str);
 
 /**
     Exchanges the path extension to another one.
@@ -76,3 +69,87 @@ std::string replace_folder_path(
     program execution.
 */
 void emit_error(const std::string& error_msg, const int line=-1, const int pos=-1);
+
+/**
+ * 64-bit FNV-1a, stable between runs (e.g. the file caches on the disk).
+ */
+uint64_t hash_string(const std::string_view str);
+
+/**
+ * The hash as 16 hex digits, e.g. for file names.
+ */
+std::string hash_to_hex(const uint64_t hash);
+
+/**
+ * Reads the whole file, stops with an error if it can not be opened.
+ */
+std::string read_file(const std::string& file_path);
+
+/**
+ * Writes a temporary file next to the file, then renames it to the file:
+ * a reader (also another tglc process) never sees a partially written file.
+ */
+void write_file_atomically(const std::string& file_path, const std::string_view content);
+
+/**
+ * Union-find over the elements 0, 1, ..., n-1 (e.g. kernels compiled together).
+ * The root of a set is its smallest element.
+ */
+class DisjointSets
+{
+public:
+    explicit DisjointSets(const int num_elements);
+
+    int find_root(int element);
+    void unite(const int lhs, const int rhs);
+
+private:
+    std::vector<int> parents;
+};
+
+/**
+ * Fixed set of worker threads for splitting a job into independent tasks
+ * (e.g. the kernels of a source file). The calling thread works on the tasks too.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * @param num_threads the threads working on the tasks with the calling one, 0 selects the number of cores
+     */
+    explicit ThreadPool(const int num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /**
+     * Runs task(0), ..., task(num_tasks - 1) and waits for all of them.
+     * The tasks are picked in increasing order. If tasks throw, one of the
+     * exceptions is rethrown after the others are finished.
+     */
+    void parallel_for(const int num_tasks, const std::function<void(const int)>& task);
+
+    int get_num_threads() const;
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex lock_obj;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+
+    const std::function<void(const int)>* current_task = nullptr;
+    int num_tasks = 0;
+    int next_task = 0;
+    int num_finished_tasks = 0;
+    int job_generation = 0;  // incremented by each parallel_for
+    bool is_stopping = false;
+    std::exception_ptr first_exception;
+
+    void run_worker();
+
+    /**
+     * Takes the tasks of the current job until none is left.
+     */
+    void run_tasks(std::unique_lock<std::mutex>& lock);
+};
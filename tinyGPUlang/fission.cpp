@@ -0,0 +1,370 @@
+#include "fission.hpp"
+
+static std::string get_type_name(const DataType dtype)
+{
+    switch (dtype)
+    {
+    case DataType::COMPLEX64:
+        return "c64";
+    case DataType::FLOAT32X2:
+        return "f32x2";
+    case DataType::FLOAT32X4:
+        return "f32x4";
+    default:
+        return "f32";
+    }
+}
+
+/**
+ * The nodes visited after the node (as in for_each_reachable_node).
+ */
+static std::vector<ASTNodePtr> get_successors(const ASTNodePtr& node)
+{
+    auto successors = get_operands(node);
+
+    if (auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(node))
+    {
+        successors.insert(successors.end(), repeat_node->body.begin(), repeat_node->body.end());
+        successors.insert(successors.end(), repeat_node->loop_vars.begin(), repeat_node->loop_vars.end());
+    }
+    else if (auto loop_var_node = std::dynamic_pointer_cast<LoopVarNode>(node))
+    {
+        successors.push_back(loop_var_node->next);
+    }
+
+    return successors;
+}
+
+static bool is_leaf(const ASTNodePtr& node)
+{
+    return std::dynamic_pointer_cast<ConstantNode>(node) || std::dynamic_pointer_cast<VariableNode>(node);
+}
+
+
+KernelFission::KernelFission(const int max_live_values) : max_live_values(max_live_values)
+{
+}
+
+int KernelFission::estimate_live_values(const KernelNode& kernel)
+{
+    analyze(kernel);
+
+    std::vector<int> live_values;
+    std::vector<int> transfers;
+    scan_ranges(0, live_values, transfers);
+    return live_values.back();
+}
+
+void KernelFission::analyze(const KernelNode& kernel)
+{
+    statements.clear();
+    values.clear();
+    owners.clear();
+    use_positions.clear();
+    unstorable_ids.clear();
+
+    for (auto& ast_node : kernel.body)
+    {
+        if (!std::dynamic_pointer_cast<ReturnNode>(ast_node))
+            statements.push_back(ast_node);
+    }
+
+    for (int pos = 0; pos < statements.size(); ++pos)
+    {
+        std::vector<ASTNodePtr> work_list = {statements[pos]};
+        while (!work_list.empty())
+        {
+            auto node = work_list.back();
+            work_list.pop_back();
+
+            if (!node || is_leaf(node))
+                continue;
+
+            // uniform values are recomputed where they are needed
+            if (node != statements[pos] && uniformity.is_uniform(node))
+                continue;
+
+            if (owners.contains(node->ast_id))
+            {
+                int owner = owners.at(node->ast_id);
+                if (owner == pos)
+                    continue;
+
+                // computed by an earlier statement, kept until this one
+                auto& positions = use_positions[node->ast_id];
+                if (positions.empty())
+                {
+                    values.push_back(node);
+
+                    auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node);
+                    auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(statements[owner]);
+                    bool is_tuple = call_node && call_node->kernel->return_values.size() != 1;
+                    bool is_loop_local = repeat_node && std::none_of(repeat_node->loop_vars.begin(), repeat_node->loop_vars.end(),
+                        [&](const LoopVarNodePtr& loop_var) { return loop_var->ast_id == node->ast_id; });
+
+                    if (is_tuple || is_loop_local)
+                    {
+                        unstorable_ids.insert(node->ast_id);
+                    }
+                }
+                if (positions.empty() || positions.back() != pos)
+                {
+                    positions.push_back(pos);
+                }
+                continue;
+            }
+
+            owners.insert({node->ast_id, pos});
+
+            auto successors = get_successors(node);
+            work_list.insert(work_list.end(), successors.begin(), successors.end());
+        }
+    }
+
+    int num_statements = static_cast<int>(statements.size());
+    statement_needs.assign(num_statements, 0);
+    uses_at.assign(num_statements, {});
+    last_uses_at.assign(num_statements, {});
+    num_owned_values.assign(num_statements, 0);
+
+    for (int pos = 0; pos < num_statements; ++pos)
+    {
+        // an alias statement computes its source
+        auto statement = statements[pos];
+        if (auto alias_node = std::dynamic_pointer_cast<AliasNode>(statement))
+            statement = alias_node->src;
+
+        statement_needs[pos] = register_need.get_need(statement);
+    }
+
+    for (int value_ix = 0; value_ix < values.size(); ++value_ix)
+    {
+        int prev_use = owners.at(values[value_ix]->ast_id);
+        ++num_owned_values[prev_use];
+        for (int use : use_positions.at(values[value_ix]->ast_id))
+        {
+            uses_at[use].push_back({value_ix, prev_use});
+            prev_use = use;
+        }
+        last_uses_at[prev_use].push_back(value_ix);
+    }
+}
+
+void KernelFission::scan_ranges(const int begin, std::vector<int>& live_values, std::vector<int>& transfers) const
+{
+    int num_statements = static_cast<int>(statements.size());
+    live_values.assign(num_statements + 1, 0);
+    transfers.assign(num_statements + 1, 0);
+
+    // values of the range kept at each position (computed before it, used from it on)
+    std::vector<int> kept_values(num_statements, 0);
+    int max_live = 0;
+    int num_transfers = 0;
+    for (int pos = begin; pos < num_statements; ++pos)
+    {
+        for (auto [value_ix, prev_use] : uses_at[pos])
+        {
+            if (owners.at(values[value_ix]->ast_id) < begin)
+            {
+                // loaded from a temporary tensor, once in the range
+                if (prev_use < begin)
+                    ++num_transfers;
+                continue;
+            }
+
+            // the value is kept from its previous use on
+            for (int kept_pos = prev_use + 1; kept_pos <= pos; ++kept_pos)
+            {
+                ++kept_values[kept_pos];
+                max_live = std::max(max_live, kept_values[kept_pos] + statement_needs[kept_pos]);
+            }
+        }
+        max_live = std::max(max_live, kept_values[pos] + statement_needs[pos]);
+
+        // stored for a later kernel until the last use is in the range
+        num_transfers += num_owned_values[pos];
+        for (int value_ix : last_uses_at[pos])
+        {
+            if (owners.at(values[value_ix]->ast_id) >= begin)
+                --num_transfers;
+        }
+
+        live_values[pos + 1] = max_live;
+        transfers[pos + 1] = num_transfers;
+    }
+}
+
+bool KernelFission::can_cut_before(const int pos) const
+{
+    for (auto& value : values)
+    {
+        if (!unstorable_ids.contains(value->ast_id))
+            continue;
+
+        if (owners.at(value->ast_id) < pos && use_positions.at(value->ast_id).back() >= pos)
+            return false;
+    }
+    return true;
+}
+
+std::vector<KernelNodePtr> KernelFission::split_kernel(const KernelNodePtr kernel)
+{
+    if (kernel->scope != KernelScope::GLOBAL)
+        return {kernel};
+
+    int live = estimate_live_values(*kernel);
+    int num_statements = static_cast<int>(statements.size());
+    if (live <= max_live_values || num_statements < 2)
+        return {kernel};
+
+    // shortest path over the cut positions: (registers above the limit, temporary transfers, kernels)
+    using Cost = std::tuple<int, int, int>;
+    std::vector<std::optional<Cost>> best(num_statements + 1);
+    std::vector<int> prev_cut(num_statements + 1, 0);
+    best[0] = Cost{0, 0, 0};
+
+    // the cost of a part starting at begin is known for every end after one scan,
+    // best[begin] is final when the parts before it are done
+    std::vector<int> range_live_values;
+    std::vector<int> range_transfers;
+    for (int begin = 0; begin < num_statements; ++begin)
+    {
+        if (!best[begin] || (begin > 0 && !can_cut_before(begin)))
+            continue;
+
+        scan_ranges(begin, range_live_values, range_transfers);
+        for (int end = begin + 1; end <= num_statements; ++end)
+        {
+            auto [overflow, transfers, parts] = *best[begin];
+            Cost cost = {
+                overflow + std::max(0, range_live_values[end] - max_live_values),
+                transfers + range_transfers[end],
+                parts + 1};
+
+            if (!best[end] || cost < *best[end])
+            {
+                best[end] = cost;
+                prev_cut[end] = begin;
+            }
+        }
+    }
+
+    std::vector<int> cuts = {num_statements};
+    while (cuts.back() > 0)
+    {
+        cuts.push_back(prev_cut[cuts.back()]);
+    }
+    std::reverse(cuts.begin(), cuts.end());
+
+    int num_parts = static_cast<int>(cuts.size()) - 1;
+    if (num_parts < 2)
+        return {kernel};
+
+    std::vector<int> part_of_statement(num_statements);
+    for (int part = 0; part < num_parts; ++part)
+    {
+        std::fill(part_of_statement.begin() + cuts[part], part_of_statement.begin() + cuts[part + 1], part);
+    }
+
+    // a temporary tensor for each value used in a later kernel
+    std::unordered_map<int, TensorNodePtr> temps;
+    std::vector<TensorNodePtr> temp_list;
+    for (auto& value : values)
+    {
+        int owner_part = part_of_statement[owners.at(value->ast_id)];
+        if (part_of_statement[use_positions.at(value->ast_id).back()] == owner_part)
+            continue;
+
+        std::string name = "val";
+        if (auto alias_node = std::dynamic_pointer_cast<AliasNode>(value))
+            name = alias_node->name;
+        else if (auto loop_var_node = std::dynamic_pointer_cast<LoopVarNode>(value))
+            name = loop_var_node->name;
+
+        auto temp = create_tensor_node(dtype_inference.get_dtype(value), "tmp" + std::to_string(temp_list.size()) + "_" + name);
+        temps.insert({value->ast_id, temp});
+        temp_list.push_back(temp);
+    }
+
+    std::stringstream ss;
+    ss << kernel->name << ":\n";
+    for (auto& temp : temp_list)
+    {
+        ss << "    temporary " << get_type_name(temp->dtype) << "[] " << temp->name << "\n";
+    }
+
+    std::vector<KernelNodePtr> part_kernels;
+    for (int part = 0; part < num_parts; ++part)
+    {
+        ASTCloner cloner;
+        auto arguments = kernel->arguments;
+        std::unordered_map<int, std::vector<ASTNodePtr>> loads;  // statement position -> aliases reading temporaries
+
+        for (auto& value : values)
+        {
+            if (!temps.contains(value->ast_id))
+                continue;
+
+            auto& temp = temps.at(value->ast_id);
+            int owner_part = part_of_statement[owners.at(value->ast_id)];
+            auto& positions = use_positions.at(value->ast_id);
+            bool used_in_part = std::any_of(positions.begin(), positions.end(), [&](int use) { return part_of_statement[use] == part; });
+
+            if (owner_part == part)
+            {
+                arguments.push_back(temp);
+            }
+            else if (owner_part < part && used_in_part)
+            {
+                // read once, before the first use (kernel call arguments have to be values)
+                auto load_alias = create_alias_node(temp->name, temp);
+                int first_use = *std::find_if(positions.begin(), positions.end(), [&](int use) { return part_of_statement[use] == part; });
+                loads[first_use].push_back(load_alias);
+
+                arguments.push_back(temp);
+                cloner.replace(value->ast_id, load_alias);
+            }
+        }
+
+        auto part_kernel = create_kernel_node(kernel->name + "_part" + std::to_string(part), KernelScope::GLOBAL, arguments, {});
+        for (int pos = cuts[part]; pos < cuts[part + 1]; ++pos)
+        {
+            if (loads.contains(pos))
+            {
+                part_kernel->body.insert(part_kernel->body.end(), loads.at(pos).begin(), loads.at(pos).end());
+            }
+            part_kernel->body.push_back(cloner.clone(statements[pos]));
+
+            // stored right after the computation, the register is free after the last use in this kernel
+            for (auto& value : values)
+            {
+                if (temps.contains(value->ast_id) && owners.at(value->ast_id) == pos)
+                {
+                    part_kernel->body.push_back(create_assignment_node(temps.at(value->ast_id), cloner.clone(value)));
+                }
+            }
+        }
+        part_kernel->body.push_back(create_return_node({}));
+
+        ss << "    " << part_kernel->name << "(";
+        for (int ix = 0; ix < arguments.size(); ++ix)
+        {
+            ss << (ix > 0 ? ", " : "") << arguments[ix]->name;
+        }
+        ss << ")\n";
+
+        part_kernels.push_back(part_kernel);
+    }
+
+    launch_sequence += ss.str();
+
+    std::cout << "Kernel " << kernel->name << " (" << live << " estimated live values) was split into ";
+    std::cout << num_parts << " kernels with " << temp_list.size() << " temporary tensors\n";
+
+    return part_kernels;
+}
+
+const std::string& KernelFission::get_launch_sequence() const
+{
+    return launch_sequence;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ast.hpp"
+#include "core.hpp"
+#include "transforms.hpp"
+
+/**
+ * Splits global kernels with too many live values into a sequence
+ * of global kernels (name_part0, name_part1, ...), cut between the top-level statements.
+ * Values computed before a cut and used after it are passed in temporary tensors.
+ * The cuts minimize the number of temporary stores and loads.
+ */
+class KernelFission
+{
+public:
+    explicit KernelFission(const int max_live_values);
+
+    /**
+     * Estimated registers of the kernel body: values kept between
+     * the statements plus the Sethi-Ullman need of the statement.
+     */
+    int estimate_live_values(const KernelNode& kernel);
+
+    /**
+     * The parts of the kernel, or the kernel itself if it is
+     * below the limit (or can not be split).
+     */
+    std::vector<KernelNodePtr> split_kernel(const KernelNodePtr kernel);
+
+    /**
+     * The kernels to be launched instead of each split kernel, with the temporary tensors.
+     */
+    const std::string& get_launch_sequence() const;
+
+private:
+    int max_live_values;
+    std::string launch_sequence;
+
+    RegisterNeedAnalysis register_need;
+    UniformityAnalysis uniformity;
+    DataTypeInference dtype_inference;
+
+    // analysis of the kernel being split
+    std::vector<ASTNodePtr> statements;                      // body without the return
+    std::vector<ASTNodePtr> values;                          // computed by a statement, used by later ones
+    std::unordered_map<int, int> owners;                     // node id -> first statement reaching it
+    std::unordered_map<int, std::vector<int>> use_positions; // value id -> later statements using it
+    std::unordered_set<int> unstorable_ids;                  // tuples and loop-local values
+
+    // by statement
+    std::vector<int> statement_needs;                        // Sethi-Ullman need of the statement
+    std::vector<std::vector<std::pair<int, int>>> uses_at;   // (value index, its previous use or owner) used here
+    std::vector<std::vector<int>> last_uses_at;              // value indices used the last time here
+    std::vector<int> num_owned_values;                       // values computed here and used later
+
+    void analyze(const KernelNode& kernel);
+
+    /**
+     * Live values estimated and the temporary loads and stores of the statements [begin, end)
+     * in one kernel, for each end after begin (indexed by end). Values from earlier statements
+     * are read from temporary tensors. The ranges are extended one statement at a time,
+     * a use only adds the positions since the previous use of its value.
+     */
+    void scan_ranges(const int begin, std::vector<int>& live_values, std::vector<int>& transfers) const;
+
+    bool can_cut_before(const int pos) const;
+};
@@ -0,0 +1,216 @@
+#include "fusion.hpp"
+
+StageCloner::StageCloner(
+    const std::unordered_map<int, VariableNodePtr>& tensor_vars,
+    const std::unordered_set<int>& intermediate_ids
+    ) : ASTCloner(), tensor_vars(tensor_vars),
+        intermediate_ids(intermediate_ids)
+{
+}
+
+VariableNodePtr StageCloner::resolve_tensor(const ASTNodePtr node, const std::string& usage) const
+{
+    if (!node || !tensor_vars.contains(node->ast_id))
+        return nullptr;
+
+    auto var = tensor_vars.at(node->ast_id);
+    if (intermediate_ids.contains(var->ast_id))
+    {
+        std::stringstream ss;
+        ss << "Pipeline intermediate " << var->name << " can not be " << usage << ", it is not stored in memory.";
+        emit_error(ss.str());
+    }
+    return var;
+}
+
+void StageCloner::apply(KernelCallNode& node)
+{
+    // device kernels get the pointer of the tensor
+    std::vector<ASTNodePtr> arguments;
+    for (auto& arg_ast : node.arguments)
+    {
+        auto tensor = resolve_tensor(arg_ast, "passed to the device kernel " + node.kernel->name);
+        arguments.push_back(tensor ? tensor : clone(arg_ast));
+    }
+
+    clones.insert_or_assign(node.ast_id, create_kernelcall_node(node.kernel, arguments));
+}
+
+void StageCloner::apply(AssignmentNode& node)
+{
+    auto tensor = resolve_tensor(node.trg, "assigned inside a repeat block");
+    auto trg = tensor ? tensor : clone(node.trg);
+    auto src = clone(node.src);
+    clones.insert_or_assign(node.ast_id, create_assignment_node(trg, src));
+}
+
+
+/**
+ * Tensor parameters which are assigned inside repeat blocks or passed to device kernels.
+ * These are read from memory, their values can not be forwarded.
+ */
+static std::unordered_set<int> find_memory_params(const KernelNode& kernel)
+{
+    std::unordered_set<int> memory_param_ids;
+    for_each_reachable_node(kernel.body, [&](const ASTNodePtr& node)
+    {
+        if (auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node))
+        {
+            for (auto& arg : call_node->arguments)
+            {
+                memory_param_ids.insert(arg->ast_id);
+            }
+        }
+        else if (auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(node))
+        {
+            for_each_reachable_node(repeat_node->body, [&](const ASTNodePtr& inner_node)
+            {
+                if (auto assign_node = std::dynamic_pointer_cast<AssignmentNode>(inner_node))
+                    memory_param_ids.insert(assign_node->trg->ast_id);
+            });
+        }
+    });
+    return memory_param_ids;
+}
+
+KernelNodePtr fuse_pipeline(const Pipeline& pipeline)
+{
+    std::unordered_set<int> intermediate_ids;
+    for (auto& intermediate : pipeline.intermediates)
+    {
+        intermediate_ids.insert(intermediate->ast_id);
+    }
+
+    // pipeline tensors written by any of the kernels, the others are inputs
+    std::unordered_set<int> stored_ids;
+    for (auto& stage : pipeline.stages)
+    {
+        auto& kernel = *stage->kernel;
+        std::unordered_set<int> written_param_ids = find_memory_params(kernel);
+        for (auto& statement : kernel.body)
+        {
+            if (auto assign_node = std::dynamic_pointer_cast<AssignmentNode>(statement))
+                written_param_ids.insert(assign_node->trg->ast_id);
+        }
+
+        for (int ix = 0; ix < kernel.arguments.size(); ++ix)
+        {
+            if (written_param_ids.contains(kernel.arguments[ix]->ast_id))
+                stored_ids.insert(stage->arguments[ix]->ast_id);
+        }
+    }
+
+    // the current value of each pipeline tensor, the tensor itself if it is read from memory
+    std::unordered_map<int, ASTNodePtr> current_values;
+    for (auto& arg : pipeline.arguments)
+    {
+        current_values.insert({arg->ast_id, arg});
+    }
+    for (auto& intermediate : pipeline.intermediates)
+    {
+        current_values.insert({intermediate->ast_id, intermediate});
+    }
+
+    auto fused_kernel = create_kernel_node(pipeline.name, KernelScope::GLOBAL, pipeline.arguments, {});
+    for (auto& stage : pipeline.stages)
+    {
+        auto& kernel = *stage->kernel;
+        auto memory_param_ids = find_memory_params(kernel);
+
+        std::unordered_set<int> read_ids;
+        for_each_reachable_node(kernel.body, [&](const ASTNodePtr& node) { read_ids.insert(node->ast_id); });
+
+        std::unordered_map<int, VariableNodePtr> tensor_vars;
+        for (int ix = 0; ix < kernel.arguments.size(); ++ix)
+        {
+            if (kernel.arguments[ix]->vtype == VariableType::TENSOR)
+                tensor_vars.insert({kernel.arguments[ix]->ast_id, std::static_pointer_cast<VariableNode>(stage->arguments[ix])});
+        }
+
+        StageCloner cloner(tensor_vars, intermediate_ids);
+        for (int ix = 0; ix < kernel.arguments.size(); ++ix)
+        {
+            auto& param = kernel.arguments[ix];
+            auto var = std::static_pointer_cast<VariableNode>(stage->arguments[ix]);
+
+            if (param->vtype == VariableType::SCALAR)
+            {
+                cloner.replace(param->ast_id, var);
+            }
+            else if (memory_param_ids.contains(param->ast_id))
+            {
+                if (intermediate_ids.contains(var->ast_id))
+                {
+                    std::stringstream ss;
+                    ss << "Pipeline intermediate " << var->name << " can not be assigned inside a repeat block";
+                    ss << " or passed to a device kernel (in " << kernel.name << "), it is not stored in memory.";
+                    emit_error(ss.str());
+                }
+
+                // the stores of the earlier kernels are already issued
+                current_values.insert_or_assign(var->ast_id, var);
+                cloner.replace(param->ast_id, var);
+            }
+            else
+            {
+                // inputs are loaded once, at the first kernel reading them
+                if (!stored_ids.contains(var->ast_id) && current_values.at(var->ast_id) == var && read_ids.contains(param->ast_id))
+                {
+                    auto input = create_alias_node(var->name, var);
+                    fused_kernel->body.push_back(input);
+                    current_values.insert_or_assign(var->ast_id, input);
+                }
+
+                cloner.replace(param->ast_id, current_values.at(var->ast_id));
+            }
+        }
+
+        for (auto& statement : kernel.body)
+        {
+            if (std::dynamic_pointer_cast<ReturnNode>(statement))
+                continue;
+
+            auto assign_node = std::dynamic_pointer_cast<AssignmentNode>(statement);
+            if (!assign_node || memory_param_ids.contains(assign_node->trg->ast_id))
+            {
+                fused_kernel->body.push_back(cloner.clone(statement));
+                continue;
+            }
+
+            // the stored value is forwarded to the later reads, intermediates are not stored
+            auto var = tensor_vars.at(assign_node->trg->ast_id);
+            auto value = create_alias_node(var->name, cloner.clone(assign_node->src));
+            fused_kernel->body.push_back(value);
+
+            if (!intermediate_ids.contains(var->ast_id))
+            {
+                fused_kernel->body.push_back(create_assignment_node(var, value));
+            }
+
+            current_values.insert_or_assign(var->ast_id, value);
+            for (auto& [param_id, param_var] : tensor_vars)
+            {
+                if (param_var == var)
+                    cloner.replace(param_id, value);
+            }
+        }
+    }
+
+    fused_kernel->body.push_back(create_return_node({}));
+
+    for_each_reachable_node(fused_kernel->body, [&](const ASTNodePtr& node)
+    {
+        if (intermediate_ids.contains(node->ast_id))
+        {
+            std::stringstream ss;
+            ss << "Pipeline intermediate " << std::static_pointer_cast<TensorNode>(node)->name;
+            ss << " is read before it is written in " << pipeline.name << ".";
+            emit_error(ss.str());
+        }
+    });
+
+    std::cout << "Pipeline " << pipeline.name << " was fused into a single kernel (";
+    std::cout << pipeline.stages.size() << " launches, " << pipeline.intermediates.size() << " intermediates)\n";
+
+    return fused_kernel;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "ast.hpp"
+#include "core.hpp"
+#include "transforms.hpp"
+
+/**
+ * Copies the body of a kernel launched by a pipeline.
+ * Stores and device kernel calls get the tensors of the pipeline,
+ * the reads are replaced by the current values (see replace).
+ */
+class StageCloner : public ASTCloner
+{
+public:
+    /**
+     * @param tensor_vars tensor parameters of the kernel -> tensors of the pipeline
+     * @param intermediate_ids tensors of the pipeline which are not stored in memory
+     */
+    explicit StageCloner(
+        const std::unordered_map<int, VariableNodePtr>& tensor_vars,
+        const std::unordered_set<int>& intermediate_ids);
+
+    virtual void apply(KernelCallNode& node) override;
+    virtual void apply(AssignmentNode& node) override;
+
+private:
+    std::unordered_map<int, VariableNodePtr> tensor_vars;
+    std::unordered_set<int> intermediate_ids;
+
+    /**
+     * The pipeline tensor of a tensor parameter, nullptr for other nodes.
+     * Stops with an error for intermediates, they have no memory.
+     */
+    VariableNodePtr resolve_tensor(const ASTNodePtr node, const std::string& usage) const;
+};
+
+
+/**
+ * Vertical fusion of a pipeline: the launched kernels (all of them are pointwise)
+ * are merged into a single global kernel, named after the pipeline, with the pipeline arguments.
+ * The values stored by a kernel are forwarded to the later ones in registers,
+ * the intermediates are never stored. A chain of kernels reads its inputs and writes its outputs once.
+ */
+KernelNodePtr fuse_pipeline(const Pipeline& pipeline);
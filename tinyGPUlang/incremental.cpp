@@ -0,0 +1,84 @@
+#include "incremental.hpp"
+
+IncrementalBuild::IncrementalBuild(
+    const std::string& build_folder,
+    const std::string& source_path,
+    const std::string& options_key) :
+    build_folder(build_folder),
+    source_name(std::filesystem::path(source_path).stem().string()),
+    options_key(options_key)
+{
+    std::error_code error;
+    std::filesystem::create_directories(build_folder, error);
+    if (error || !std::filesystem::is_directory(build_folder))
+    {
+        std::stringstream ss;
+        ss << "Error while creating build folder ";
+        ss << build_folder;
+        emit_error(ss.str());
+    }
+}
+
+std::string IncrementalBuild::get_unit_hash(const std::vector<KernelNodePtr>& kernels, const std::vector<int>& elems_per_thread) const
+{
+    // a single printer, the kernels called from several kernels are printed once
+    ASTPrinter printer(true);
+    std::stringstream ss;
+    ss << options_key << "\n";
+    for (int ix = 0; ix < kernels.size(); ++ix)
+    {
+        ss << kernels[ix]->name << " x" << elems_per_thread[ix] << "\n";
+        kernels[ix]->accept(printer);
+    }
+    ss << printer.get_ast_string();
+
+    return hash_to_hex(hash_string(ss.str()));
+}
+
+std::string IncrementalBuild::load_unit_ptx(const std::string& unit_hash) const
+{
+    auto fragment_path = get_fragment_path(unit_hash);
+    if (!std::filesystem::exists(fragment_path))
+        return "";
+
+    return read_file(fragment_path);
+}
+
+void IncrementalBuild::save_unit_ptx(const std::string& unit_hash, const std::string& ptx_code) const
+{
+    write_file_atomically(get_fragment_path(unit_hash), ptx_code);
+}
+
+void IncrementalBuild::remove_unused_fragments(const std::vector<std::string>& unit_hashes) const
+{
+    std::unordered_set<std::string> used_names;
+    for (auto& unit_hash : unit_hashes)
+    {
+        if (unit_hash.empty())
+            continue;
+
+        used_names.insert(std::filesystem::path(get_fragment_path(unit_hash)).filename().string());
+    }
+
+    // name_<16 hex digits>.ptx, the fragments of the other sources are kept
+    std::string prefix = source_name + "_";
+    size_t fragment_name_size = prefix.size() + 16 + 4;
+
+    std::error_code error;
+    for (auto& entry : std::filesystem::directory_iterator(build_folder, error))
+    {
+        std::string file_name = entry.path().filename().string();
+        bool is_fragment = file_name.size() == fragment_name_size && file_name.starts_with(prefix) && file_name.ends_with(".ptx") &&
+            std::all_of(file_name.begin() + prefix.size(), file_name.end() - 4, ::isxdigit);
+
+        if (is_fragment && !used_names.contains(file_name))
+        {
+            std::filesystem::remove(entry.path(), error);
+        }
+    }
+}
+
+std::string IncrementalBuild::get_fragment_path(const std::string& unit_hash) const
+{
+    return (std::filesystem::path(build_folder) / (source_name + "_" + unit_hash + ".ptx")).string();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ast.hpp"
+#include "core.hpp"
+
+/**
+ * Keeps the ptx of the codegen units of a source in a build folder between the runs,
+ * so only the changed units are built again. A unit is found by the hash of its kernels:
+ * the AST with stable ids (the called kernels are printed with their callers), the thread
+ * coarsening of each kernel and the options of the code generation.
+ */
+class IncrementalBuild
+{
+public:
+    /**
+     * @param build_folder folder of the fragments, created if it does not exist
+     * @param source_path the fragments of the source are named after it (name_<hash>.ptx)
+     * @param options_key the options changing the ptx of each unit (e.g. target, sm, ptx version)
+     */
+    explicit IncrementalBuild(
+        const std::string& build_folder,
+        const std::string& source_path,
+        const std::string& options_key);
+
+    /**
+     * @param elems_per_thread the thread coarsening of each kernel of the unit
+     */
+    std::string get_unit_hash(const std::vector<KernelNodePtr>& kernels, const std::vector<int>& elems_per_thread) const;
+
+    /**
+     * The ptx of the unit saved by an earlier run, empty if there is none.
+     */
+    std::string load_unit_ptx(const std::string& unit_hash) const;
+
+    void save_unit_ptx(const std::string& unit_hash, const std::string& ptx_code) const;
+
+    /**
+     * Removes the fragments of the source not used by the current run,
+     * the folder keeps a single build of each source. Empty hashes are skipped.
+     */
+    void remove_unused_fragments(const std::vector<std::string>& unit_hashes) const;
+
+private:
+    std::string build_folder;
+    std::string source_name;
+    std::string options_key;
+
+    std::string get_fragment_path(const std::string& unit_hash) const;
+};
@@ -0,0 +1,185 @@
+#include "lexer.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// character classes of the tokenizer
+enum CharClass : uint8_t
+{
+    WORD_CHAR = 0,    // part of a keyword, name or number
+    IGNORED_CHAR,     // space, tab, new line
+    SINGLE_CHAR,      // brackets, comma chars and arithmetic operators, a token on their own
+    COMMENT_CHAR      // starts a comment until the end of the line
+};
+
+static constexpr std::array<uint8_t, 256> create_char_classes()
+{
+    std::array<uint8_t, 256> classes = {};
+    for (unsigned char c : std::string_view(" \t\n\r"))
+    {
+        classes[c] = IGNORED_CHAR;
+    }
+    for (unsigned char c : std::string_view("()[]{},;*/+-="))
+    {
+        classes[c] = SINGLE_CHAR;
+    }
+    classes['#'] = COMMENT_CHAR;
+    return classes;
+}
+
+static constexpr std::array<uint8_t, 256> char_classes = create_char_classes();
+
+
+int SymbolTable::intern(const std::string_view name)
+{
+    auto [it, inserted] = symbol_ids.try_emplace(name, static_cast<int>(names.size()));
+    if (inserted)
+    {
+        names.push_back(name);
+    }
+    return it->second;
+}
+
+int SymbolTable::find(const std::string_view name) const
+{
+    auto it = symbol_ids.find(name);
+    return it == symbol_ids.end() ? -1 : it->second;
+}
+
+std::string_view SymbolTable::get_name(const int symbol) const
+{
+    return names.at(symbol);
+}
+
+int SymbolTable::get_num_symbols() const
+{
+    return static_cast<int>(names.size());
+}
+
+
+TGLlexer::TGLlexer(const std::string& path_to_tgl)
+{
+    map_source(path_to_tgl);
+    tokenize();
+}
+
+TGLlexer::~TGLlexer()
+{
+#ifndef _WIN32
+    if (is_mapped)
+    {
+        munmap(const_cast<char*>(source), source_size);
+    }
+#endif
+}
+
+const std::vector<Token>& TGLlexer::get_tokens() const
+{
+    return tokens;
+}
+
+const SymbolTable& TGLlexer::get_symbols() const
+{
+    return symbols;
+}
+
+int TGLlexer::get_num_lines() const
+{
+    return num_lines;
+}
+
+void TGLlexer::map_source(const std::string& path_to_tgl)
+{
+#ifndef _WIN32
+    int fd = open(path_to_tgl.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd >= 0 && fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+    {
+        void* mapped = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED)
+        {
+            source = static_cast<const char*>(mapped);
+            source_size = static_cast<size_t>(file_stat.st_size);
+            is_mapped = true;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+
+    if (!is_mapped)  // empty file or no mmap
+    {
+        std::ifstream tgl_file(path_to_tgl, std::ios::binary);
+        if (!tgl_file)
+        {
+            std::stringstream ss;
+            ss << "Error while opening file ";
+            ss << path_to_tgl;
+            emit_error(ss.str());
+        }
+
+        std::stringstream buffer;
+        buffer << tgl_file.rdbuf();
+        source_buffer = buffer.str();
+        source = source_buffer.data();
+        source_size = source_buffer.size();
+    }
+
+    std::cout << "Source file was opened successfully " << path_to_tgl << std::endl;
+}
+
+void TGLlexer::tokenize()
+{
+    int line = 0;
+    size_t line_start = 0;
+    size_t ix = 0;
+    while (ix < source_size)
+    {
+        char c = source[ix];
+        switch (char_classes[static_cast<unsigned char>(c)])
+        {
+        case IGNORED_CHAR:
+            if (c == '\n')
+            {
+                line += 1;
+                line_start = ix + 1;
+            }
+            ix += 1;
+            break;
+
+        case COMMENT_CHAR:
+            while (ix < source_size && source[ix] != '\n')
+            {
+                ix += 1;
+            }
+            break;
+
+        case SINGLE_CHAR:
+            tokens.push_back({std::string_view(source + ix, 1), line, static_cast<int>(ix - line_start)});
+            ix += 1;
+            break;
+
+        default:  // keyword, name or number
+        {
+            size_t first = ix;
+            while (ix < source_size && char_classes[static_cast<unsigned char>(source[ix])] == WORD_CHAR)
+            {
+                ix += 1;
+            }
+
+            auto text = std::string_view(source + first, ix - first);
+            tokens.push_back({text, line, static_cast<int>(first - line_start), symbols.intern(text)});
+            break;
+        }
+        }
+    }
+
+    num_lines = line + 1;
+    tokens.push_back({std::string_view(), line, static_cast<int>(ix - line_start)});
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "core.hpp"
+
+/**
+ * Token of the tgl source. The text points into the source buffer
+ * of the lexer, it is valid while the lexer is alive.
+ */
+struct Token
+{
+    std::string_view text;  // empty for the end of the source
+    int line = 0;
+    int pos = 0;            // column of the first character
+    int symbol = -1;        // interned id of the words (keywords, names, numbers), -1 for others
+
+    /**
+     * Column right after the last character (where the next token search starts).
+     */
+    int end_pos() const { return pos + static_cast<int>(text.size()); }
+};
+
+/**
+ * Interns the words of the source into dense integer ids,
+ * equal words get the same id. The words are views of the source buffer.
+ */
+class SymbolTable
+{
+public:
+    int intern(const std::string_view name);
+
+    /**
+     * The id of the name, -1 if it is not in the source.
+     */
+    int find(const std::string_view name) const;
+
+    std::string_view get_name(const int symbol) const;
+    int get_num_symbols() const;
+
+private:
+    std::unordered_map<std::string_view, int> symbol_ids;
+    std::vector<std::string_view> names;
+};
+
+/**
+ * Splits the tgl source into tokens in a single pass.
+ * The source is memory-mapped (read into a buffer where mmap is not available),
+ * the characters are classified with a lookup table and the tokens are
+ * views of the source, no string is allocated per token.
+ * Tokens are the brackets, the , ; characters, the arithmetic operators
+ * and the words between them. Comments (#) last until the end of the line.
+ */
+class TGLlexer
+{
+public:
+    explicit TGLlexer(const std::string& path_to_tgl);
+    ~TGLlexer();
+
+    TGLlexer(const TGLlexer&) = delete;
+    TGLlexer& operator=(const TGLlexer&) = delete;
+
+    /**
+     * All of the tokens, the last one is an empty token at the end of the source.
+     */
+    const std::vector<Token>& get_tokens() const;
+    const SymbolTable& get_symbols() const;
+    int get_num_lines() const;
+
+private:
+    const char* source = nullptr;
+    size_t source_size = 0;
+    bool is_mapped = false;
+    std::string source_buffer;  // the source if it is not mapped
+
+    std::vector<Token> tokens;
+    SymbolTable symbols;
+    int num_lines = 0;
+
+    void map_source(const std::string& path_to_tgl);
+    void tokenize();
+};
@@ -1,39 +1,8 @@
 #include "parser.hpp"
+#include "transforms.hpp"
 
 // static class variables
-std::unordered_set<char> TGLparser::ignored_chars = 
-{
-    ' ',   // space
-    '\t',  // tab
-    '\n'   // new line
-};
-
-std::unordered_set<char> TGLparser::bracket_chars = 
-{
-    '(',  // for functions or arithmetic expressions
-    ')',  // --
-    '[',  // only for tensor variable type def.
-    ']',  // --
-    '{',  // only for function body test
-    '}'   // --
-};
-
-std::unordered_set<char> TGLparser::comma_chars =
-{
-    ',',
-    ';'
-};
-
-std::unordered_set<char> TGLparser::arithmetic_chars =
-{
-    '*',
-    '/',
-    '+',
-    '-',
-    '='
-};
-
-std::unordered_set<std::string> TGLparser::builtin_kernel_names = 
+std::unordered_set<std::string_view> TGLparser::builtin_kernel_names = 
 {
     "abs",
     "sqrt",
@@ -49,164 +18,377 @@ std::unordered_map<char, int> TGLparser::arithmetic_precedences =
     {'-', 1}
 };
 
+std::unordered_map<std::string_view, DataType> TGLparser::data_type_names = 
+{
+    {"f32", DataType::FLOAT32},
+    {"c64", DataType::COMPLEX64},
+    {"f32x2", DataType::FLOAT32X2},
+    {"f32x4", DataType::FLOAT32X4}
+};
+
 // class functions
 
-TGLparser::TGLparser(const std::string& path_to_tgl)
+TGLparser::TGLparser(const std::string& path_to_tgl, const int num_threads, const bool defer_bodies) : 
+    lexer(std::make_shared<TGLlexer>(path_to_tgl)), tokens(lexer->get_tokens()), symbols(lexer->get_symbols()),
+    file_parser(this)
 {
-    read_all_lines_from_tgl(path_to_tgl);
-    
-    int current_line = 0;
-    int current_pos = 0;
-    while (current_line < all_lines.size())
+    // split the source at the kernel headers and the pipelines in order,
+    // the kernel bodies are skipped
+    int current_tok = 0;
+    int end_tok = static_cast<int>(tokens.size()) - 1;
+    while (current_tok < end_tok)
     {
-        parse_next_kernel(current_line, current_pos, current_line, current_pos);
+        SourceItem item;
+        if (!defer_bodies)
+        {
+            item.ast_context = std::make_shared<ASTContext>(true);  // the ids are shifted in merge_item_ids
+        }
+
+        ASTContextScope ast_context_scope(item.ast_context ? *item.ast_context : ASTContext::get_current());
+        try
+        {
+            parse_next_kernel(item, current_tok, current_tok);
+        }
+        catch (const ParseError& error)
+        {
+            item.error = error;
+            current_tok = end_tok;  // the rest of the source can not be split
+        }
+        item.end_tok = current_tok;
+        items.push_back(std::move(item));
+    }
+
+    if (defer_bodies)
+    {
+        check_item_errors();
+        split_into_units();
+
+        std::cout << "Source file was split into " << unit_items.size() << " units " << path_to_tgl << "\n";
+        std::cout << "Found " << defined_global_kernels.size() << " global kernels" << std::endl;
+        return;
     }
 
+    // each kernel body sees only its own names and the kernels declared before it,
+    // the bodies are parsed independently
+    ThreadPool thread_pool(num_threads);
+    thread_pool.parallel_for(static_cast<int>(items.size()), [&](const int item_ix)
+    {
+        auto& item = items[item_ix];
+        if (!item.kernel || item.error)
+            return;
+
+        ASTContextScope ast_context_scope(*item.ast_context);
+        try
+        {
+            TGLparser body_parser(*this, item_ix);
+            body_parser.parse_kernel_definition();
+        }
+        catch (const ParseError& error)
+        {
+            item.error = error;
+        }
+    });
+
+    check_item_errors();
+    merge_item_ids();
+
     std::cout << "Source file was parsed successfully " << path_to_tgl << "\n";
     std::cout << "Parsed " << defined_global_kernels.size() << " global kernels" << std::endl;
 }
 
+TGLparser::TGLparser(const TGLparser& file_parser, const int item_index) :
+    lexer(file_parser.lexer), tokens(file_parser.tokens), symbols(file_parser.symbols),
+    file_parser(&file_parser), item_index(item_index)
+{
+    // the arguments shadow the names of the earlier kernels
+    for (auto& arg : file_parser.items[item_index].kernel->arguments)
+    {
+        defined_nodes.insert_or_assign(symbols.find(arg->name), arg);
+    }
+}
+
 std::vector<KernelNodePtr> TGLparser::get_all_kernels() const
 {
     return defined_kernels;
 }
 
+std::vector<PipelinePtr> TGLparser::get_all_pipelines() const
+{
+    return defined_pipelines;
+}
+
 KernelNodePtr TGLparser::get_global_kernel(const std::string& kernel_name) const
 {
     return defined_global_kernels.at(kernel_name);
 }
 
-// helper functions
-void TGLparser::read_all_lines_from_tgl(const std::string& path_to_tgl)
+int TGLparser::get_num_units() const
 {
-    std::ifstream tgl_file(path_to_tgl);
+    return static_cast<int>(unit_items.size());
+}
 
-    if (tgl_file)
+SourceUnit TGLparser::parse_unit(const int unit_ix)
+{
+    SourceUnit unit;
+    for (int item_ix : unit_items[unit_ix])
     {
-        std::cout << "Source file was opened successfully " << path_to_tgl << std::endl;
-
-        while(!tgl_file.eof())
+        auto& item = items[item_ix];
+        if (item.pipeline)
         {
-            std::string line;
-            std::getline(tgl_file, line);
-            all_lines.push_back(line);
+            unit.pipelines.push_back(item.pipeline);
+            continue;
         }
+
+        parse_item_body(item_ix);
+        unit.kernels.push_back(item.kernel);
     }
-    else
+    return unit;
+}
+
+void TGLparser::release_unit(const int unit_ix)
+{
+    // the headers are kept, they are small
+    for (int item_ix : unit_items[unit_ix])
     {
-        std::stringstream ss;
-        ss << "Error while opening file ";
-        ss << path_to_tgl;
-        emit_error(ss.str());
+        if (items[item_ix].kernel)
+        {
+            items[item_ix].kernel->body = {};
+        }
     }
 }
 
-int TGLparser::parse_next_token(std::string& next_token, const std::string& line, const int start_pos)
+// helper functions
+const Token& TGLparser::get_token(const int tok) const
 {
-    next_token = "";
+    return tokens[std::min(tok, static_cast<int>(tokens.size()) - 1)];
+}
 
-    int current_pos = start_pos;
-    if (static_cast<size_t>(start_pos) < line.size())
-    {
-        char c = line[current_pos];
+void TGLparser::emit_error_at(const std::string& error_msg, const int next_tok) const
+{
+    auto& token = get_token(std::max(next_tok - 1, 0));
+    emit_parse_error(error_msg, token.line, token.end_pos());
+}
+
+void TGLparser::emit_parse_error(const std::string& error_msg, const int line, const int pos) const
+{
+    throw ParseError{error_msg, line, pos};
+}
+
+ASTNodePtr TGLparser::find_defined_node(const int symbol) const
+{
+    auto defined_node = defined_nodes.find(symbol);
+    if (defined_node != defined_nodes.end())
+        return defined_node->second;
+
+    auto kernel_item = file_parser->kernel_items.find(symbol);
+    if (kernel_item != file_parser->kernel_items.end() && kernel_item->second <= item_index)
+        return file_parser->items[kernel_item->second].kernel;
 
-        // go until characters can be ignored
-        while (ignored_chars.contains(c))
+    return nullptr;
+}
+
+int TGLparser::skip_kernel_body(const int start_tok) const
+{
+    int current_tok = start_tok;
+    int depth = 0;
+    for (std::string_view next_token = get_token(current_tok).text; !next_token.empty(); next_token = get_token(++current_tok).text)
+    {
+        if (next_token == "{")
         {
-            current_pos += 1;
-            c = line[current_pos];
+            depth += 1;
         }
-
-        // ignore comments
-        if (c == '#')
+        else if (next_token == "}" && depth > 0)
         {
-            next_token = "";
-            return current_pos;
+            depth -= 1;
+            if (depth == 0)
+                return current_tok + 1;
         }
+    }
+    return current_tok;  // the body parser reports the missing bracket
+}
 
-        // return immediately if the character is special or arithmetic
-        if (bracket_chars.contains(c) || arithmetic_chars.contains(c) || comma_chars.contains(c))
+SourceUnit TGLparser::parse_selected_kernels(const std::vector<std::string>& kernel_names)
+{
+    std::vector<int> pending_items;
+    for (auto& kernel_name : kernel_names)
+    {
+        auto pipeline_item = std::find_if(items.begin(), items.end(),
+            [&](const SourceItem& item) { return item.pipeline && item.pipeline->name == kernel_name; });
+        if (pipeline_item != items.end())
+        {
+            pending_items.push_back(static_cast<int>(pipeline_item - items.begin()));
+        }
+        else
         {
-            next_token += c;
-            return current_pos + 1;
+            pending_items.push_back(kernel_items.at(symbols.find(defined_global_kernels.at(kernel_name)->name)));
         }
+    }
 
-        // can be the start of keyword or variable (func) name
-        int first_pos = current_pos;
-        bool proceed = true;
-        while (proceed)
+    std::vector<bool> is_selected(items.size(), false);
+    while (!pending_items.empty())
+    {
+        int item_ix = pending_items.back();
+        pending_items.pop_back();
+        if (is_selected[item_ix])
+            continue;
+
+        is_selected[item_ix] = true;
+        auto& item = items[item_ix];
+        if (item.pipeline)
         {
-            current_pos += 1;
+            for (auto& stage : item.pipeline->stages)
+            {
+                pending_items.push_back(kernel_items.at(symbols.find(stage->kernel->name)));
+            }
+            continue;
+        }
 
-            proceed = static_cast<size_t>(current_pos) < line.size();
-            if (proceed)
+        parse_item_body(item_ix);
+        for_each_reachable_node(item.kernel->body, [&](const ASTNodePtr& node)
+        {
+            if (node->kind == NodeKind::KERNEL_CALL)
             {
-                c = line[current_pos];
-                proceed = proceed && !(bracket_chars.contains(c) || arithmetic_chars.contains(c) || ignored_chars.contains(c) || comma_chars.contains(c));
+                auto& callee = static_cast<const KernelCallNode&>(*node).kernel;
+                pending_items.push_back(kernel_items.at(symbols.find(callee->name)));
             }
+        });
+    }
+
+    SourceUnit selected;
+    for (int item_ix = 0; item_ix < items.size(); ++item_ix)
+    {
+        if (!is_selected[item_ix])
+            continue;
+
+        if (items[item_ix].pipeline)
+        {
+            selected.pipelines.push_back(items[item_ix].pipeline);
+        }
+        else
+        {
+            selected.kernels.push_back(items[item_ix].kernel);
         }
+    }
+    return selected;
+}
 
-        // cut the token
-        int last_pos = current_pos;
-        next_token = line.substr(first_pos, last_pos - first_pos);
+void TGLparser::parse_item_body(const int item_ix) const
+{
+    try
+    {
+        TGLparser body_parser(*this, item_ix);
+        body_parser.parse_kernel_definition();
+    }
+    catch (const ParseError& error)
+    {
+        emit_error(error.message, error.line, error.pos);
     }
-    return current_pos;
 }
 
-void TGLparser::parse_next_kernel(const int start_line, const int start_pos, int& next_line, int& next_pos)
+void TGLparser::check_item_errors() const
 {
-    int current_line = start_line;
-    int current_pos = start_pos;
-    std::string next_token;
-    
-    // find the line with the next function header
-    bool found_func = false;
-    while (!found_func)
+    // the first error of the source, as in a single pass
+    for (auto& item : items)
+    {
+        if (item.error)
+            emit_error(item.error->message, item.error->line, item.error->pos);
+    }
+}
+
+void TGLparser::split_into_units()
+{
+    // the root is the first item of the unit
+    DisjointSets item_sets(static_cast<int>(items.size()));
+    for (int item_ix = 0; item_ix < items.size(); ++item_ix)
     {
-        if (current_line >= all_lines.size())
+        auto& item = items[item_ix];
+        if (item.pipeline)
         {
-            break;
+            for (auto& stage : item.pipeline->stages)
+            {
+                item_sets.unite(kernel_items.at(symbols.find(stage->kernel->name)), item_ix);
+            }
+            continue;
         }
 
-        auto& cline = all_lines[current_line];
-        
-        bool cont = true;
-        while (cont)
+        for (int tok = item.body_tok; tok + 1 < item.end_tok; ++tok)
         {
-            current_pos = parse_next_token(next_token, cline, current_pos);
-            found_func = next_token == "func";
-            cont = !(next_token == "" || found_func);
-
-            // check for illegal keyword (because func is expected)
-            if (next_token != "" && next_token != "func" && next_token != "#")
+            auto callee = kernel_items.find(get_token(tok).symbol);
+            if (callee != kernel_items.end() && callee->second < item_ix && get_token(tok + 1).text == "(")
             {
-                std::stringstream ss;
-                ss << "Illegal keyword: ";
-                ss << next_token;
-                emit_error(ss.str(), current_line, current_pos);
+                item_sets.unite(callee->second, item_ix);
             }
         }
+    }
 
-        if (!found_func)
+    std::vector<int> unit_indices(items.size(), -1);  // by the root item
+    for (int item_ix = 0; item_ix < items.size(); ++item_ix)
+    {
+        int root = item_sets.find_root(item_ix);
+        if (unit_indices[root] < 0)
         {
-            current_line += 1;
-            current_pos = 0;
+            unit_indices[root] = static_cast<int>(unit_items.size());
+            unit_items.emplace_back();
         }
+        unit_items[unit_indices[root]].push_back(item_ix);
+    }
+}
+
+void TGLparser::merge_item_ids()
+{
+    // the ids of an item follow the ids of the items before it
+    int total_ids = 0;
+    for (auto& item : items)
+    {
+        total_ids += item.ast_context->get_num_ids();
+    }
+
+    int first_id = ASTContext::get_current().reserve_ids(total_ids);
+    for (auto& item : items)
+    {
+        for (auto& node : item.ast_context->get_kept_nodes())
+        {
+            node->ast_id += first_id;
+        }
+
+        first_id += item.ast_context->get_num_ids();
+    }
+}
+
+void TGLparser::parse_next_kernel(SourceItem& item, const int start_tok, int& next_tok)
+{
+    int current_tok = start_tok;
+    
+    // the next token has to start a function header or a pipeline
+    std::string_view next_token = get_token(current_tok).text;
+    if (next_token.empty())  // no more function can be found
+    {
+        next_tok = current_tok;
+        return;
     }
+    current_tok += 1;
 
-    if (!found_func)  // no more function can be found
+    if (next_token == "pipeline")
     {
-        next_line = static_cast<int>(all_lines.size());
-        next_pos = 0;
+        parse_pipeline(current_tok, next_tok);
+        item.pipeline = defined_pipelines.back();
         return;
     }
 
+    // check for illegal keyword (because func or pipeline is expected)
+    if (next_token != "func")
+    {
+        std::stringstream ss;
+        ss << "Illegal keyword: ";
+        ss << next_token;
+        emit_error_at(ss.str(), current_tok);
+    }
+
     // parse kernel header and save it
-    KernelNodePtr kernel = parse_kernel_header(current_line, current_pos, current_pos);
+    KernelNodePtr kernel = parse_kernel_header(current_tok, current_tok);
     if (kernel == nullptr)  // error during kernel parsing
     {
-        next_line = static_cast<int>(all_lines.size());
-        next_pos = 0;
+        next_tok = static_cast<int>(tokens.size()) - 1;
         return;
     }
 
@@ -217,7 +399,7 @@ void TGLparser::parse_next_kernel(const int start_line, const int start_pos, int
             std::stringstream ss;
             ss << "Global kernel already defined: ";
             ss << kernel->name;
-            emit_error(ss.str(), current_line, current_pos);
+            emit_error_at(ss.str(), current_tok);
         }
 
         defined_global_kernels.insert({kernel->name, kernel});
@@ -230,15 +412,28 @@ void TGLparser::parse_next_kernel(const int start_line, const int start_pos, int
             std::stringstream ss;
             ss << "Device kernel already defined: ";
             ss << kernel->name;
-            emit_error(ss.str(), current_line, current_pos);
+            emit_error_at(ss.str(), current_tok);
         }
 
         defined_device_kernels.insert({kernel->name, kernel});
         defined_kernels.push_back(kernel);
     }
 
+    kernel_items.insert({symbols.find(kernel->name), static_cast<int>(items.size())});
+    item.kernel = kernel;
+    item.body_tok = current_tok;
+
+    // the body is parsed later, see parse_kernel_definition
+    next_tok = skip_kernel_body(current_tok);
+}
+
+void TGLparser::parse_kernel_definition()
+{
+    auto kernel = file_parser->items[item_index].kernel;
+
     // parse kernel body
-    parse_kernel_body(kernel, current_line, current_pos, current_line, current_pos);
+    int next_tok;
+    parse_kernel_body(kernel, file_parser->items[item_index].body_tok, next_tok);
 
     // check return type from header and from the body
     bool found_return = false;
@@ -247,15 +442,19 @@ void TGLparser::parse_next_kernel(const int start_line, const int start_pos, int
         ReturnNodePtr ret_candidate = std::dynamic_pointer_cast<ReturnNode>(expr);
         if (ret_candidate)
         {
-            bool both_void = (ret_candidate->return_value == nullptr && kernel->return_value == nullptr);
-            bool both_float = (ret_candidate->return_value != nullptr && kernel->return_value != nullptr);
-            
-            if (!(both_void || both_float))
+            bool same_types = (ret_candidate->return_values.size() == kernel->return_values.size());
+            for (int ix = 0; same_types && ix < kernel->return_values.size(); ++ix)
+            {
+                auto ret_dtype = dtype_inference.get_dtype(ret_candidate->return_values[ix]);
+                same_types = (ret_dtype == kernel->return_values[ix]->dtype);
+            }
+
+            if (!same_types)
             {
                 std::stringstream ss;
                 ss << "Inconsistent return type in header and actual return type in body of: ";
                 ss << kernel->name;
-                emit_error(ss.str());
+                emit_parse_error(ss.str());
             }
 
             found_return = true;
@@ -267,23 +466,233 @@ void TGLparser::parse_next_kernel(const int start_line, const int start_pos, int
         std::stringstream ss;
         ss << "Missing return statement in body of: ";
         ss << kernel->name;
-        emit_error(ss.str());
+        emit_parse_error(ss.str());
+    }
+}
+
+void TGLparser::parse_pipeline(const int start_tok, int& next_tok)
+{
+    int current_tok = start_tok;
+    std::string_view next_token;
+
+    // pipeline name(args)
+    std::string pipeline_name(get_token(current_tok++).text);
+
+    bool is_defined = defined_global_kernels.contains(pipeline_name) || defined_device_kernels.contains(pipeline_name)
+        || std::any_of(defined_pipelines.begin(), defined_pipelines.end(),
+            [&](const PipelinePtr& pipeline) { return pipeline->name == pipeline_name; });
+    if (is_defined)
+    {
+        std::stringstream ss;
+        ss << "Kernel or pipeline already defined: ";
+        ss << pipeline_name;
+        emit_error_at(ss.str(), current_tok);
+    }
+
+    next_token = get_token(current_tok++).text;
+    if (next_token != "(")
+    {
+        std::stringstream ss;
+        ss << "Expected a ( character instead of ";
+        ss << next_token;
+        emit_error_at(ss.str(), current_tok);
+    }
+
+    // the names of the pipeline are not visible in the kernels
+    std::unordered_map<int, VariableNodePtr> pipeline_vars;
+    std::vector<VariableNodePtr> args;
+
+    next_token = get_token(current_tok).text;
+    if (next_token == ")")  // no arguments
+    {
+        current_tok += 1;
+    }
+
+    while (next_token != ")")
+    {
+        auto var = parse_variable_type(current_tok, current_tok);
+        auto& name_token = get_token(current_tok++);  // read the var. name
+        var->name = name_token.text;
+        next_token = get_token(current_tok++).text;  // read delimiter
+
+        if (next_token != "," && next_token != ")")
+        {
+            std::stringstream ss;
+            ss << "Expected a , or ) in the pipeline arguments instead of ";
+            ss << next_token;
+            emit_error_at(ss.str(), current_tok);
+        }
+
+        args.push_back(var);
+        pipeline_vars.insert({name_token.symbol, var});
+    }
+
+    auto pipeline = create_pipeline(pipeline_name, args);
+
+    // the { starts the pipeline body
+    next_token = get_token(current_tok++).text;
+    if (next_token != "{")
+    {
+        std::stringstream ss;
+        ss << "Expected a { character for starting the pipeline body.";
+        emit_error_at(ss.str(), current_tok);
+    }
+
+    // each statement is either an intermediate (f32[] t;) or a launch (kernel_name(args);)
+    while (next_token != "}")
+    {
+        int statement_start_tok = current_tok;
+        auto& statement_token = get_token(current_tok++);
+        next_token = statement_token.text;
+
+        if (next_token.empty())
+        {
+            std::stringstream ss;
+            ss << "Expected a } character for closing the pipeline.";
+            emit_parse_error(ss.str(), statement_token.line, statement_token.pos);
+        }
+
+        if (next_token == "}")
+        {
+            continue;
+        }
+
+        if (data_type_names.contains(next_token))
+        {
+            auto var = parse_variable_type(statement_start_tok, current_tok);
+            auto& name_token = get_token(current_tok++);  // read the var. name
+            var->name = name_token.text;
+
+            if (var->vtype != VariableType::TENSOR)
+            {
+                std::stringstream ss;
+                ss << "Only tensors can be pipeline intermediates (e.g. f32[] t;), got a scalar: ";
+                ss << var->name;
+                emit_error_at(ss.str(), current_tok);
+            }
+
+            if (pipeline_vars.contains(name_token.symbol))
+            {
+                std::stringstream ss;
+                ss << "Name already defined in the pipeline: ";
+                ss << var->name;
+                emit_error_at(ss.str(), current_tok);
+            }
+
+            next_token = get_token(current_tok++).text;
+            if (next_token != ";")
+            {
+                std::stringstream ss;
+                ss << "Expected a ; after the intermediate ";
+                ss << var->name;
+                emit_error_at(ss.str(), current_tok);
+            }
+
+            pipeline->intermediates.push_back(std::static_pointer_cast<TensorNode>(var));
+            pipeline_vars.insert({name_token.symbol, var});
+            continue;
+        }
+
+        // launch of a global kernel
+        std::string kernel_name(next_token);
+        if (!defined_global_kernels.contains(kernel_name))
+        {
+            std::stringstream ss;
+            ss << "Expected a launch of a global kernel defined earlier or an intermediate, got: ";
+            ss << kernel_name;
+            emit_error_at(ss.str(), current_tok);
+        }
+        auto kernel = defined_global_kernels.at(kernel_name);
+
+        next_token = get_token(current_tok++).text;
+        if (next_token != "(")
+        {
+            std::stringstream ss;
+            ss << "Expected a ( character after the kernel name ";
+            ss << kernel_name;
+            emit_error_at(ss.str(), current_tok);
+        }
+
+        std::vector<ASTNodePtr> arguments;
+        while (next_token != ")")
+        {
+            auto& arg_token = get_token(current_tok++);
+            next_token = arg_token.text;
+            if (next_token == ")" || next_token == ",")
+                continue;
+
+            if (!pipeline_vars.contains(arg_token.symbol))
+            {
+                std::stringstream ss;
+                ss << "Undefined variable in pipeline launch arguments: ";
+                ss << next_token;
+                emit_error_at(ss.str(), current_tok);
+            }
+
+            auto var = pipeline_vars.at(arg_token.symbol);
+            if (kernel->arguments.size() <= arguments.size())
+            {
+                std::stringstream ss;
+                ss << "Too much argument in the launch of ";
+                ss << kernel_name;
+                emit_error_at(ss.str(), current_tok);
+            }
+
+            auto& param = kernel->arguments[arguments.size()];
+            if (var->vtype != param->vtype || var->dtype != param->dtype)
+            {
+                std::stringstream ss;
+                ss << "Wrong argument type at ";
+                ss << var->name;
+                ss << " for the launch of ";
+                ss << kernel_name;
+                emit_error_at(ss.str(), current_tok);
+            }
+
+            arguments.push_back(var);
+        }
+
+        if (kernel->arguments.size() > arguments.size())
+        {
+            std::stringstream ss;
+            ss << "Missing arguments in the launch of ";
+            ss << kernel_name;
+            emit_error_at(ss.str(), current_tok);
+        }
+
+        next_token = get_token(current_tok++).text;
+        if (next_token != ";")
+        {
+            std::stringstream ss;
+            ss << "Expected a ; after the launch of ";
+            ss << kernel_name;
+            emit_error_at(ss.str(), current_tok);
+        }
+
+        pipeline->stages.push_back(create_kernelcall_node(kernel, arguments));
     }
 
+    if (pipeline->stages.empty())
+    {
+        std::stringstream ss;
+        ss << "Pipeline without kernel launches: ";
+        ss << pipeline_name;
+        emit_error_at(ss.str(), current_tok);
+    }
+
+    defined_pipelines.push_back(pipeline);
+
     // return
-    next_line = current_line;
-    next_pos = current_pos;
+    next_tok = current_tok;
 }
 
-KernelNodePtr TGLparser::parse_kernel_header(const int start_line, const int start_pos, int& next_pos)
+KernelNodePtr TGLparser::parse_kernel_header(const int start_tok, int& next_tok)
 {
-    int current_line = start_line;
-    int current_pos = start_pos;
-    std::string next_token;
+    int current_tok = start_tok;
+    std::string_view next_token;
 
     // parse the function type
-    auto& cline = all_lines[current_line];
-    current_pos = parse_next_token(next_token, cline, current_pos);
+    next_token = get_token(current_tok++).text;
     
     KernelScope kernel_scope;
     if (next_token == "global")
@@ -299,379 +708,608 @@ KernelNodePtr TGLparser::parse_kernel_header(const int start_line, const int sta
         std::stringstream ss;
         ss << "Wrong scope for function: ";
         ss << next_token;
-        emit_error(ss.str(), current_line, current_pos);
+        emit_error_at(ss.str(), current_tok);
     }
 
     // parse the return type
-    int prev_pos = current_pos;
-    current_pos = parse_next_token(next_token, cline, current_pos);
+    int prev_tok = current_tok;
+    next_token = get_token(current_tok++).text;
+
+    std::vector<VariableNodePtr> return_var_types;
+    if (next_token == "(")  // several return values, e.g. (f32, f32)
+    {
+        while (next_token != ")")
+        {
+            return_var_types.push_back(parse_variable_type(current_tok, current_tok));
+            next_token = get_token(current_tok++).text;  // read delimiter
+
+            if (next_token != "," && next_token != ")")
+            {
+                std::stringstream ss;
+                ss << "Expected a , or ) in the return types instead of ";
+                ss << next_token;
+                emit_error_at(ss.str(), current_tok);
+            }
+        }
 
-    VariableNodePtr return_var_type = nullptr; 
-    if (next_token != "void")
+        if (kernel_scope != KernelScope::DEVICE || return_var_types.size() < 2)
+        {
+            std::stringstream ss;
+            ss << "Only device kernels can return several (at least two) values.";
+            emit_error_at(ss.str(), current_tok);
+        }
+    }
+    else if (next_token != "void")
     {
-        if (next_token != "f32")
+        if (!data_type_names.contains(next_token))
         {
             std::stringstream ss;
             ss << "Wrong variable type: ";
             ss << next_token;
-            emit_error(ss.str(), current_line, current_pos);
+            emit_error_at(ss.str(), current_tok);
         }
 
-        return_var_type = parse_variable_type(current_line, prev_pos, current_pos);
+        return_var_types.push_back(parse_variable_type(prev_tok, current_tok));
     }
 
     // parse the function name
-    std::string kernel_name;
-    current_pos = parse_next_token(kernel_name, cline, current_pos);
+    auto& name_token = get_token(current_tok++);
 
     // parse argument var types
     std::vector<VariableNodePtr> args;
     
-    std::string start_parantheses;
-    current_pos = parse_next_token(start_parantheses, cline, current_pos);
-
-    if (start_parantheses != "(")
+    next_token = get_token(current_tok++).text;
+    if (next_token != "(")
     {
         std::stringstream ss;
         ss << "Expected a ( character instead of ";
-        ss << start_parantheses;
-        emit_error(ss.str(), current_line, current_pos);
+        ss << next_token;
+        emit_error_at(ss.str(), current_tok);
     }
     
-    bool empty_arg = false;
-    parse_next_token(next_token, cline, current_pos);
-    if (next_token == ")")
+    next_token = get_token(current_tok).text;
+    if (next_token == ")")  // no arguments
     {
-        empty_arg = true;
+        current_tok += 1;
     }
 
-    while (!empty_arg && next_token != ")")
+    while (next_token != ")")
     {
-        auto var = parse_variable_type(current_line, current_pos, current_pos);
-        current_pos = parse_next_token(next_token, cline, current_pos);  // read the var. name
-        var->name = next_token;
-        current_pos = parse_next_token(next_token, cline, current_pos);  // read delimiter
+        auto var = parse_variable_type(current_tok, current_tok);
+        auto& arg_token = get_token(current_tok++);  // read the var. name
+        var->name = arg_token.text;
+        next_token = get_token(current_tok++).text;  // read delimiter
         args.push_back(var);
-        defined_nodes.insert({var->name, var});
     }
 
     // return values
-    next_pos = current_pos;
-    auto node = create_kernel_node(kernel_name, kernel_scope, args, return_var_type);
-    defined_nodes.insert({kernel_name, node});
-    return node;
+    next_tok = current_tok;
+    return create_kernel_node(std::string(name_token.text), kernel_scope, args, return_var_types);
 }
 
-void TGLparser::parse_kernel_body(KernelNodePtr kernel, const int start_line, const int start_pos, int& next_line, int& next_pos)
+void TGLparser::parse_kernel_body(KernelNodePtr kernel, const int start_tok, int& next_tok)
 {
-    std::string next_token;
-    int current_line = start_line;
-    int current_pos = start_pos;
+    std::string_view next_token;
+    int current_tok = start_tok;
 
     // search for the { to know the start of the kernel body
     while (next_token != "{")
     {
-        if (current_line >= all_lines.size())
+        auto& token = get_token(current_tok++);
+        next_token = token.text;
+
+        if (next_token.empty())
         {
             std::stringstream ss;
             ss << "Expected a { character for starting the kernel body.";
-            emit_error(ss.str(), current_line, current_pos);
+            emit_parse_error(ss.str(), token.line, token.pos);
         }
+    }
 
-        auto& cline = all_lines[current_line];
-        current_pos = parse_next_token(next_token, cline, current_pos);
+    parse_statements(kernel->body, current_tok, current_tok);
+    
+    // return
+    next_tok = current_tok;
+}
 
-        if (next_token == "")  // line ended
-        {
-            current_line += 1;
-            current_pos = 0;
-        }
-    }
+void TGLparser::parse_statements(std::vector<ASTNodePtr>& statements, const int start_tok, int& next_tok)
+{
+    std::string_view next_token;
+    int current_tok = start_tok;
 
-    while (next_token != "}")  // until the end of the body
+    while (next_token != "}")  // until the end of the block
     {
         // next token can be either of the following:
         //    - var v = arithmetic_expression;
         //    - function_call(args);
         //    - v = arithmetic_expression;
+        //    - repeat N { statements }
         //    - return v;
         // each situation requires different handling
 
         // get next token
-        int line_expression_start_pos = current_pos;
-        auto& cline = all_lines[current_line];
-        current_pos = parse_next_token(next_token, cline, current_pos);
+        int statement_start_tok = current_tok;
+        auto& first_token = get_token(current_tok++);
+        next_token = first_token.text;
 
-        check_paranthesis_in_line(current_line);
-        
-        // handle if next token is empty (no more expressions in current line)
-        if (next_token == "")
+        if (next_token.empty())
         {
-            current_line += 1;
-            current_pos = 0;
+            std::stringstream ss;
+            ss << "Expected a } character for closing the block.";
+            emit_parse_error(ss.str(), first_token.line, first_token.pos);
         }
+
         // handle if next token is var (it is not ambigous)
-        else if (next_token == "var")
+        if (next_token == "var")
         {
-            auto node = parse_alias_node(current_line, current_pos, current_pos);
-            kernel->body.push_back(node);
+            if (get_token(current_tok).text == "(")  // several return values of a call
+            {
+                auto nodes = parse_tuple_alias_nodes(current_tok, current_tok);
+                statements.insert(statements.end(), nodes.begin(), nodes.end());
+            }
+            else
+            {
+                auto node = parse_alias_node(current_tok, current_tok);
+                statements.push_back(node);
+            }
         }
         // handle if next token is return
         else if (next_token == "return")
         {
-            auto node = parse_return_node(current_line, current_pos, current_pos);
-            kernel->body.push_back(node);
+            auto node = parse_return_node(current_tok, current_tok);
+            statements.push_back(node);
+        }
+        // handle if next token is repeat
+        else if (next_token == "repeat")
+        {
+            auto node = parse_repeat_node(current_tok, current_tok);
+            statements.push_back(node);
         }
         // handle the function call or the assignment case
         else if (next_token != "}")
         {
-            std::string first_token = next_token;
-            current_pos = parse_next_token(next_token, cline, current_pos);
+            next_token = get_token(current_tok++).text;
             
+            // handle the update of a loop-carried variable
+            if (next_token == "=" && carried_vars.contains(first_token.symbol))
+            {
+                auto arithm_node = parse_arithmetic_node(current_tok, current_tok);
+                check_single_value(arithm_node, current_tok);
+
+                auto loop_var = carried_vars.at(first_token.symbol);
+                if (check_data_type(arithm_node, current_tok) != check_data_type(loop_var, current_tok))
+                {
+                    std::stringstream ss;
+                    ss << "Data type of a carried variable can not change in the repeat block: ";
+                    ss << first_token.text;
+                    emit_error_at(ss.str(), current_tok);
+                }
+
+                loop_var->next = arithm_node;
+                defined_nodes.insert_or_assign(first_token.symbol, arithm_node);  // later reads see the new value
+            }
             // handle the assignment case
-            if (next_token == "=")
+            else if (next_token == "=")
             {
-                auto node = parse_assignment_node(first_token, current_line, current_pos, current_pos);
-                kernel->body.push_back(node);
+                auto node = parse_assignment_node(statement_start_tok, current_tok, current_tok);
+                statements.push_back(node);
             }
             // handle the potential function call case
             else if (next_token == "(")
             {
-                auto node = parse_arithmetic_node(current_line, line_expression_start_pos, current_pos);
-                kernel->body.push_back(node);
+                auto node = parse_arithmetic_node(statement_start_tok, current_tok);
+                check_data_type(node, current_tok);
+                statements.push_back(node);
             }
             // unexpected case
             else
             {
                 std::stringstream ss;
                 ss << "Unexpected expression, starts with ";
-                ss << first_token;
-                emit_error(ss.str(), current_line, current_pos);
+                ss << first_token.text;
+                emit_error_at(ss.str(), current_tok);
             }
         }
     }
     
     // return
-    next_line = current_line;
-    next_pos = current_pos;
+    next_tok = current_tok;
 }
 
-
-void TGLparser::check_paranthesis_in_line(const int start_line)
+RepeatNodePtr TGLparser::parse_repeat_node(const int start_tok, int& next_tok)
 {
-    int current_pos = 0;
-    
-    std::string next_token = " ";
-    auto& cline = all_lines[start_line];
-    
-    int num_open_paranthesis = 0;
-    while (next_token != "")
+    std::string_view next_token;
+    int current_tok = start_tok;
+
+    // repeat keyword is already consumed by the caller
+    // reading the trip count (positive integer)
+    next_token = get_token(current_tok++).text;
+    bool is_count = !next_token.empty() && next_token.size() < 10;
+    for (auto c : next_token)
     {
-        current_pos = parse_next_token(next_token, cline, current_pos);
+        is_count = is_count && isdigit(c);
+    }
 
-        if (next_token == "(")
+    int trip_count = is_count ? std::stoi(std::string(next_token)) : 0;
+    if (trip_count < 1)
+    {
+        std::stringstream ss;
+        ss << "Expected a positive integer trip count after repeat, got instead: ";
+        ss << next_token;
+        emit_error_at(ss.str(), current_tok);
+    }
+
+    // the { starts the block
+    next_token = get_token(current_tok++).text;
+    if (next_token != "{")
+    {
+        std::stringstream ss;
+        ss << "Expected a { character for starting the repeat block.";
+        emit_error_at(ss.str(), current_tok);
+    }
+
+    // aliases from outside which are updated in the block are carried
+    // from one iteration to the next one
+    std::vector<LoopVarNodePtr> loop_vars;
+    for (int symbol : collect_assigned_names(current_tok))
+    {
+        auto outer_node = find_defined_node(symbol);
+        if (!outer_node || std::dynamic_pointer_cast<VariableNode>(outer_node))
         {
-            num_open_paranthesis++;
+            continue;  // tensors are stored, unknown names are reported later
         }
-        else if (next_token == ")")
+
+        loop_vars.push_back(create_loopvar_node(std::string(symbols.get_name(symbol)), outer_node));
+    }
+
+    auto node = create_repeat_node(trip_count, loop_vars);
+
+    // names defined inside the block are local to it
+    auto outer_nodes = defined_nodes;
+    auto outer_carried_vars = carried_vars;
+
+    for (auto& loop_var : loop_vars)
+    {
+        int symbol = symbols.find(loop_var->name);
+        defined_nodes.insert_or_assign(symbol, loop_var);
+        carried_vars.insert_or_assign(symbol, loop_var);
+    }
+
+    parse_statements(node->body, current_tok, current_tok);
+
+    defined_nodes = outer_nodes;
+    carried_vars = outer_carried_vars;
+
+    for (auto expr : node->body)
+    {
+        if (std::dynamic_pointer_cast<ReturnNode>(expr))
         {
-            num_open_paranthesis--;
+            std::stringstream ss;
+            ss << "Return statement is not allowed inside a repeat block.";
+            emit_error_at(ss.str(), current_tok);
         }
+    }
 
-        if (num_open_paranthesis < 0)
+    // after the block the names refer to the values of the last iteration,
+    // this is also an update if the block is nested in another one
+    for (auto& loop_var : loop_vars)
+    {
+        int symbol = symbols.find(loop_var->name);
+        defined_nodes.insert_or_assign(symbol, loop_var);
+
+        if (carried_vars.contains(symbol))
         {
-            break;
+            carried_vars.at(symbol)->next = loop_var;
         }
     }
 
-    if (num_open_paranthesis != 0)
+    // return
+    next_tok = current_tok;
+    return node;
+}
+
+std::vector<int> TGLparser::collect_assigned_names(const int start_tok)
+{
+    std::vector<int> names;
+
+    int depth = 0;
+    std::string_view prev_token = "{";
+    for (int tok = start_tok; depth >= 0 && !get_token(tok).text.empty(); ++tok)
     {
-        std::stringstream ss;
-        ss << "Paranthesis is not closed properly in the given line.";
-        emit_error(ss.str(), start_line, 0);
+        auto& token = get_token(tok);
+        if (token.text == "{")
+        {
+            depth++;
+        }
+        else if (token.text == "}")
+        {
+            depth--;
+        }
+
+        // statement start: name = 
+        bool statement_start = (prev_token == ";" || prev_token == "{" || prev_token == "}");
+        if (statement_start && token.symbol >= 0 && get_token(tok + 1).text == "=")
+        {
+            if (std::find(names.begin(), names.end(), token.symbol) == names.end())
+            {
+                names.push_back(token.symbol);
+            }
+        }
+
+        prev_token = token.text;
     }
+
+    return names;
 }
 
 
-VariableNodePtr TGLparser::parse_variable_type(
-    const int start_line, 
-    const int start_pos, 
-    int& next_pos)
+VariableNodePtr TGLparser::parse_variable_type(const int start_tok, int& next_tok)
 {
     VariableNodePtr var = nullptr;
-    int current_pos = start_pos;
-    
-    std::string next_token;
-    auto& cline = all_lines[start_line];  // variable type def has to be in one line
+    int current_tok = start_tok;
+    std::string_view next_token;
 
     // read the data type
     DataType dtype;
-    current_pos = parse_next_token(next_token, cline, current_pos);
-    if (next_token == "f32")
+    next_token = get_token(current_tok++).text;
+    if (data_type_names.contains(next_token))
     {
-        dtype = DataType::FLOAT32;
+        dtype = data_type_names.at(next_token);
     }
     else
     {
         std::stringstream ss;
-        ss << "Expected a f32, but got instead: ";
+        ss << "Expected a data type (f32, c64, f32x2, f32x4), but got instead: ";
         ss << next_token;
-        emit_error(ss.str(), start_line, current_pos);
+        emit_error_at(ss.str(), current_tok);
     }
 
     // decide variable type
-    VariableType vtype;
-    int prev_pos = current_pos;
-    current_pos = parse_next_token(next_token, cline, current_pos);
-    if (next_token == "[")  // this has to be a tensor
+    if (get_token(current_tok).text == "[")  // this has to be a tensor
     {
-        vtype = VariableType::TENSOR;
-        current_pos = parse_next_token(next_token, cline, current_pos);
+        current_tok += 1;
+        next_token = get_token(current_tok++).text;
         if (next_token != "]")
         {
             std::stringstream ss;
             ss << "Expected a closing bracket ], got instead: ";
             ss << next_token;
-            emit_error(ss.str(), start_line, current_pos);
+            emit_error_at(ss.str(), current_tok);
         }
 
         var = create_tensor_node(dtype, "");
     }
     else  // has to be a scalar
     {
-        vtype = VariableType::SCALAR;
-        current_pos = prev_pos;  // restore position
         var = create_scalar_node(dtype, "");
     }
     
-    next_pos = current_pos;
+    next_tok = current_tok;
     return var;
 }
 
-ConstantNodePtr TGLparser::parse_constant_scalar(
-    const std::string& value_as_string, 
-    const int start_line, 
-    const int start_pos)
+ConstantNodePtr TGLparser::parse_constant_scalar(const int value_tok)
 {
+    auto value_as_string = get_token(value_tok).text;
     if (!is_float_number(value_as_string))
     {
         std::stringstream ss;
         ss << "Value can not be converted to float: ";
         ss << value_as_string;
-        emit_error(ss.str(), start_line, start_pos);
+        emit_error_at(ss.str(), value_tok + 1);
     }
 
-    float value = std::atof(value_as_string.c_str());
+    float value = std::atof(std::string(value_as_string).c_str());
     return create_constant_node(value, DataType::FLOAT32);
 }
 
-AliasNodePtr TGLparser::parse_alias_node(  // var d = arithmetic_node;
-    const int start_line, 
-    const int start_pos, 
-    int& next_pos)
+AliasNodePtr TGLparser::parse_alias_node(const int start_tok, int& next_tok)  // var d = arithmetic_node;
 {
-    std::string line = all_lines[start_line];
-    int current_pos = start_pos;
-    std::string next_token;
+    int current_tok = start_tok;
+    std::string_view next_token;
 
     // var keyword is already consumed by the caller
     // reading var name
-    current_pos = parse_next_token(next_token, line, current_pos);
-    std::string var_name = next_token;
-    if (defined_nodes.contains(var_name))
+    auto& name_token = get_token(current_tok++);
+    if (find_defined_node(name_token.symbol))
     {
         std::stringstream ss;
         ss << "Alias variable is already defined (duplication not allowed): ";
-        ss << var_name;
-        emit_error(ss.str(), start_line, current_pos);
+        ss << name_token.text;
+        emit_error_at(ss.str(), current_tok);
     }
 
     // check the equation sign
-    current_pos = parse_next_token(next_token, line, current_pos);
+    next_token = get_token(current_tok++).text;
     if (next_token != "=")
     {
         std::stringstream ss;
         ss << "Expected an = but instead got: ";
         ss << next_token;
-        emit_error(ss.str(), start_line, current_pos);
+        emit_error_at(ss.str(), current_tok);
     }
 
     // process the arithmetic node (function calls also handled by it)
-    auto arithm_node = parse_arithmetic_node(start_line, current_pos, current_pos);
+    auto arithm_node = parse_arithmetic_node(current_tok, current_tok);
+    check_single_value(arithm_node, current_tok);
+    check_data_type(arithm_node, current_tok);
 
     // build the alias node
-    auto node = create_alias_node(var_name, arithm_node);
-    defined_nodes.insert({var_name, node});
+    auto node = create_alias_node(std::string(name_token.text), arithm_node);
+    defined_nodes.insert({name_token.symbol, node});
 
     // return
-    next_pos = current_pos;
+    next_tok = current_tok;
     return node;
 }
 
-ReturnNodePtr TGLparser::parse_return_node( 
-    const int start_line, 
-    const int start_pos, 
-    int& next_pos)
+std::vector<AliasNodePtr> TGLparser::parse_tuple_alias_nodes(const int start_tok, int& next_tok)  // var (s, c) = kernel_call(args);
+{
+    int current_tok = start_tok;
+    std::string_view next_token;
+
+    // var keyword is already consumed by the caller
+    // reading the ( and the var names
+    next_token = get_token(current_tok++).text;
+
+    std::vector<int> name_toks;
+    while (next_token != ")")
+    {
+        int name_tok = current_tok++;
+        auto& name_token = get_token(name_tok);
+        std::string_view var_name = name_token.text;
+
+        bool is_name = !var_name.empty() && (isalpha(var_name[0]) || var_name[0] == '_');
+        if (!is_name)
+        {
+            std::stringstream ss;
+            ss << "Expected an alias name, but got instead: ";
+            ss << var_name;
+            emit_error_at(ss.str(), current_tok);
+        }
+
+        bool duplicated = std::any_of(name_toks.begin(), name_toks.end(),
+            [&](const int tok) { return get_token(tok).symbol == name_token.symbol; });
+        if (find_defined_node(name_token.symbol) || duplicated)
+        {
+            std::stringstream ss;
+            ss << "Alias variable is already defined (duplication not allowed): ";
+            ss << var_name;
+            emit_error_at(ss.str(), current_tok);
+        }
+
+        name_toks.push_back(name_tok);
+
+        next_token = get_token(current_tok++).text;
+        if (next_token != "," && next_token != ")")
+        {
+            std::stringstream ss;
+            ss << "Expected a , or ) after the alias name, but got instead: ";
+            ss << next_token;
+            emit_error_at(ss.str(), current_tok);
+        }
+    }
+
+    // check the equation sign
+    next_token = get_token(current_tok++).text;
+    if (next_token != "=")
+    {
+        std::stringstream ss;
+        ss << "Expected an = but instead got: ";
+        ss << next_token;
+        emit_error_at(ss.str(), current_tok);
+    }
+
+    // the right side has to be a single call with the same number of return values
+    auto arithm_node = parse_arithmetic_node(current_tok, current_tok);
+    auto call_node = std::dynamic_pointer_cast<KernelCallNode>(arithm_node);
+    if (!call_node || call_node->kernel->return_values.size() != name_toks.size())
+    {
+        std::stringstream ss;
+        ss << "Expected a call of a kernel with ";
+        ss << name_toks.size();
+        ss << " return values.";
+        emit_error_at(ss.str(), current_tok);
+    }
+
+    check_data_type(call_node, current_tok);
+
+    // build the alias nodes
+    std::vector<AliasNodePtr> nodes;
+    for (int ix = 0; ix < name_toks.size(); ++ix)
+    {
+        auto& name_token = get_token(name_toks[ix]);
+        auto element_node = create_tuple_element_node(call_node, ix);
+        auto node = create_alias_node(std::string(name_token.text), element_node);
+        defined_nodes.insert({name_token.symbol, node});
+        nodes.push_back(node);
+    }
+
+    // return
+    next_tok = current_tok;
+    return nodes;
+}
+
+ReturnNodePtr TGLparser::parse_return_node(const int start_tok, int& next_tok)
 {
-    std::string line = all_lines[start_line];
-    int current_pos = start_pos;
+    int current_tok = start_tok;
 
     // return keyword is already consumed by the caller
-    // process the arithmetic node (function calls also handled by it)
-    auto arithm_node = parse_arithmetic_node(start_line, current_pos, current_pos);
+    // process the arithmetic nodes (function calls also handled by it)
+    std::vector<ASTNodePtr> return_values;
+    bool proceed = true;
+    while (proceed)
+    {
+        auto arithm_node = parse_arithmetic_node(current_tok, current_tok);
+        proceed = (get_closing_delimiter(current_tok) == ',');
+
+        if (arithm_node)
+        {
+            check_single_value(arithm_node, current_tok);
+            check_data_type(arithm_node, current_tok);
+            return_values.push_back(arithm_node);
+        }
+        else if (proceed || !return_values.empty())
+        {
+            std::stringstream ss;
+            ss << "Missing return value in the return statement.";
+            emit_error_at(ss.str(), current_tok);
+        }
+    }
 
     // build return node
-    auto node = create_return_node(arithm_node);
+    auto node = create_return_node(return_values);
 
     // return
-    next_pos = current_pos;
+    next_tok = current_tok;
     return node;
 }
 
-AssignmentNodePtr TGLparser::parse_assignment_node(
-    const std::string& var_name, 
-    const int start_line, 
-    const int start_pos, 
-    int& next_pos)
+AssignmentNodePtr TGLparser::parse_assignment_node(const int name_tok, const int start_tok, int& next_tok)
 {
-    std::string line = all_lines[start_line];
-    int current_pos = start_pos;
-    std::string next_token;
+    auto& name_token = get_token(name_tok);
+    int current_tok = start_tok;
 
     // var name is already consumed by the caller
     // = sign is also consumed by the caller
     
     // getting node for var name
-    if (!defined_nodes.contains(var_name))
+    auto var_node = find_defined_node(name_token.symbol);
+    if (!var_node)
     {
         std::stringstream ss;
         ss << "Assigning to undefined variable: ";
-        ss << var_name;
-        emit_error(ss.str(), start_line, current_pos);
+        ss << name_token.text;
+        emit_error_at(ss.str(), current_tok);
     }
 
-    auto var_node = defined_nodes.at(var_name);
+    if (!std::dynamic_pointer_cast<TensorNode>(var_node))
+    {
+        std::stringstream ss;
+        ss << "Only tensors can be assigned (aliases only inside repeat blocks): ";
+        ss << name_token.text;
+        emit_error_at(ss.str(), current_tok);
+    }
 
     // process the arithmetic node (function calls also handled by it)
-    auto arithm_node = parse_arithmetic_node(start_line, current_pos, current_pos);
+    auto arithm_node = parse_arithmetic_node(current_tok, current_tok);
+    check_single_value(arithm_node, current_tok);
 
     // build the alias node
     auto node = create_assignment_node(var_node, arithm_node);
+    check_data_type(node, current_tok);
 
     // return
-    next_pos = current_pos;
+    next_tok = current_tok;
     return node;
 }
 
-ASTNodePtr TGLparser::parse_kernel_call_node(
-    const std::string& kernel_name, 
-    const int start_line,
-    const int start_pos, 
-    int& next_pos)
+ASTNodePtr TGLparser::parse_kernel_call_node(const int name_tok, const int start_tok, int& next_tok)
 {
-    std::string line = all_lines[start_line];
-    int current_pos = start_pos;
-    std::string next_token;
+    auto& name_token = get_token(name_tok);
+    std::string_view kernel_name = name_token.text;
+    int current_tok = start_tok;
+    std::string_view next_token;
 
     ASTNodePtr node = nullptr;
 
@@ -679,36 +1317,38 @@ ASTNodePtr TGLparser::parse_kernel_call_node(
     // '(' paranthesis is also consumed by the caller
     
     // getting node for var name
-    if (defined_nodes.contains(kernel_name))
+    auto defined_node = find_defined_node(name_token.symbol);
+    if (defined_node)
     {
-        auto kernel_node = std::dynamic_pointer_cast<KernelNode>(defined_nodes.at(kernel_name));
+        auto kernel_node = std::dynamic_pointer_cast<KernelNode>(defined_node);
 
         if (!kernel_node)
         {
             std::stringstream ss;
             ss << "Expected a kernel node for: ";
             ss << kernel_name;
-            emit_error(ss.str(), start_line, current_pos);
+            emit_error_at(ss.str(), current_tok);
         }
 
         // process the arguments
         std::vector<ASTNodePtr> arguments;
         while (next_token != ")")
         {
-            current_pos = parse_next_token(next_token, line, current_pos);
+            auto& arg_token = get_token(current_tok++);
+            next_token = arg_token.text;
             if (next_token != ")" && next_token != ",")
             {
-                std::string var_name = next_token;
+                std::string_view var_name = next_token;
 
-                if (!defined_nodes.contains(var_name))
+                auto node = find_defined_node(arg_token.symbol);
+                if (!node)
                 {
                     std::stringstream ss;
                     ss << "Undefined variable in call arguments: ";
                     ss << var_name;
-                    emit_error(ss.str(), start_line, current_pos);
+                    emit_error_at(ss.str(), current_tok);
                 }
 
-                auto node = defined_nodes.at(var_name);
                 
                 // check if argument is the same as expected type
                 VariableType var_node_type = VariableType::SCALAR;  // alias is a scalar after codegen
@@ -723,7 +1363,7 @@ ASTNodePtr TGLparser::parse_kernel_call_node(
                     std::stringstream ss;
                     ss << "Too much argument in kernel call: ";
                     ss << kernel_name;
-                    emit_error(ss.str(), start_line, current_pos);
+                    emit_error_at(ss.str(), current_tok);
                 }
 
                 if (var_node_type != kernel_node->arguments[arguments.size()]->vtype)
@@ -733,7 +1373,7 @@ ASTNodePtr TGLparser::parse_kernel_call_node(
                     ss << var_name;
                     ss << " for kernel call in: ";
                     ss << kernel_name;
-                    emit_error(ss.str(), start_line, current_pos);
+                    emit_error_at(ss.str(), current_tok);
                 }
 
                 arguments.push_back(node);
@@ -745,7 +1385,7 @@ ASTNodePtr TGLparser::parse_kernel_call_node(
             std::stringstream ss;
             ss << "Missing arguments in kernel call: ";
             ss << kernel_name;
-            emit_error(ss.str(), start_line, current_pos);
+            emit_error_at(ss.str(), current_tok);
         }
 
         // build the alias node
@@ -753,18 +1393,18 @@ ASTNodePtr TGLparser::parse_kernel_call_node(
     }
     else if (builtin_kernel_names.contains(kernel_name))  // check for builtin functions
     {
-        current_pos = parse_next_token(next_token, line, current_pos);
-        std::string var_name = next_token;
+        auto& arg_token = get_token(current_tok++);
+        std::string_view var_name = arg_token.text;
 
-        if (!defined_nodes.contains(var_name))
+        auto var_node = find_defined_node(arg_token.symbol);
+        if (!var_node)
         {
             std::stringstream ss;
             ss << "Undefined variable in call arguments: ";
             ss << var_name;
-            emit_error(ss.str(), start_line, current_pos);
+            emit_error_at(ss.str(), current_tok);
         }
 
-        auto var_node = defined_nodes.at(var_name);
 
         if (kernel_name == "sqrt")
         {
@@ -787,177 +1427,230 @@ ASTNodePtr TGLparser::parse_kernel_call_node(
             std::stringstream ss;
             ss << "Undefined variable in call arguments: ";
             ss << var_name;
-            emit_error(ss.str(), start_line, current_pos);
+            emit_error_at(ss.str(), current_tok);
         }
 
         // consume the ')' paranthesis
-        current_pos = parse_next_token(next_token, line, current_pos);
+        current_tok += 1;
     }
     else
     {
         std::stringstream ss;
         ss << "Undefined function can not be called: ";
         ss << kernel_name;
-        emit_error(ss.str(), start_line, current_pos);
+        emit_error_at(ss.str(), current_tok);
     }
 
     // return
-    next_pos = current_pos;
+    next_tok = current_tok;
     return node;
 }
 
-ASTNodePtr TGLparser::parse_arithmetic_node( 
-    const int start_line, 
-    const int start_pos, 
-    int& next_pos)
+ASTNodePtr TGLparser::parse_arithmetic_node(const int start_tok, int& next_tok)
 {
-    // 3 types of arithmetic operands
-    // - function call with immediate return
-    // - variable
-    // - another complex arithm expression (paranthesis signals it)
-    
-    std::string line = all_lines[start_line];
-    int current_pos = start_pos;
-    std::string next_token;
-
-    // helper structures
-    std::vector<char> operators;
-    std::vector<ASTNodePtr> ast_nodes;
-    
-    current_pos = parse_next_token(next_token, line, current_pos);
+    int current_tok = start_tok;
+    ASTNodePtr node = nullptr;
 
-    bool waiting_for_arithm_sign = false;  // first, an operand is required;
+    // an empty expression is a void return
+    std::string_view next_token = get_token(current_tok).text;
+    if (next_token != ";" && next_token != ",")
+    {
+        node = parse_expression(0, current_tok, current_tok);
+    }
 
-    while (next_token != ";" && next_token != ")" && next_token != "")
+    // the expression is closed by the delimiter, it can span several lines
+    auto& delimiter_token = get_token(current_tok++);
+    next_token = delimiter_token.text;
+    if (next_token != ";" && next_token != ",")
     {
-        // select arithmetc operand type
-        if (next_token == "(")  // complex arithmetic expression
+        std::stringstream ss;
+        if (next_token == ")")
         {
-            if (waiting_for_arithm_sign)
-            {
-                std::stringstream ss;
-                ss << "Expected the next arithmetic operation.";
-                emit_error(ss.str(), start_line, current_pos);
-            }
-
-            auto sub_expression = parse_arithmetic_node(start_line, current_pos, current_pos);
-            ast_nodes.push_back(sub_expression);
-            waiting_for_arithm_sign = true;
+            ss << "Paranthesis is not closed properly.";
         }
-        else if (arithmetic_chars.contains(next_token[0]))  // arithmetic operator sign, e.g. +
+        else if (delimiter_token.symbol >= 0 || next_token == "(")
         {
-            if (!waiting_for_arithm_sign)
-            {
-                std::stringstream ss;
-                ss << "Expected the next operand.";
-                emit_error(ss.str(), start_line, current_pos);
-            }
-
-            operators.push_back(next_token[0]);
-            waiting_for_arithm_sign = false;
+            ss << "Expected the next arithmetic operation.";
         }
-        else  // variable or function call
+        else
         {
-            if (waiting_for_arithm_sign)
-            {
-                std::stringstream ss;
-                ss << "Expected the next arithmetic operation.";
-                emit_error(ss.str(), start_line, current_pos);
-            }
-
-            std::string expr_name = next_token;
+            ss << "Expected a ; at the end of the statement instead of: ";
+            ss << (next_token.empty() ? "end of file" : next_token);
+        }
+        emit_error_at(ss.str(), current_tok);
+    }
 
-            int next_pos = parse_next_token(next_token, line, current_pos);
+    // return
+    next_tok = current_tok;
+    return node;
+}
 
-            if (next_token == "(")  // has to be a function
-            {
-                auto node = parse_kernel_call_node(expr_name, start_line, next_pos, current_pos);
-                ast_nodes.push_back(node);
-            }
-            else if (expr_name.find('.') < std::string::npos)  // can be a constant scalar
-            {
-                auto node = parse_constant_scalar(expr_name, start_line, current_pos);
-                ast_nodes.push_back(node);
-            }
-            else  // has to be a variable (or an alias)
-            {
-                if (!defined_nodes.contains(expr_name))
-                {
-                    std::stringstream ss;
-                    ss << "Undefined variable name (or alias): ";
-                    ss << expr_name;
-                    emit_error(ss.str(), start_line, next_pos);
-                }
+ASTNodePtr TGLparser::parse_expression(const int min_precedence, const int start_tok, int& next_tok)
+{
+    int current_tok = start_tok;
+    auto node = parse_operand(current_tok, current_tok);
 
-                auto node = defined_nodes.at(expr_name);
-                ast_nodes.push_back(node);
-            }
+    // operators binding at least as strong as min_precedence,
+    // the right side takes only the stronger ones (left associativity)
+    while (true)
+    {
+        std::string_view next_token = get_token(current_tok).text;
+        if (next_token.size() != 1 || !arithmetic_precedences.contains(next_token[0]))
+        {
+            break;
+        }
 
-            waiting_for_arithm_sign = true;
+        char op = next_token[0];
+        int precedence = arithmetic_precedences.at(op);
+        if (precedence < min_precedence)
+        {
+            break;
         }
 
-        current_pos = parse_next_token(next_token, line, current_pos);
-    }
+        current_tok += 1;
+        auto rhs = parse_expression(precedence + 1, current_tok, current_tok);
+        check_single_value(node, current_tok);
+        check_single_value(rhs, current_tok);
 
-    if (!waiting_for_arithm_sign && operators.size() > 0)
-    {
-        std::stringstream ss;
-        ss << "Unfinished arithmetic op";
-        emit_error(ss.str(), start_line, 0);
+        // build the right binary operator
+        if (op == '*')
+        {
+            node = create_mul_node(node, rhs);
+        }
+        else if (op == '/')
+        {
+            node = create_div_node(node, rhs);
+        }
+        else if (op == '+')
+        {
+            node = create_add_node(node, rhs);
+        }
+        else if (op == '-')
+        {
+            node = create_sub_node(node, rhs);
+        }
     }
-    
-    // process the arithmetic expressions
+
+    // return
+    next_tok = current_tok;
+    return node;
+}
+
+ASTNodePtr TGLparser::parse_operand(const int start_tok, int& next_tok)
+{
+    int current_tok = start_tok;
     ASTNodePtr node = nullptr;
-    while (operators.size() > 0)
+
+    auto& token = get_token(current_tok++);
+    std::string_view next_token = token.text;
+
+    if (next_token == "(")  // complex arithmetic expression
     {
-        // find the operator with highest precedence (first occurence)
-        int best_op_idx = 0;
-        int highest_prec = arithmetic_precedences.at(operators[best_op_idx]);
-        for (int idx = 1; idx < operators.size(); ++idx)
+        node = parse_expression(0, current_tok, current_tok);
+
+        next_token = get_token(current_tok++).text;
+        if (next_token != ")")
         {
-            int tentative_prec = arithmetic_precedences.at(operators[idx]);
-            if (highest_prec < tentative_prec)
-            {
-                best_op_idx = idx;
-                highest_prec = tentative_prec;
-            }
+            std::stringstream ss;
+            ss << "Paranthesis is not closed properly.";
+            emit_error_at(ss.str(), current_tok);
         }
+    }
+    else if (next_token == "-")  // unary minus, binds stronger than the binary operators
+    {
+        auto x = parse_operand(current_tok, current_tok);
+        check_single_value(x, current_tok);
 
-        char best_op = operators[best_op_idx];
-
-        // find the left and right arguments
-        auto lhs = ast_nodes[best_op_idx];
-        auto rhs = ast_nodes[best_op_idx + 1];
-
-        // build the right binary operator
-        ASTNodePtr subnode = nullptr;
-        if (best_op == '*')
+        auto constant_node = std::dynamic_pointer_cast<ConstantNode>(x);
+        if (constant_node)  // negative constant
         {
-            subnode = create_mul_node(lhs, rhs);
+            node = create_constant_node(-constant_node->val_f32, constant_node->dtype);
         }
-        else if (best_op == '/')
+        else  // exact for each data type, a f32 is broadcast
         {
-            subnode = create_div_node(lhs, rhs);
+            node = create_mul_node(create_constant_node(-1.0f, DataType::FLOAT32), x);
         }
-        else if (best_op == '+')
+    }
+    else if (token.symbol >= 0)  // variable, constant or function call
+    {
+        if (get_token(current_tok).text == "(")  // has to be a function
         {
-            subnode = create_add_node(lhs, rhs);
+            node = parse_kernel_call_node(start_tok, current_tok + 1, current_tok);
         }
-        else if (best_op == '-')
+        else if (next_token.find('.') != std::string_view::npos)  // can be a constant scalar
         {
-            subnode = create_sub_node(lhs, rhs);
+            node = parse_constant_scalar(start_tok);
         }
+        else  // has to be a variable (or an alias)
+        {
+            node = find_defined_node(token.symbol);
+            if (!node)
+            {
+                std::stringstream ss;
+                ss << "Undefined variable name (or alias): ";
+                ss << next_token;
+                emit_error_at(ss.str(), current_tok + 1);
+            }
 
-        // change the helper data
-        operators.erase(operators.begin() + best_op_idx);
-        ast_nodes.erase(ast_nodes.begin() + best_op_idx + 1);
-        ast_nodes[best_op_idx] = subnode;
+        }
+    }
+    else if (next_token.size() == 1 && (arithmetic_precedences.contains(next_token[0]) || next_token == "="))
+    {
+        std::stringstream ss;
+        ss << "Expected the next operand.";
+        emit_error_at(ss.str(), current_tok);
+    }
+    else
+    {
+        std::stringstream ss;
+        ss << "Expected an operand instead of: ";
+        ss << (next_token.empty() ? "end of file" : next_token);
+        emit_error_at(ss.str(), current_tok);
     }
-    
-    if (ast_nodes.size() > 0)  // otherwise it is a void return
-        node = ast_nodes[0];   // last remaining node is the root
 
     // return
-    next_pos = current_pos;
+    next_tok = current_tok;
     return node;
 }
+
+void TGLparser::check_single_value(const ASTNodePtr node, const int next_tok)
+{
+    auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node);
+    if (call_node && call_node->kernel->return_values.size() > 1)
+    {
+        std::stringstream ss;
+        ss << "Kernel with several return values can be only used as var (...) = ";
+        ss << call_node->kernel->name;
+        ss << "(...);";
+        emit_error_at(ss.str(), next_tok);
+    }
+}
+
+char TGLparser::get_closing_delimiter(const int next_tok) const
+{
+    if (next_tok < 1)
+    {
+        return '\0';
+    }
+
+    auto& token = get_token(next_tok - 1);
+    return token.text.empty() ? '\0' : token.text.back();
+}
+
+DataType TGLparser::check_data_type(const ASTNodePtr node, const int next_tok)
+{
+    if (!node)
+    {
+        std::stringstream ss;
+        ss << "Missing expression.";
+        emit_error_at(ss.str(), next_tok);
+    }
+
+    auto dtype = dtype_inference.get_dtype(node);
+    if (!dtype_inference.get_error().empty())
+    {
+        emit_error_at(dtype_inference.get_error(), next_tok);
+    }
+
+    return dtype;
+}
@@ -2,135 +2,301 @@
 
 #include "ast.hpp"
 #include "core.hpp"
+#include "lexer.hpp"
 
+/**
+ * Kernels and pipelines of the source which can be compiled on their own:
+ * the kernels calling each other (also through common device kernels)
+ * and the kernels launched by a pipeline are in the same unit.
+ */
+struct SourceUnit
+{
+    std::vector<KernelNodePtr> kernels;  // in source order
+    std::vector<PipelinePtr> pipelines;
+};
+
+/**
+ * Reads the tgl source into kernels and pipelines. The source is split
+ * at the kernel headers in order, then the kernel bodies are parsed in parallel
+ * (each body sees its own names and the kernels declared before it).
+ */
 class TGLparser
 {
 public:
-     
-    explicit TGLparser(const std::string& path_to_tgl);
+    /**
+     * @param num_threads threads parsing the kernel bodies, 0 for the number of cores
+     * @param defer_bodies only the headers and the pipelines are read, the kernel bodies
+     *     are parsed unit by unit with parse_unit (e.g. for streaming)
+     */
+    explicit TGLparser(const std::string& path_to_tgl, const int num_threads = 1, const bool defer_bodies = false);
     std::vector<KernelNodePtr> get_all_kernels() const;
+    std::vector<PipelinePtr> get_all_pipelines() const;
     KernelNodePtr get_global_kernel(const std::string& kernel_name) const;
 
+    /**
+     * The number of units with deferred bodies, the units follow the order of their first kernel.
+     * The called kernels are found from the tokens of the bodies.
+     */
+    int get_num_units() const;
+
+    /**
+     * Parses the kernel bodies of the unit into the current context
+     * (stops with an error at the first syntax error of the unit).
+     */
+    SourceUnit parse_unit(const int unit_ix);
+
+    /**
+     * Drops the kernel bodies of the unit, so their nodes can be released.
+     */
+    void release_unit(const int unit_ix);
+
+    /**
+     * Parses the deferred bodies of the named global kernels and pipelines and of the kernels
+     * they call (found from the kernel call nodes of the parsed bodies) into the current context.
+     * The other bodies are not parsed. The kernels and pipelines are in source order.
+     */
+    SourceUnit parse_selected_kernels(const std::vector<std::string>& kernel_names);
+
 protected:
-    std::vector<std::string> all_lines;  // all of the lines from the source file
+    /**
+     * Error found while parsing a definition, the first one in the source is reported.
+     */
+    struct ParseError
+    {
+        std::string message;
+        int line = -1;
+        int pos = -1;
+    };
+
+    /**
+     * A kernel or a pipeline of the source. The nodes are created in the
+     * context of the item, their ids are merged after the parsing.
+     */
+    struct SourceItem
+    {
+        KernelNodePtr kernel;  // nullptr for a pipeline
+        PipelinePtr pipeline;  // nullptr for a kernel
+        int body_tok = -1;     // first token after the kernel header
+        int end_tok = -1;      // first token after the item
+        std::shared_ptr<ASTContext> ast_context;  // nullptr with deferred bodies (the current context)
+        std::optional<ParseError> error;
+    };
+
+    std::shared_ptr<TGLlexer> lexer;  // shared with the kernel body parsers
+    const std::vector<Token>& tokens;  // all of the tokens from the source file
+    const SymbolTable& symbols;
 
-    static std::unordered_set<char> ignored_chars;
-    static std::unordered_set<char> bracket_chars;
-    static std::unordered_set<char> comma_chars;
-    static std::unordered_set<char> arithmetic_chars;
-    static std::unordered_set<std::string> builtin_kernel_names;
+    static std::unordered_set<std::string_view> builtin_kernel_names;
     static std::unordered_map<char, int> arithmetic_precedences;
+    static std::unordered_map<std::string_view, DataType> data_type_names;
     std::unordered_map<std::string, KernelNodePtr> defined_global_kernels;
     std::unordered_map<std::string, KernelNodePtr> defined_device_kernels;
-    std::unordered_map<std::string, ASTNodePtr> defined_nodes;
+    std::unordered_map<int, ASTNodePtr> defined_nodes;  // by the symbol of the name
     std::vector<KernelNodePtr> defined_kernels;  // kernels defined in order
+    std::vector<PipelinePtr> defined_pipelines;
+    std::unordered_map<int, LoopVarNodePtr> carried_vars;  // updated in the enclosing repeat blocks
+    DataTypeInference dtype_inference;
+
+    const TGLparser* file_parser;  // parser of the whole source, this for itself
+    int item_index = -1;           // item of the parsed kernel body
+    std::vector<SourceItem> items;
+    std::unordered_map<int, int> kernel_items;  // item index of the kernels by the symbol of the name
+    std::vector<std::vector<int>> unit_items;   // items of the units with deferred bodies
+
+    /**
+     * Parser of a single kernel body, it reads the tokens and the items of the file parser.
+     */
+    explicit TGLparser(const TGLparser& file_parser, const int item_index);
+
+    /**
+     * The node defined by the name: a name of the kernel body or
+     * a kernel declared before the parsed one. nullptr if it is not defined.
+     */
+    ASTNodePtr find_defined_node(const int symbol) const;
+
+    /**
+     * The token after the } closing the first { from start_tok on
+     * (the end token if there is none).
+     */
+    int skip_kernel_body(const int start_tok) const;
+
+    /**
+     * Sets the final ids of the nodes, the same as if the items were
+     * parsed one after the other in the current context.
+     */
+    void merge_item_ids();
+
+    /**
+     * Parses the deferred body of the kernel of the item in the current context,
+     * stops with an error at its first syntax error.
+     */
+    void parse_item_body(const int item_ix) const;
+
+    /**
+     * Stops with the first error of the items (in source order).
+     */
+    void check_item_errors() const;
+
+    /**
+     * Groups the items into units (see SourceUnit), a kernel is called
+     * if its name is followed by a ( in the body of the caller.
+     */
+    void split_into_units();
+
+    /**
+     * The token at an index, the empty end token past the end of the source.
+     */
+    const Token& get_token(const int tok) const;
+
+    /**
+     * Stops with an error at the end of the last consumed token.
+     * @param next_tok the index of the first token which is not consumed yet
+     */
+    [[noreturn]] void emit_error_at(const std::string& error_msg, const int next_tok) const;
 
     /**
-     * Reads all the text from the source file.
-     * Breaks the text into lines.
-     * @param path_to_tgl string representing the full path to the soorce file (*.tgl)
+     * Stops the parsing of the current definition with a ParseError.
      */
-    void read_all_lines_from_tgl(const std::string& path_to_tgl);
+    [[noreturn]] void emit_parse_error(const std::string& error_msg, const int line = -1, const int pos = -1) const;
 
     /**
-     * Searches and cuts the next token from a line.
-     * @param next_token the next token will be in this variable, empty string shows no more token
-     * @param line the line to search for the next token
-     * @param start_pos the search start at this position, inclusive
-     * @return the position where the search ended (next search should start here)
+     * Parse the next function header (the body is skipped) or pipeline from the source file.
+     * @param start_tok the first token to look for the next kernel def
+     * @param next_tok the token where the search ended (next search should start here)
      */
-    int parse_next_token(std::string& next_token, const std::string& line, const int start_pos);
+    void parse_next_kernel(SourceItem& item, const int start_tok, int& next_tok);
 
     /**
-     * Parse the next function from the source file.
-     * @param start_line the first line to look for the next kernel def
-     * @param start_pos first position within the line
-     * @param next_line the line where the search ended (next search should start here)
-     * @param next_pos the position where the search ended (next search should start here)
+     * Parse the body of the kernel of the item and check its return statements.
      */
-    void parse_next_kernel(const int start_line, const int start_pos, int& next_line, int& next_pos);
+    void parse_kernel_definition();
+
+    /**
+     * Reads the pipeline name(args) { f32[] t; kernel(args); ... } like code pieces.
+     * The launched kernels have to be global kernels defined earlier.
+     * @param start_tok shows the token right after the pipeline keyword.
+     */
+    void parse_pipeline(const int start_tok, int& next_tok);
 
     /**
      * Reads the kernel header (gives the definition of the kernel).
-     * The kernel header should be in a single line.
      */ 
-    KernelNodePtr parse_kernel_header(const int start_line, const int start_pos, int& next_pos);
+    KernelNodePtr parse_kernel_header(const int start_tok, int& next_tok);
     
     /**
      * Reads the body of the kernel, each line (expression) will
      * be an ASTNode. The kernel body is among curly brackets.
      */
-    void parse_kernel_body(KernelNodePtr kernel, const int start_line, const int start_pos, int& next_line, int& next_pos);
+    void parse_kernel_body(KernelNodePtr kernel, const int start_tok, int& next_tok);
 
     /**
-     * Checks for missing paranthesis in an expression, line.
-     * Stops the process if error found.
+     * Reads statements until the closing } of the current block.
+     * The opening { is already consumed by the caller, the closing one
+     * is consumed here.
      */
-    void check_paranthesis_in_line(const int start_line);
-    
+    void parse_statements(std::vector<ASTNodePtr>& statements, const int start_tok, int& next_tok);
+
+    /**
+     * Reads the repeat N { ... } like code pieces.
+     * Aliases assigned inside the block become loop-carried variables.
+     * @param start_tok shows the token of the trip count.
+     */
+    RepeatNodePtr parse_repeat_node(const int start_tok, int& next_tok);
+
+    /**
+     * Collects the names assigned (name = ...;) inside a block, 
+     * including the nested blocks. Does not build any node.
+     * @param start_tok shows the token right after the opening {.
+     * @return the symbols of the names
+     */
+    std::vector<int> collect_assigned_names(const int start_tok);
+
     /**
      * Reads the type of a variable. Type definition can happen in
      * a kernel header. The name will remain empty.
      */
-    VariableNodePtr parse_variable_type(const int start_line, const int start_pos, int& next_pos);
+    VariableNodePtr parse_variable_type(const int start_tok, int& next_tok);
 
     /**
      * Reads a constant value in the code (a value given inside the code).
      * Only floats are supported.
      */
-    ConstantNodePtr parse_constant_scalar(
-        const std::string& value_as_string, 
-        const int start_line, 
-        const int start_pos);
+    ConstantNodePtr parse_constant_scalar(const int value_tok);
     
     /**
      * Reads the var t = arithm expr.; like code pieces.
      * The alias will be for the ASTNode built from the arithmetic expression.
-     * @param start_pos shows the position at the beginning of the alias name.
+     * @param start_tok shows the token of the alias name.
+     */
+    AliasNodePtr parse_alias_node(const int start_tok, int& next_tok);
+
+    /**
+     * Reads the var (s, c) = kernel_call(args); like code pieces.
+     * Each alias will refer to one of the return values of the call.
+     * @param start_tok shows the token of the ( character.
      */
-    AliasNodePtr parse_alias_node( 
-        const int start_line, 
-        const int start_pos, 
-        int& next_pos);
+    std::vector<AliasNodePtr> parse_tuple_alias_nodes(const int start_tok, int& next_tok);
 
     /**
      * Reads the return arithm expr.; like code pieces.
-     * @param start_pos shows the position at the beginning of the variable name.
+     * Several comma separated expressions are returned as a tuple.
+     * @param start_tok shows the token right after the return keyword.
      */
-    ReturnNodePtr parse_return_node( 
-        const int start_line, 
-        const int start_pos, 
-        int& next_pos);
+    ReturnNodePtr parse_return_node(const int start_tok, int& next_tok);
 
     /**
      * Reads the d = arithm expr.; like code pieces.
-     * @param start_pos shows the position at the beginning of the arithmetic ops.
+     * @param name_tok shows the token of the variable name.
+     * @param start_tok shows the token at the beginning of the arithmetic ops.
      */
-    AssignmentNodePtr parse_assignment_node(
-        const std::string& var_name, 
-        const int start_line, 
-        const int start_pos, 
-        int& next_pos);
+    AssignmentNodePtr parse_assignment_node(const int name_tok, const int start_tok, int& next_tok);
 
     /**
      * Reads a function call. The call is to a device function
      * defined in the same tgl file, somewhere earlier.
      * Builtin function calls are handled as arithmetic expressions.
-     * @param start_pos shows the position at the beginning of the args.
+     * @param name_tok shows the token of the kernel name.
+     * @param start_tok shows the token at the beginning of the args.
      */
-    ASTNodePtr parse_kernel_call_node(
-        const std::string& kernel_name, 
-        const int start_line, 
-        const int start_pos, 
-        int& next_pos);
+    ASTNodePtr parse_kernel_call_node(const int name_tok, const int start_tok, int& next_tok);
 
     /**
      * Can be a function call (newly defined are delegated), and regular
-     * mathematical expressions. (E.g.: a + (b * c) - abs(d) + ((a / b) + d + 2.0); )
-     * @param start_pos shows the position at the beginning of the expression.
+     * mathematical expressions. (E.g.: a + (b * c) - abs(d) + ((a / b) + d + -2.0); )
+     * The expression can span several lines, the closing ; or , is consumed.
+     * An empty expression gives nullptr (void return).
+     * @param start_tok shows the token at the beginning of the expression.
+     */
+    ASTNodePtr parse_arithmetic_node(const int start_tok, int& next_tok);
+
+    /**
+     * Precedence climbing: reads an operand, then the binary operators
+     * with at least min_precedence (and their right sides) in a single pass.
+     * Stops at the first token which is not such an operator.
+     */
+    ASTNodePtr parse_expression(const int min_precedence, const int start_tok, int& next_tok);
+
+    /**
+     * Reads a variable, constant, function call, a (sub-expression)
+     * or a unary minus with its operand.
+     */
+    ASTNodePtr parse_operand(const int start_tok, int& next_tok);
+
+    /**
+     * Stops with an error if the node is a call of a kernel with several return values.
+     * These calls can be used only in var (s, c) = kernel_call(args); like statements.
+     */
+    void check_single_value(const ASTNodePtr node, const int next_tok);
+
+    /**
+     * Infers the data type of the node.
+     * Stops with an error if the data types are inconsistent (e.g. c64 + f32x2).
+     */
+    DataType check_data_type(const ASTNodePtr node, const int next_tok);
+
+    /**
+     * Gives the delimiter character which closed the expression
+     * ending right before next_tok (e.g. ',' or ';').
      */
-    ASTNodePtr parse_arithmetic_node( 
-        const int start_line, 
-        const int start_pos, 
-        int& next_pos);
+    char get_closing_delimiter(const int next_tok) const;
 };
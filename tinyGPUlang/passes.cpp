@@ -0,0 +1,585 @@
+#include "passes.hpp"
+#include "transforms.hpp"
+
+static ASTNodePtr skip_aliases(ASTNodePtr node)
+{
+    while (auto alias_node = std::dynamic_pointer_cast<AliasNode>(node))
+    {
+        node = alias_node->src;
+    }
+    return node;
+}
+
+static ConstantNodePtr as_constant(const ASTNodePtr& node)
+{
+    auto const_node = std::dynamic_pointer_cast<ConstantNode>(skip_aliases(node));
+    if (const_node && const_node->dtype == DataType::FLOAT32)
+    {
+        return const_node;
+    }
+    return nullptr;
+}
+
+static bool is_constant_value(const ASTNodePtr& node, const float value)
+{
+    auto const_node = as_constant(node);
+    return const_node && const_node->val_f32 == value;
+}
+
+static bool calls_kernel_with_side_effects(const std::vector<ASTNodePtr>& roots)
+{
+    bool found = false;
+    for_each_reachable_node(roots, [&](const ASTNodePtr& node)
+    {
+        auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node);
+        if (call_node && has_side_effects(*call_node->kernel))
+        {
+            found = true;
+        }
+    });
+    return found;
+}
+
+// pass base
+
+ASTPass::ASTPass(const std::string& name) : name(name), num_changes(0)
+{
+}
+
+const std::string& ASTPass::get_name() const
+{
+    return name;
+}
+
+int ASTPass::get_num_changes() const
+{
+    return num_changes;
+}
+
+void ASTPass::run(KernelNode& kernel)
+{
+    for (auto& statement : kernel.body)
+    {
+        statement = rewrite(statement);
+    }
+}
+
+ASTNodePtr ASTPass::rewrite(const ASTNodePtr node)
+{
+    if (!node)
+        return nullptr;
+
+    if (replacements.contains(node->ast_id))
+        return replacements.at(node->ast_id);
+
+    if (visited_ids.contains(node->ast_id))
+        return node;
+
+    visited_ids.insert(node->ast_id);  // before the operands, loop-carried values can refer back
+
+    // operands first
+    if (auto binary_node = std::dynamic_pointer_cast<BinaryNode>(node))
+    {
+        binary_node->lhs = rewrite(binary_node->lhs);
+        binary_node->rhs = rewrite(binary_node->rhs);
+    }
+    else if (auto unary_node = std::dynamic_pointer_cast<UnaryNode>(node))
+    {
+        unary_node->x = rewrite(unary_node->x);
+    }
+    else if (auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node))
+    {
+        for (auto& arg : call_node->arguments)
+        {
+            arg = rewrite(arg);
+        }
+    }
+    else if (auto assign_node = std::dynamic_pointer_cast<AssignmentNode>(node))
+    {
+        assign_node->src = rewrite(assign_node->src);
+    }
+    else if (auto alias_node = std::dynamic_pointer_cast<AliasNode>(node))
+    {
+        alias_node->src = rewrite(alias_node->src);
+    }
+    else if (auto ret_node = std::dynamic_pointer_cast<ReturnNode>(node))
+    {
+        for (auto& ret : ret_node->return_values)
+        {
+            ret = rewrite(ret);
+        }
+    }
+    else if (auto tuple_elem_node = std::dynamic_pointer_cast<TupleElementNode>(node))
+    {
+        tuple_elem_node->tuple = rewrite(tuple_elem_node->tuple);
+    }
+    else if (auto loop_var_node = std::dynamic_pointer_cast<LoopVarNode>(node))
+    {
+        loop_var_node->init = rewrite(loop_var_node->init);
+        loop_var_node->next = rewrite(loop_var_node->next);
+    }
+    else if (auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(node))
+    {
+        for (auto& loop_var : repeat_node->loop_vars)
+        {
+            rewrite(loop_var);
+        }
+
+        for (auto& statement : repeat_node->body)
+        {
+            statement = rewrite(statement);
+        }
+    }
+
+    visited_node = node;
+    replacement = nullptr;
+    node->accept(*this);
+
+    if (replacement)
+    {
+        replacements.insert({node->ast_id, replacement});
+        num_changes++;
+        return replacement;
+    }
+    return node;
+}
+
+// constant folding
+
+ConstantFoldingPass::ConstantFoldingPass() : ASTPass("constant-folding")
+{
+}
+
+void ConstantFoldingPass::apply(AddNode& node)
+{
+    auto lhs = as_constant(node.lhs);
+    auto rhs = as_constant(node.rhs);
+    if (lhs && rhs)
+        replacement = create_constant_node(lhs->val_f32 + rhs->val_f32, DataType::FLOAT32);
+}
+
+void ConstantFoldingPass::apply(SubNode& node)
+{
+    auto lhs = as_constant(node.lhs);
+    auto rhs = as_constant(node.rhs);
+    if (lhs && rhs)
+        replacement = create_constant_node(lhs->val_f32 - rhs->val_f32, DataType::FLOAT32);
+}
+
+void ConstantFoldingPass::apply(MulNode& node)
+{
+    auto lhs = as_constant(node.lhs);
+    auto rhs = as_constant(node.rhs);
+    if (lhs && rhs)
+        replacement = create_constant_node(lhs->val_f32 * rhs->val_f32, DataType::FLOAT32);
+}
+
+void ConstantFoldingPass::apply(DivNode& node)
+{
+    auto lhs = as_constant(node.lhs);
+    auto rhs = as_constant(node.rhs);
+    if (lhs && rhs)
+        replacement = create_constant_node(lhs->val_f32 / rhs->val_f32, DataType::FLOAT32);
+}
+
+void ConstantFoldingPass::apply(AbsNode& node)
+{
+    if (auto x = as_constant(node.x))
+        replacement = create_constant_node(std::abs(x->val_f32), DataType::FLOAT32);
+}
+
+void ConstantFoldingPass::apply(SqrtNode& node)
+{
+    if (auto x = as_constant(node.x))
+        replacement = create_constant_node(std::sqrt(x->val_f32), DataType::FLOAT32);
+}
+
+void ConstantFoldingPass::apply(Log2Node& node)
+{
+    if (auto x = as_constant(node.x))
+        replacement = create_constant_node(std::log2(x->val_f32), DataType::FLOAT32);
+}
+
+void ConstantFoldingPass::apply(Exp2Node& node)
+{
+    if (auto x = as_constant(node.x))
+        replacement = create_constant_node(std::exp2(x->val_f32), DataType::FLOAT32);
+}
+
+// algebraic simplification
+
+AlgebraicSimplificationPass::AlgebraicSimplificationPass() : ASTPass("algebraic-simplification")
+{
+}
+
+void AlgebraicSimplificationPass::run(KernelNode& kernel)
+{
+    squares.clear();
+
+    assigned_ids.clear();
+    for_each_reachable_node(kernel.body, [&](const ASTNodePtr& node)
+    {
+        if (auto assign_node = std::dynamic_pointer_cast<AssignmentNode>(node))
+        {
+            assigned_ids.insert(assign_node->trg->ast_id);
+        }
+    });
+
+    ASTPass::run(kernel);
+}
+
+bool AlgebraicSimplificationPass::can_forward(const ASTNodePtr& node) const
+{
+    // tensors are loaded at the use, an aliased value can be older than an assignment
+    return !(std::dynamic_pointer_cast<TensorNode>(node) && assigned_ids.contains(node->ast_id));
+}
+
+void AlgebraicSimplificationPass::apply(AddNode& node)
+{
+    if (is_constant_value(node.rhs, 0.0f))
+    {
+        replacement = node.lhs;
+    }
+    else if (is_constant_value(node.lhs, 0.0f))
+    {
+        replacement = node.rhs;
+    }
+    else if (node.lhs == node.rhs)  // x + x
+    {
+        replacement = create_mul_node(node.lhs, create_constant_node(2.0f, DataType::FLOAT32));
+    }
+}
+
+void AlgebraicSimplificationPass::apply(SubNode& node)
+{
+    if (is_constant_value(node.rhs, 0.0f))
+    {
+        replacement = node.lhs;
+    }
+}
+
+void AlgebraicSimplificationPass::apply(MulNode& node)
+{
+    if (is_constant_value(node.rhs, 1.0f))
+    {
+        replacement = node.lhs;
+    }
+    else if (is_constant_value(node.lhs, 1.0f))
+    {
+        replacement = node.rhs;
+    }
+    else if (node.lhs == node.rhs && can_forward(node.lhs))  // x * x, the first square is reused
+    {
+        if (squares.contains(node.lhs->ast_id))
+        {
+            replacement = squares.at(node.lhs->ast_id);
+        }
+        else
+        {
+            squares.insert({node.lhs->ast_id, visited_node});
+        }
+    }
+}
+
+void AlgebraicSimplificationPass::apply(DivNode& node)
+{
+    auto rhs = as_constant(node.rhs);
+    if (!rhs || rhs->val_f32 == 0.0f)
+        return;
+
+    if (rhs->val_f32 == 1.0f)
+    {
+        replacement = node.lhs;
+        return;
+    }
+
+    // multiplication is cheaper than division, the same result only if 1/c is exact (c is a power of two)
+    int exponent = 0;
+    float reciprocal = 1.0f / rhs->val_f32;
+    if (std::abs(std::frexp(rhs->val_f32, &exponent)) == 0.5f && std::isnormal(reciprocal))
+    {
+        replacement = create_mul_node(node.lhs, create_constant_node(reciprocal, DataType::FLOAT32));
+    }
+}
+
+void AlgebraicSimplificationPass::apply(AbsNode& node)
+{
+    if (std::dynamic_pointer_cast<AbsNode>(skip_aliases(node.x)))
+    {
+        replacement = node.x;
+    }
+}
+
+void AlgebraicSimplificationPass::apply(Log2Node& node)
+{
+    auto exp2_node = std::dynamic_pointer_cast<Exp2Node>(skip_aliases(node.x));
+    if (exp2_node && can_forward(exp2_node->x))
+    {
+        replacement = exp2_node->x;
+    }
+}
+
+void AlgebraicSimplificationPass::apply(Exp2Node& node)
+{
+    auto log2_node = std::dynamic_pointer_cast<Log2Node>(skip_aliases(node.x));
+    if (log2_node && can_forward(log2_node->x))
+    {
+        replacement = log2_node->x;  // assumes x > 0 (as fast math)
+    }
+}
+
+// common subexpression elimination
+
+CommonSubexpressionPass::CommonSubexpressionPass() : ASTPass("common-subexpression")
+{
+}
+
+void CommonSubexpressionPass::run(KernelNode& kernel)
+{
+    expressions.clear();
+    tensor_versions.clear();
+
+    // assignments in a repeat block change the value in each iteration,
+    // kernels with side effects can assign their tensor arguments
+    volatile_ids.clear();
+    for_each_reachable_node(kernel.body, [&](const ASTNodePtr& node)
+    {
+        if (auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(node))
+        {
+            for_each_reachable_node(repeat_node->body, [&](const ASTNodePtr& body_node)
+            {
+                if (auto assign_node = std::dynamic_pointer_cast<AssignmentNode>(body_node))
+                    volatile_ids.insert(assign_node->trg->ast_id);
+            });
+        }
+        else if (auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node))
+        {
+            if (has_side_effects(*call_node->kernel))
+            {
+                for (auto& arg : call_node->arguments)
+                    volatile_ids.insert(arg->ast_id);
+            }
+        }
+    });
+
+    ASTPass::run(kernel);
+}
+
+std::string CommonSubexpressionPass::make_key(const std::string& kind, const std::vector<ASTNodePtr>& operands, const bool commutative)
+{
+    std::vector<std::string> operand_keys;
+    for (auto& operand : operands)
+    {
+        auto value_node = skip_aliases(operand);
+        if (volatile_ids.contains(value_node->ast_id) || volatile_ids.contains(operand->ast_id))
+        {
+            volatile_ids.insert(visited_node->ast_id);
+            return "";
+        }
+
+        if (std::dynamic_pointer_cast<TensorNode>(value_node))
+        {
+            if (value_node != operand)  // an alias holds the tensor value at its definition
+            {
+                operand_keys.push_back(std::to_string(operand->ast_id));
+            }
+            else
+            {
+                int version = tensor_versions.contains(value_node->ast_id) ? tensor_versions.at(value_node->ast_id) : 0;
+                operand_keys.push_back(std::to_string(value_node->ast_id) + "v" + std::to_string(version));
+            }
+        }
+        else
+        {
+            operand_keys.push_back(std::to_string(value_node->ast_id));
+        }
+    }
+
+    if (commutative)
+    {
+        std::sort(operand_keys.begin(), operand_keys.end());
+    }
+
+    std::string key = kind;
+    for (auto& operand_key : operand_keys)
+    {
+        key += ":" + operand_key;
+    }
+    return key;
+}
+
+void CommonSubexpressionPass::hash_cons(const std::string& key)
+{
+    if (key.empty())
+        return;
+
+    if (expressions.contains(key))
+    {
+        replacement = expressions.at(key);
+    }
+    else
+    {
+        expressions.insert({key, visited_node});
+    }
+}
+
+void CommonSubexpressionPass::apply(KernelCallNode& node)
+{
+    // void calls and calls with side effects are kept
+    if (node.kernel->return_values.empty() || has_side_effects(*node.kernel))
+        return;
+
+    hash_cons(make_key("call" + std::to_string(node.kernel->ast_id), node.arguments));
+}
+
+void CommonSubexpressionPass::apply(ConstantNode& node)
+{
+    std::stringstream ss;
+    ss << "const:" << node.dtype << ":" << std::hexfloat << node.val_f32;
+    hash_cons(ss.str());
+}
+
+void CommonSubexpressionPass::apply(AddNode& node)
+{
+    hash_cons(make_key("add", {node.lhs, node.rhs}, true));
+}
+
+void CommonSubexpressionPass::apply(SubNode& node)
+{
+    hash_cons(make_key("sub", {node.lhs, node.rhs}));
+}
+
+void CommonSubexpressionPass::apply(MulNode& node)
+{
+    hash_cons(make_key("mul", {node.lhs, node.rhs}, true));
+}
+
+void CommonSubexpressionPass::apply(DivNode& node)
+{
+    hash_cons(make_key("div", {node.lhs, node.rhs}));
+}
+
+void CommonSubexpressionPass::apply(AbsNode& node)
+{
+    hash_cons(make_key("abs", {node.x}));
+}
+
+void CommonSubexpressionPass::apply(SqrtNode& node)
+{
+    hash_cons(make_key("sqrt", {node.x}));
+}
+
+void CommonSubexpressionPass::apply(Log2Node& node)
+{
+    hash_cons(make_key("log2", {node.x}));
+}
+
+void CommonSubexpressionPass::apply(Exp2Node& node)
+{
+    hash_cons(make_key("exp2", {node.x}));
+}
+
+void CommonSubexpressionPass::apply(AssignmentNode& node)
+{
+    // visited after the source, later reads get the new version
+    tensor_versions[node.trg->ast_id]++;
+}
+
+void CommonSubexpressionPass::apply(TupleElementNode& node)
+{
+    hash_cons(make_key("elem" + std::to_string(node.index), {node.tuple}));
+}
+
+// dead alias elimination
+
+DeadAliasEliminationPass::DeadAliasEliminationPass() : ASTPass("dead-alias-elimination")
+{
+}
+
+void DeadAliasEliminationPass::run(KernelNode& kernel)
+{
+    // statements with effects, aliases are used only if reachable from them
+    std::vector<ASTNodePtr> roots;
+    std::function<void(const std::vector<ASTNodePtr>&)> collect_roots = [&](const std::vector<ASTNodePtr>& statements)
+    {
+        for (auto& statement : statements)
+        {
+            if (auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(statement))
+            {
+                roots.insert(roots.end(), repeat_node->loop_vars.begin(), repeat_node->loop_vars.end());
+                collect_roots(repeat_node->body);
+            }
+            else if (!std::dynamic_pointer_cast<AliasNode>(statement) || calls_kernel_with_side_effects({statement}))
+            {
+                roots.push_back(statement);
+            }
+        }
+    };
+    collect_roots(kernel.body);
+
+    std::unordered_set<int> used_ids;
+    for_each_reachable_node(roots, [&](const ASTNodePtr& node) { used_ids.insert(node->ast_id); });
+
+    remove_dead_aliases(kernel.body, used_ids);
+}
+
+void DeadAliasEliminationPass::remove_dead_aliases(std::vector<ASTNodePtr>& statements, const std::unordered_set<int>& used_ids)
+{
+    num_changes += std::erase_if(statements, [&](const ASTNodePtr& statement)
+    {
+        return std::dynamic_pointer_cast<AliasNode>(statement) && !used_ids.contains(statement->ast_id);
+    });
+
+    for (auto& statement : statements)
+    {
+        if (auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(statement))
+        {
+            remove_dead_aliases(repeat_node->body, used_ids);
+        }
+    }
+}
+
+// pass manager
+
+ASTPassManager::ASTPassManager()
+{
+}
+
+void ASTPassManager::add_pass(const ASTPassPtr pass)
+{
+    passes.push_back(pass);
+}
+
+void ASTPassManager::run(const std::vector<KernelNodePtr>& kernels)
+{
+    for (auto& pass : passes)
+    {
+        for (auto& kernel : kernels)
+        {
+            pass->run(*kernel);
+        }
+    }
+}
+
+std::string ASTPassManager::get_statistics() const
+{
+    std::stringstream ss;
+    ss << "AST pass statistics \n";
+    for (auto& pass : passes)
+    {
+        ss << "    " << pass->get_name();
+        ss << std::string(std::max(1, 28 - static_cast<int>(pass->get_name().size())), ' ');
+        ss << ": " << pass->get_num_changes() << " rewrites \n";
+    }
+    return ss.str();
+}
+
+ASTPassManager ASTPassManager::create_default_pipeline()
+{
+    ASTPassManager pass_manager;
+    pass_manager.add_pass(std::make_shared<ConstantFoldingPass>());
+    pass_manager.add_pass(std::make_shared<AlgebraicSimplificationPass>());
+    pass_manager.add_pass(std::make_shared<CommonSubexpressionPass>());
+    pass_manager.add_pass(std::make_shared<DeadAliasEliminationPass>());
+    return pass_manager;
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "ast.hpp"
+#include "core.hpp"
+
+/**
+ * Base of the AST optimization passes.
+ * The nodes of a kernel are visited bottom-up (operands first),
+ * apply() can give a replacement for the visited node, then
+ * the users of the node refer to the replacement.
+ */
+class ASTPass : public ASTVisitor
+{
+public:
+    explicit ASTPass(const std::string& name);
+
+    const std::string& get_name() const;
+
+    /**
+     * Number of rewrites done by the pass so far.
+     */
+    int get_num_changes() const;
+
+    virtual void run(KernelNode& kernel);
+
+    // by default the nodes are kept
+    virtual void apply(KernelNode& node) {}
+    virtual void apply(KernelCallNode& node) {}
+
+    virtual void apply(ConstantNode& node) {}
+    virtual void apply(ScalarNode& node) {}
+    virtual void apply(TensorNode& node) {}
+
+    virtual void apply(AddNode& node) {}
+    virtual void apply(SubNode& node) {}
+    virtual void apply(MulNode& node) {}
+    virtual void apply(DivNode& node) {}
+
+    virtual void apply(AbsNode& node) {}
+    virtual void apply(SqrtNode& node) {}
+    virtual void apply(Log2Node& node) {}
+    virtual void apply(Exp2Node& node) {}
+
+    virtual void apply(AssignmentNode& node) {}
+    virtual void apply(AliasNode& node) {}
+    virtual void apply(ReturnNode& node) {}
+    virtual void apply(TupleElementNode& node) {}
+
+    virtual void apply(LoopVarNode& node) {}
+    virtual void apply(RepeatNode& node) {}
+
+protected:
+    std::string name;
+    int num_changes;
+
+    ASTNodePtr visited_node;  // the node being visited
+    ASTNodePtr replacement;   // set by apply() if the visited node is replaced
+
+    /**
+     * Rewrites the operands of the node, then the node itself.
+     * @return the node or its replacement
+     */
+    ASTNodePtr rewrite(const ASTNodePtr node);
+
+private:
+    std::unordered_map<int, ASTNodePtr> replacements;
+    std::unordered_set<int> visited_ids;
+};
+
+using ASTPassPtr = std::shared_ptr<ASTPass>;
+
+
+/**
+ * Evaluates the operations with constant operands, e.g. 2.0 * 0.5 becomes 1.0.
+ */
+class ConstantFoldingPass : public ASTPass
+{
+public:
+    explicit ConstantFoldingPass();
+
+    virtual void apply(AddNode& node) override;
+    virtual void apply(SubNode& node) override;
+    virtual void apply(MulNode& node) override;
+    virtual void apply(DivNode& node) override;
+
+    virtual void apply(AbsNode& node) override;
+    virtual void apply(SqrtNode& node) override;
+    virtual void apply(Log2Node& node) override;
+    virtual void apply(Exp2Node& node) override;
+};
+
+
+/**
+ * Identity and strength-reduction rewrites:
+ * x + 0, x - 0, x * 1, x / 1 become x, x / c becomes x * (1/c) for a power of two c,
+ * (constants and patterns are also matched through aliases)
+ * x + x becomes x * 2, exp2(log2(x)) and log2(exp2(x)) become x,
+ * abs(abs(x)) becomes abs(x), repeated x * x squares are reused
+ * (not the squares of the tensors written by the kernel).
+ */
+class AlgebraicSimplificationPass : public ASTPass
+{
+public:
+    explicit AlgebraicSimplificationPass();
+
+    virtual void run(KernelNode& kernel) override;
+
+    virtual void apply(AddNode& node) override;
+    virtual void apply(SubNode& node) override;
+    virtual void apply(MulNode& node) override;
+    virtual void apply(DivNode& node) override;
+
+    virtual void apply(AbsNode& node) override;
+    virtual void apply(Log2Node& node) override;
+    virtual void apply(Exp2Node& node) override;
+
+private:
+    std::unordered_map<int, ASTNodePtr> squares;  // x id -> x * x
+    std::unordered_set<int> assigned_ids;
+
+    bool can_forward(const ASTNodePtr& node) const;
+};
+
+
+/**
+ * Common subexpression elimination by hash-consing: structurally equal
+ * expressions (and calls of device kernels without side effects with
+ * the same arguments) are replaced by the first one, so they are computed once.
+ * Tensor reads are versioned by the preceding assignments. Reads of tensors assigned
+ * in repeat blocks or passed to kernels with side effects are never merged.
+ */
+class CommonSubexpressionPass : public ASTPass
+{
+public:
+    explicit CommonSubexpressionPass();
+
+    virtual void run(KernelNode& kernel) override;
+
+    virtual void apply(KernelCallNode& node) override;
+    virtual void apply(ConstantNode& node) override;
+
+    virtual void apply(AddNode& node) override;
+    virtual void apply(SubNode& node) override;
+    virtual void apply(MulNode& node) override;
+    virtual void apply(DivNode& node) override;
+
+    virtual void apply(AbsNode& node) override;
+    virtual void apply(SqrtNode& node) override;
+    virtual void apply(Log2Node& node) override;
+    virtual void apply(Exp2Node& node) override;
+
+    virtual void apply(AssignmentNode& node) override;
+    virtual void apply(TupleElementNode& node) override;
+
+private:
+    std::unordered_map<std::string, ASTNodePtr> expressions;  // structural key -> first node
+    std::unordered_map<int, int> tensor_versions;  // number of assignments so far
+    std::unordered_set<int> volatile_ids;  // values that can change in a way not tracked by the versions
+
+    /**
+     * Key from the node kind and the operands (aliases are looked through).
+     * Empty if the node depends on a volatile value.
+     */
+    std::string make_key(const std::string& kind, const std::vector<ASTNodePtr>& operands, const bool commutative = false);
+    void hash_cons(const std::string& key);
+};
+
+
+/**
+ * Removes the aliases whose value is not used.
+ * Aliases calling kernels with side effects (tensor assignments) are kept.
+ */
+class DeadAliasEliminationPass : public ASTPass
+{
+public:
+    explicit DeadAliasEliminationPass();
+
+    virtual void run(KernelNode& kernel) override;
+
+private:
+    void remove_dead_aliases(std::vector<ASTNodePtr>& statements, const std::unordered_set<int>& used_ids);
+};
+
+
+/**
+ * Runs a sequence of passes on the kernels,
+ * between parsing and code generation.
+ */
+class ASTPassManager
+{
+public:
+    explicit ASTPassManager();
+
+    void add_pass(const ASTPassPtr pass);
+
+    void run(const std::vector<KernelNodePtr>& kernels);
+
+    /**
+     * Number of rewrites per pass, one line per pass.
+     */
+    std::string get_statistics() const;
+
+    /**
+     * Constant folding, algebraic simplification, common subexpression
+     * elimination, dead alias elimination.
+     */
+    static ASTPassManager create_default_pipeline();
+
+private:
+    std::vector<ASTPassPtr> passes;
+};
@@ -0,0 +1,202 @@
+#include "specialize.hpp"
+#include "transforms.hpp"
+#include "passes.hpp"
+#include "codegen.hpp"
+
+// launches are single blocks, at most this many threads
+static constexpr int max_threads_per_block = 1024;
+
+std::string SpecializationKey::to_string() const
+{
+    std::stringstream ss;
+    ss << kernel_name << "(";
+    bool first = true;
+    for (auto& [name, value] : scalar_values)
+    {
+        ss << (first ? "" : ", ") << name << "=" << std::setprecision(9) << value;
+        first = false;
+    }
+    if (num_elements > 0)
+    {
+        ss << (first ? "" : ", ") << "n=" << num_elements;
+    }
+    ss << ")";
+    return ss.str();
+}
+
+/**
+ * The smallest coarsening which fits the elements into a single block
+ * without a partial tail, 0 if there is none.
+ */
+static int select_elems_per_thread(const int num_elements)
+{
+    for (int elems = 1; elems <= 8; elems *= 2)
+    {
+        if (num_elements % elems == 0 && num_elements / elems <= max_threads_per_block)
+            return elems;
+    }
+    return 0;
+}
+
+/**
+ * The device kernels called by the kernel (also indirectly), callees first.
+ */
+static void collect_called_kernels(
+    const KernelNode& kernel,
+    std::unordered_set<int>& visited_ids,
+    std::vector<KernelNodePtr>& called_kernels)
+{
+    for_each_reachable_node(kernel.body, [&](const ASTNodePtr& node)
+    {
+        auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node);
+        if (!call_node || visited_ids.contains(call_node->kernel->ast_id))
+            return;
+
+        visited_ids.insert(call_node->kernel->ast_id);
+        collect_called_kernels(*call_node->kernel, visited_ids, called_kernels);
+        called_kernels.push_back(call_node->kernel);
+    });
+}
+
+
+KernelSpecializer::KernelSpecializer(
+    const std::vector<KernelNodePtr>& kernels,
+    const std::string& generic_ptx_path,
+    const std::string& cache_folder,
+    const std::string& sm_xx
+    ) : kernels(kernels), generic_ptx_path(generic_ptx_path),
+        cache_folder(cache_folder), sm_xx(sm_xx)
+{
+}
+
+KernelNodePtr KernelSpecializer::find_global_kernel(const std::string& kernel_name) const
+{
+    auto kernel = std::find_if(kernels.begin(), kernels.end(),
+        [&](const KernelNodePtr& k) { return k->name == kernel_name && k->scope == KernelScope::GLOBAL; });
+
+    if (kernel == kernels.end())
+    {
+        std::stringstream ss;
+        ss << "Only global kernels can be specialized, " << kernel_name << " is not one of them.";
+        emit_error(ss.str());
+    }
+    return *kernel;
+}
+
+std::string KernelSpecializer::get_cache_path(const SpecializationKey& key) const
+{
+    // a changed kernel (or target) gets a new file
+    ASTPrinter printer;
+    auto kernel = find_global_kernel(key.kernel_name);
+    std::unordered_set<int> visited_ids;
+    std::vector<KernelNodePtr> called_kernels;
+    collect_called_kernels(*kernel, visited_ids, called_kernels);
+    called_kernels.push_back(kernel);
+    for (auto& called_kernel : called_kernels)
+    {
+        called_kernel->accept(printer);
+    }
+
+    uint64_t hash = hash_string(key.to_string() + sm_xx + printer.get_ast_string());
+
+    std::stringstream ss;
+    ss << key.kernel_name << "_" << hash_to_hex(hash) << ".ptx";
+    return (std::filesystem::path(cache_folder) / ss.str()).string();
+}
+
+KernelNodePtr KernelSpecializer::build_specialized_kernel(const KernelNode& kernel, const SpecializationKey& key) const
+{
+    ASTCloner cloner;
+    for (auto& [name, value] : key.scalar_values)
+    {
+        auto arg = std::find_if(kernel.arguments.begin(), kernel.arguments.end(),
+            [&](const VariableNodePtr& a) { return a->name == name && a->vtype == VariableType::SCALAR; });
+
+        if (arg == kernel.arguments.end())
+        {
+            std::stringstream ss;
+            ss << "Kernel " << kernel.name << " has no scalar argument " << name << " to specialize.";
+            emit_error(ss.str());
+        }
+        cloner.replace((*arg)->ast_id, create_constant_node(value, (*arg)->dtype));
+    }
+
+    // same name and arguments, the specialized scalars are not read
+    auto specialized_kernel = create_kernel_node(kernel.name, KernelScope::GLOBAL, kernel.arguments, {});
+    for (auto& statement : kernel.body)
+    {
+        specialized_kernel->body.push_back(cloner.clone(statement));
+    }
+
+    auto pass_manager = ASTPassManager::create_default_pipeline();
+    pass_manager.run({specialized_kernel});
+
+    return specialized_kernel;
+}
+
+SpecializedKernel KernelSpecializer::describe(const SpecializationKey& key) const
+{
+    SpecializedKernel result;
+    result.ptx_file_path = get_cache_path(key);
+    result.is_specialized = true;
+
+    int elems_per_thread = key.num_elements > 0 ? select_elems_per_thread(key.num_elements) : 0;
+    if (elems_per_thread > 0)
+    {
+        result.elems_per_thread = elems_per_thread;
+        result.num_threads = key.num_elements / elems_per_thread;
+    }
+    return result;
+}
+
+SpecializedKernel KernelSpecializer::specialize(const SpecializationKey& key)
+{
+    auto kernel = find_global_kernel(key.kernel_name);
+
+    std::string key_str = key.to_string();
+    cache_hit = cache.contains(key_str);
+    if (cache_hit)
+        return cache.at(key_str);
+
+    auto result = describe(key);
+
+    // compiled by an earlier run
+    cache_hit = std::filesystem::exists(result.ptx_file_path);
+    if (!cache_hit)
+    {
+        std::unordered_set<int> visited_ids;
+        std::vector<KernelNodePtr> called_kernels;
+        collect_called_kernels(*kernel, visited_ids, called_kernels);
+
+        PTXGenerator ptx_generator;
+        for (auto& called_kernel : called_kernels)
+        {
+            ptx_generator.build_ir_from_kernel(called_kernel);
+        }
+        ptx_generator.build_ir_from_kernel(build_specialized_kernel(*kernel, key), result.elems_per_thread);
+        ptx_generator.generate_ptx(result.ptx_file_path, sm_xx, false);
+    }
+
+    cache.insert({key_str, result});
+    return result;
+}
+
+SpecializedKernel KernelSpecializer::lookup(const SpecializationKey& key) const
+{
+    std::string key_str = key.to_string();
+    if (cache.contains(key_str))
+        return cache.at(key_str);
+
+    auto result = describe(key);
+    if (std::filesystem::exists(result.ptx_file_path))
+        return result;
+
+    SpecializedKernel generic;
+    generic.ptx_file_path = generic_ptx_path;
+    return generic;
+}
+
+bool KernelSpecializer::was_cache_hit() const
+{
+    return cache_hit;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "ast.hpp"
+#include "core.hpp"
+
+/**
+ * A specialization of a global kernel: the values of some
+ * of its scalar arguments and the number of elements (0 if not known).
+ */
+struct SpecializationKey
+{
+    std::string kernel_name;
+    std::map<std::string, float> scalar_values;  // ordered, equal keys have equal strings
+    int num_elements = 0;
+
+    /**
+     * E.g. sgd(lr=0.00999999978, n=4096), floats are printed exactly.
+     */
+    std::string to_string() const;
+};
+
+/**
+ * The ptx to load for a launch, with the launch size
+ * of the specialized kernel (0 threads: the generic kernel, any size).
+ */
+struct SpecializedKernel
+{
+    std::string ptx_file_path;
+    bool is_specialized = false;
+    int num_threads = 0;
+    int elems_per_thread = 1;
+};
+
+/**
+ * Compiles global kernels with concrete values baked in: the specialized scalars
+ * become constants (folded by the AST passes), a known element count selects
+ * the thread coarsening with no partial tail. The kernel keeps its name and arguments,
+ * so a launch of the generic kernel works with the specialized ptx too.
+ * The ptx files are cached in a folder, named by the hash of the specialization.
+ */
+class KernelSpecializer
+{
+public:
+    /**
+     * @param kernels the parsed kernels (after the AST passes)
+     * @param generic_ptx_path the ptx of the generic kernels, the fallback of lookup
+     * @param cache_folder folder of the specialized ptx files
+     */
+    explicit KernelSpecializer(
+        const std::vector<KernelNodePtr>& kernels,
+        const std::string& generic_ptx_path,
+        const std::string& cache_folder,
+        const std::string& sm_xx);
+
+    /**
+     * The specialized ptx, compiled unless it is already in the cache.
+     */
+    SpecializedKernel specialize(const SpecializationKey& key);
+
+    /**
+     * The cached specialization (also from an earlier run), or the generic kernel if there is none.
+     */
+    SpecializedKernel lookup(const SpecializationKey& key) const;
+
+    /**
+     * Whether the last specialize() call found the ptx in the cache.
+     */
+    bool was_cache_hit() const;
+
+private:
+    std::vector<KernelNodePtr> kernels;
+    std::string generic_ptx_path;
+    std::string cache_folder;
+    std::string sm_xx;
+
+    std::unordered_map<std::string, SpecializedKernel> cache;  // key string -> ptx
+    bool cache_hit = false;
+
+    KernelNodePtr find_global_kernel(const std::string& kernel_name) const;
+
+    std::string get_cache_path(const SpecializationKey& key) const;
+
+    /**
+     * The ptx path and the launch size of the specialization.
+     */
+    SpecializedKernel describe(const SpecializationKey& key) const;
+
+    /**
+     * The copy of the kernel with the scalars replaced by constants.
+     */
+    KernelNodePtr build_specialized_kernel(const KernelNode& kernel, const SpecializationKey& key) const;
+};
@@ -0,0 +1,752 @@
+#include "transforms.hpp"
+
+std::vector<ASTNodePtr> get_operands(const ASTNodePtr& node)
+{
+    if (auto binary_node = std::dynamic_pointer_cast<BinaryNode>(node))
+    {
+        return {binary_node->lhs, binary_node->rhs};
+    }
+
+    if (auto unary_node = std::dynamic_pointer_cast<UnaryNode>(node))
+    {
+        return {unary_node->x};
+    }
+
+    if (auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node))
+    {
+        return call_node->arguments;
+    }
+
+    if (auto assign_node = std::dynamic_pointer_cast<AssignmentNode>(node))
+    {
+        return {assign_node->src};  // the target is not read
+    }
+
+    if (auto alias_node = std::dynamic_pointer_cast<AliasNode>(node))
+    {
+        return {alias_node->src};
+    }
+
+    if (auto ret_node = std::dynamic_pointer_cast<ReturnNode>(node))
+    {
+        return ret_node->return_values;
+    }
+
+    if (auto tuple_elem_node = std::dynamic_pointer_cast<TupleElementNode>(node))
+    {
+        return {tuple_elem_node->tuple};
+    }
+
+    if (auto loop_var_node = std::dynamic_pointer_cast<LoopVarNode>(node))
+    {
+        return {loop_var_node->init};  // next is a back edge
+    }
+
+    return {};
+}
+
+
+void for_each_reachable_node(
+    const std::vector<ASTNodePtr>& roots,
+    const std::function<void(const ASTNodePtr&)>& func)
+{
+    std::unordered_set<int> visited_ids;
+    std::vector<ASTNodePtr> work_list(roots.rbegin(), roots.rend());
+
+    while (!work_list.empty())
+    {
+        auto node = work_list.back();
+        work_list.pop_back();
+
+        if (!node || visited_ids.contains(node->ast_id))
+            continue;
+
+        visited_ids.insert(node->ast_id);
+        func(node);
+
+        if (auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(node))
+        {
+            work_list.insert(work_list.end(), repeat_node->body.rbegin(), repeat_node->body.rend());
+            for (auto& loop_var : repeat_node->loop_vars)
+            {
+                work_list.push_back(loop_var);
+            }
+        }
+        else if (auto loop_var_node = std::dynamic_pointer_cast<LoopVarNode>(node))
+        {
+            work_list.push_back(loop_var_node->next);
+        }
+
+        auto operands = get_operands(node);
+        work_list.insert(work_list.end(), operands.rbegin(), operands.rend());
+    }
+}
+
+
+bool has_side_effects(const KernelNode& kernel)
+{
+    if (kernel.side_effects.has_value())
+        return *kernel.side_effects;
+
+    bool found = false;
+    for_each_reachable_node(kernel.body, [&](const ASTNodePtr& node)
+    {
+        auto call_node = std::dynamic_pointer_cast<KernelCallNode>(node);
+        if (std::dynamic_pointer_cast<AssignmentNode>(node) || (call_node && has_side_effects(*call_node->kernel)))
+        {
+            found = true;
+        }
+    });
+    kernel.side_effects = found;
+    return found;
+}
+
+
+UniformityAnalysis::UniformityAnalysis()
+{
+}
+
+bool UniformityAnalysis::is_uniform(const ASTNodePtr node)
+{
+    if (!uniform.contains(node->ast_id))
+    {
+        node->accept(*this);
+    }
+    return uniform.at(node->ast_id);
+}
+
+std::vector<ASTNodePtr> UniformityAnalysis::find_hoistable_nodes(const KernelNode& kernel)
+{
+    std::vector<ASTNodePtr> hoistable_nodes;
+    std::unordered_set<int> hoisted_ids;
+
+    auto add_if_hoistable = [&](ASTNodePtr operand)
+    {
+        while (auto alias_node = std::dynamic_pointer_cast<AliasNode>(operand))  // the aliased value is hoisted
+        {
+            operand = alias_node->src;
+        }
+
+        bool is_leaf = std::dynamic_pointer_cast<ConstantNode>(operand) || std::dynamic_pointer_cast<VariableNode>(operand);
+        if (!operand || is_leaf || hoisted_ids.contains(operand->ast_id) || !is_uniform(operand))
+            return;
+
+        hoisted_ids.insert(operand->ast_id);
+        hoistable_nodes.push_back(operand);
+    };
+
+    for_each_reachable_node(kernel.body, [&](const ASTNodePtr& node)
+    {
+        // users: per-element values and statements
+        if (is_uniform(node) && !std::dynamic_pointer_cast<AliasNode>(node))
+            return;
+
+        if (std::dynamic_pointer_cast<AliasNode>(node))
+        {
+            add_if_hoistable(node);
+        }
+
+        for (auto& operand : get_operands(node))
+        {
+            add_if_hoistable(operand);
+        }
+
+        if (auto loop_var_node = std::dynamic_pointer_cast<LoopVarNode>(node))
+        {
+            add_if_hoistable(loop_var_node->next);
+        }
+    });
+
+    return hoistable_nodes;
+}
+
+void UniformityAnalysis::apply(KernelNode& node)
+{
+    uniform.insert({node.ast_id, false});
+}
+
+void UniformityAnalysis::apply(KernelCallNode& node)
+{
+    // kernels with tensor arguments read per-element data
+    bool is_pure = !node.kernel->return_values.empty() && !has_side_effects(*node.kernel);
+    bool reads_tensors = std::any_of(node.kernel->arguments.begin(), node.kernel->arguments.end(),
+        [](const VariableNodePtr& arg) { return arg->vtype == VariableType::TENSOR; });
+
+    bool args_uniform = std::all_of(node.arguments.begin(), node.arguments.end(),
+        [&](const ASTNodePtr& arg) { return is_uniform(arg); });
+
+    uniform.insert({node.ast_id, is_pure && !reads_tensors && args_uniform});
+}
+
+void UniformityAnalysis::apply(ConstantNode& node)
+{
+    uniform.insert({node.ast_id, true});
+}
+
+void UniformityAnalysis::apply(ScalarNode& node)
+{
+    uniform.insert({node.ast_id, true});
+}
+
+void UniformityAnalysis::apply(TensorNode& node)
+{
+    uniform.insert({node.ast_id, false});
+}
+
+void UniformityAnalysis::apply(AddNode& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.lhs) && is_uniform(node.rhs)});
+}
+
+void UniformityAnalysis::apply(SubNode& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.lhs) && is_uniform(node.rhs)});
+}
+
+void UniformityAnalysis::apply(MulNode& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.lhs) && is_uniform(node.rhs)});
+}
+
+void UniformityAnalysis::apply(DivNode& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.lhs) && is_uniform(node.rhs)});
+}
+
+void UniformityAnalysis::apply(AbsNode& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.x)});
+}
+
+void UniformityAnalysis::apply(SqrtNode& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.x)});
+}
+
+void UniformityAnalysis::apply(Log2Node& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.x)});
+}
+
+void UniformityAnalysis::apply(Exp2Node& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.x)});
+}
+
+void UniformityAnalysis::apply(AssignmentNode& node)
+{
+    uniform.insert({node.ast_id, false});
+}
+
+void UniformityAnalysis::apply(AliasNode& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.src)});
+}
+
+void UniformityAnalysis::apply(ReturnNode& node)
+{
+    uniform.insert({node.ast_id, false});
+}
+
+void UniformityAnalysis::apply(TupleElementNode& node)
+{
+    uniform.insert({node.ast_id, is_uniform(node.tuple)});
+}
+
+void UniformityAnalysis::apply(LoopVarNode& node)
+{
+    uniform.insert({node.ast_id, false});  // changes in each iteration
+}
+
+void UniformityAnalysis::apply(RepeatNode& node)
+{
+    uniform.insert({node.ast_id, false});
+}
+
+
+RegisterNeedAnalysis::RegisterNeedAnalysis()
+{
+}
+
+int RegisterNeedAnalysis::get_need(const ASTNodePtr node)
+{
+    if (!needs.contains(node->ast_id))
+    {
+        node->accept(*this);
+    }
+    return needs.at(node->ast_id);
+}
+
+bool RegisterNeedAnalysis::can_reorder(const ASTNodePtr node)
+{
+    if (!reorderable.contains(node->ast_id))
+    {
+        node->accept(*this);
+    }
+    return reorderable.at(node->ast_id);
+}
+
+void RegisterNeedAnalysis::set_binary(const BinaryNode& node)
+{
+    int lhs_need = get_need(node.lhs);
+    int rhs_need = get_need(node.rhs);
+
+    // the first operand is kept while the second one is evaluated
+    int need = lhs_need == rhs_need ? lhs_need + 1 : std::max(lhs_need, rhs_need);
+    needs.insert({node.ast_id, std::max(need, 1)});
+    reorderable.insert({node.ast_id, can_reorder(node.lhs) && can_reorder(node.rhs)});
+}
+
+void RegisterNeedAnalysis::set_unary(const UnaryNode& node)
+{
+    needs.insert({node.ast_id, std::max(get_need(node.x), 1)});
+    reorderable.insert({node.ast_id, can_reorder(node.x)});
+}
+
+void RegisterNeedAnalysis::apply(KernelNode& node)
+{
+    needs.insert({node.ast_id, 0});
+    reorderable.insert({node.ast_id, true});
+}
+
+void RegisterNeedAnalysis::apply(KernelCallNode& node)
+{
+    // the arguments are evaluated in order, the earlier ones stay live until the call
+    int need = 1;
+    bool is_reorderable = !has_side_effects(*node.kernel);
+    for (int ix = 0; ix < node.arguments.size(); ++ix)
+    {
+        need = std::max(need, get_need(node.arguments[ix]) + ix);
+        is_reorderable = is_reorderable && can_reorder(node.arguments[ix]);
+    }
+    needs.insert({node.ast_id, need});
+    reorderable.insert({node.ast_id, is_reorderable});
+}
+
+void RegisterNeedAnalysis::apply(ConstantNode& node)
+{
+    needs.insert({node.ast_id, 0});
+    reorderable.insert({node.ast_id, true});
+}
+
+void RegisterNeedAnalysis::apply(ScalarNode& node)
+{
+    needs.insert({node.ast_id, 1});
+    reorderable.insert({node.ast_id, true});
+}
+
+void RegisterNeedAnalysis::apply(TensorNode& node)
+{
+    needs.insert({node.ast_id, 1});
+    reorderable.insert({node.ast_id, true});
+}
+
+void RegisterNeedAnalysis::apply(AddNode& node)
+{
+    set_binary(node);
+}
+
+void RegisterNeedAnalysis::apply(SubNode& node)
+{
+    set_binary(node);
+}
+
+void RegisterNeedAnalysis::apply(MulNode& node)
+{
+    set_binary(node);
+}
+
+void RegisterNeedAnalysis::apply(DivNode& node)
+{
+    set_binary(node);
+}
+
+void RegisterNeedAnalysis::apply(AbsNode& node)
+{
+    set_unary(node);
+}
+
+void RegisterNeedAnalysis::apply(SqrtNode& node)
+{
+    set_unary(node);
+}
+
+void RegisterNeedAnalysis::apply(Log2Node& node)
+{
+    set_unary(node);
+}
+
+void RegisterNeedAnalysis::apply(Exp2Node& node)
+{
+    set_unary(node);
+}
+
+void RegisterNeedAnalysis::apply(AssignmentNode& node)
+{
+    needs.insert({node.ast_id, get_need(node.src)});
+    reorderable.insert({node.ast_id, false});
+}
+
+void RegisterNeedAnalysis::apply(AliasNode& node)
+{
+    // computed at the definition
+    needs.insert({node.ast_id, 1});
+    reorderable.insert({node.ast_id, true});
+}
+
+void RegisterNeedAnalysis::apply(ReturnNode& node)
+{
+    int need = 0;
+    for (auto& ret : node.return_values)
+    {
+        need = std::max(need, get_need(ret));
+    }
+    needs.insert({node.ast_id, need + std::max(static_cast<int>(node.return_values.size()) - 1, 0)});
+    reorderable.insert({node.ast_id, false});
+}
+
+void RegisterNeedAnalysis::apply(TupleElementNode& node)
+{
+    needs.insert({node.ast_id, 1});
+    reorderable.insert({node.ast_id, true});
+}
+
+void RegisterNeedAnalysis::apply(LoopVarNode& node)
+{
+    needs.insert({node.ast_id, 1});
+    reorderable.insert({node.ast_id, true});
+}
+
+void RegisterNeedAnalysis::apply(RepeatNode& node)
+{
+    // the carried values are live during the whole block
+    int need = 0;
+    for (auto& body_ast : node.body)
+    {
+        need = std::max(need, get_need(body_ast));
+    }
+    needs.insert({node.ast_id, static_cast<int>(node.loop_vars.size()) + need});
+    reorderable.insert({node.ast_id, false});
+}
+
+
+ASTCloner::ASTCloner()
+{
+}
+
+ASTNodePtr ASTCloner::clone(const ASTNodePtr node)
+{
+    if (!node)
+        return nullptr;
+
+    if (replacements.contains(node->ast_id))
+        return replacements.at(node->ast_id);
+
+    if (clones.contains(node->ast_id))
+        return clones.at(node->ast_id);
+
+    visited_node = node;
+    node->accept(*this);
+
+    return clones.at(node->ast_id);
+}
+
+void ASTCloner::replace(const int ast_id, const ASTNodePtr node)
+{
+    replacements.insert_or_assign(ast_id, node);
+}
+
+void ASTCloner::forget_clones()
+{
+    clones.clear();
+}
+
+void ASTCloner::apply(KernelNode& node)
+{
+    clones.insert({node.ast_id, visited_node});
+}
+
+void ASTCloner::apply(KernelCallNode& node)
+{
+    std::vector<ASTNodePtr> arguments;
+    for (auto& arg_ast : node.arguments)
+    {
+        arguments.push_back(clone(arg_ast));
+    }
+
+    clones.insert_or_assign(node.ast_id, create_kernelcall_node(node.kernel, arguments));
+}
+
+void ASTCloner::apply(ConstantNode& node)
+{
+    clones.insert({node.ast_id, visited_node});
+}
+
+void ASTCloner::apply(ScalarNode& node)
+{
+    clones.insert({node.ast_id, visited_node});
+}
+
+void ASTCloner::apply(TensorNode& node)
+{
+    clones.insert({node.ast_id, visited_node});
+}
+
+void ASTCloner::apply(AddNode& node)
+{
+    auto lhs = clone(node.lhs);
+    auto rhs = clone(node.rhs);
+    clones.insert_or_assign(node.ast_id, create_add_node(lhs, rhs));
+}
+
+void ASTCloner::apply(SubNode& node)
+{
+    auto lhs = clone(node.lhs);
+    auto rhs = clone(node.rhs);
+    clones.insert_or_assign(node.ast_id, create_sub_node(lhs, rhs));
+}
+
+void ASTCloner::apply(MulNode& node)
+{
+    auto lhs = clone(node.lhs);
+    auto rhs = clone(node.rhs);
+    clones.insert_or_assign(node.ast_id, create_mul_node(lhs, rhs));
+}
+
+void ASTCloner::apply(DivNode& node)
+{
+    auto lhs = clone(node.lhs);
+    auto rhs = clone(node.rhs);
+    clones.insert_or_assign(node.ast_id, create_div_node(lhs, rhs));
+}
+
+void ASTCloner::apply(AbsNode& node)
+{
+    clones.insert_or_assign(node.ast_id, create_abs_node(clone(node.x)));
+}
+
+void ASTCloner::apply(SqrtNode& node)
+{
+    clones.insert_or_assign(node.ast_id, create_sqrt_node(clone(node.x)));
+}
+
+void ASTCloner::apply(Log2Node& node)
+{
+    clones.insert_or_assign(node.ast_id, create_log2_node(clone(node.x)));
+}
+
+void ASTCloner::apply(Exp2Node& node)
+{
+    clones.insert_or_assign(node.ast_id, create_exp2_node(clone(node.x)));
+}
+
+void ASTCloner::apply(AssignmentNode& node)
+{
+    auto trg = clone(node.trg);
+    auto src = clone(node.src);
+    clones.insert_or_assign(node.ast_id, create_assignment_node(trg, src));
+}
+
+void ASTCloner::apply(AliasNode& node)
+{
+    clones.insert_or_assign(node.ast_id, create_alias_node(node.name, clone(node.src)));
+}
+
+void ASTCloner::apply(ReturnNode& node)
+{
+    std::vector<ASTNodePtr> return_values;
+    for (auto& ret_ast : node.return_values)
+    {
+        return_values.push_back(clone(ret_ast));
+    }
+
+    clones.insert_or_assign(node.ast_id, create_return_node(return_values));
+}
+
+void ASTCloner::apply(TupleElementNode& node)
+{
+    clones.insert_or_assign(node.ast_id, create_tuple_element_node(clone(node.tuple), node.index));
+}
+
+void ASTCloner::apply(LoopVarNode& node)
+{
+    // next is set by the repeat node (it can refer back to the loop var)
+    clones.insert_or_assign(node.ast_id, create_loopvar_node(node.name, clone(node.init)));
+}
+
+void ASTCloner::apply(RepeatNode& node)
+{
+    std::vector<LoopVarNodePtr> loop_vars;
+    for (auto& loop_var : node.loop_vars)
+    {
+        loop_vars.push_back(std::static_pointer_cast<LoopVarNode>(clone(loop_var)));
+    }
+
+    auto repeat_node = create_repeat_node(node.trip_count, loop_vars);
+    for (auto& body_ast : node.body)
+    {
+        repeat_node->body.push_back(clone(body_ast));
+    }
+
+    for (int ix = 0; ix < loop_vars.size(); ++ix)
+    {
+        loop_vars[ix]->next = clone(node.loop_vars[ix]->next);
+    }
+
+    clones.insert_or_assign(node.ast_id, repeat_node);
+}
+
+
+KernelInliner::KernelInliner() : ASTCloner()
+{
+}
+
+void KernelInliner::inline_kernel(const KernelNode& kernel)
+{
+    inline_statements(kernel.body);
+}
+
+const std::vector<std::pair<TensorNodePtr, ASTNodePtr>>& KernelInliner::get_outputs() const
+{
+    return outputs;
+}
+
+const std::vector<ASTNodePtr>& KernelInliner::get_return_values() const
+{
+    return return_values;
+}
+
+void KernelInliner::apply(KernelCallNode& node)
+{
+    auto& kernel = *node.kernel;
+
+    KernelInliner callee_inliner;
+    for (int ix = 0; ix < node.arguments.size() && ix < kernel.arguments.size(); ++ix)
+    {
+        auto& param = kernel.arguments[ix];
+        callee_inliner.replace(param->ast_id, clone(node.arguments[ix]));
+
+        if (param->vtype == VariableType::TENSOR)
+        {
+            callee_inliner.tensor_args.insert({param->ast_id, resolve_tensor(node.arguments[ix])});
+        }
+    }
+
+    callee_inliner.inline_kernel(kernel);
+
+    // the assignments of the callee are visible for the caller
+    for (auto& [tensor, value] : callee_inliner.outputs)
+    {
+        set_output(tensor, value);
+    }
+
+    auto& results = callee_inliner.return_values;
+    call_results.insert_or_assign(node.ast_id, results);
+    clones.insert_or_assign(node.ast_id, results.size() == 1 ? results[0] : nullptr);
+}
+
+void KernelInliner::apply(TupleElementNode& node)
+{
+    clone(node.tuple);  // inlines the call
+    clones.insert_or_assign(node.ast_id, call_results.at(node.tuple->ast_id).at(node.index));
+}
+
+void KernelInliner::inline_statements(const std::vector<ASTNodePtr>& statements)
+{
+    for (auto& statement : statements)
+    {
+        if (auto alias_node = std::dynamic_pointer_cast<AliasNode>(statement))
+        {
+            // aliases are evaluated where they are defined
+            replace(alias_node->ast_id, clone(alias_node->src));
+        }
+        else if (auto assign_node = std::dynamic_pointer_cast<AssignmentNode>(statement))
+        {
+            auto value = clone(assign_node->src);
+            auto tensor = resolve_tensor(assign_node->trg);
+            if (!tensor)
+            {
+                emit_error("Only tensors can be assigned in inlined kernels.");
+            }
+
+            replace(assign_node->trg->ast_id, value);
+            set_output(tensor, value);
+        }
+        else if (auto ret_node = std::dynamic_pointer_cast<ReturnNode>(statement))
+        {
+            return_values.clear();
+            for (auto& ret_ast : ret_node->return_values)
+            {
+                return_values.push_back(clone(ret_ast));
+            }
+        }
+        else if (auto repeat_node = std::dynamic_pointer_cast<RepeatNode>(statement))
+        {
+            inline_repeat(*repeat_node);
+        }
+        else
+        {
+            clone(statement);  // e.g. call of a void kernel
+        }
+    }
+}
+
+void KernelInliner::inline_repeat(const RepeatNode& node)
+{
+    std::vector<ASTNodePtr> loop_values;
+    for (auto& loop_var : node.loop_vars)
+    {
+        loop_values.push_back(clone(loop_var->init));
+    }
+
+    for (int iter = 0; iter < node.trip_count; ++iter)
+    {
+        for (int ix = 0; ix < node.loop_vars.size(); ++ix)
+        {
+            replace(node.loop_vars[ix]->ast_id, loop_values[ix]);
+        }
+
+        // the body is copied again in each iteration
+        forget_clones();
+        inline_statements(node.body);
+
+        for (int ix = 0; ix < node.loop_vars.size(); ++ix)
+        {
+            if (node.loop_vars[ix]->next)
+            {
+                loop_values[ix] = clone(node.loop_vars[ix]->next);
+            }
+        }
+    }
+
+    // uses after the block refer to the final values
+    for (int ix = 0; ix < node.loop_vars.size(); ++ix)
+    {
+        replace(node.loop_vars[ix]->ast_id, loop_values[ix]);
+    }
+    forget_clones();
+}
+
+void KernelInliner::set_output(const TensorNodePtr tensor, const ASTNodePtr value)
+{
+    replace(tensor->ast_id, value);
+
+    for (auto& output : outputs)
+    {
+        if (output.first == tensor)
+        {
+            output.second = value;
+            return;
+        }
+    }
+
+    outputs.push_back({tensor, value});
+}
+
+TensorNodePtr KernelInliner::resolve_tensor(const ASTNodePtr node) const
+{
+    if (tensor_args.contains(node->ast_id))
+        return tensor_args.at(node->ast_id);
+
+    return std::dynamic_pointer_cast<TensorNode>(node);
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include "ast.hpp"
+#include "core.hpp"
+
+/**
+ * Gives the nodes used as operands by the node
+ * (e.g. lhs and rhs of a binary node). Kernels,
+ * variables and constants have no operands.
+ */
+std::vector<ASTNodePtr> get_operands(const ASTNodePtr& node);
+
+/**
+ * Calls the function once on each node reachable from the roots
+ * through the operands (repeat bodies and loop-carried values included).
+ */
+void for_each_reachable_node(
+    const std::vector<ASTNodePtr>& roots,
+    const std::function<void(const ASTNodePtr&)>& func);
+
+
+/**
+ * True if the kernel assigns tensors (directly or in a called kernel).
+ * The body is walked once, the result is kept in the kernel node.
+ */
+bool has_side_effects(const KernelNode& kernel);
+
+
+/**
+ * Classifies the values of a kernel. Uniform values depend only on
+ * scalar arguments and constants, so they are the same for each element
+ * (in a global kernel). Per-element values depend on tensors or loop variables.
+ */
+class UniformityAnalysis : public ASTVisitor
+{
+public:
+    explicit UniformityAnalysis();
+
+    bool is_uniform(const ASTNodePtr node);
+
+    /**
+     * The largest uniform subexpressions used by per-element values or by statements,
+     * in the order of the first use. Constants and scalars are not listed.
+     */
+    std::vector<ASTNodePtr> find_hoistable_nodes(const KernelNode& kernel);
+
+    virtual void apply(KernelNode& node);
+    virtual void apply(KernelCallNode& node);
+
+    virtual void apply(ConstantNode& node);
+    virtual void apply(ScalarNode& node);
+    virtual void apply(TensorNode& node);
+
+    virtual void apply(AddNode& node);
+    virtual void apply(SubNode& node);
+    virtual void apply(MulNode& node);
+    virtual void apply(DivNode& node);
+
+    virtual void apply(AbsNode& node);
+    virtual void apply(SqrtNode& node);
+    virtual void apply(Log2Node& node);
+    virtual void apply(Exp2Node& node);
+
+    virtual void apply(AssignmentNode& node);
+    virtual void apply(AliasNode& node);
+    virtual void apply(ReturnNode& node);
+    virtual void apply(TupleElementNode& node);
+
+    virtual void apply(LoopVarNode& node);
+    virtual void apply(RepeatNode& node);
+
+private:
+    std::unordered_map<int, bool> uniform;
+};
+
+
+/**
+ * Sethi-Ullman numbers: the registers needed to evaluate an expression
+ * without keeping more temporaries than necessary. Constants are immediates (0),
+ * variables and already computed values (aliases, loop variables) need one.
+ */
+class RegisterNeedAnalysis : public ASTVisitor
+{
+public:
+    explicit RegisterNeedAnalysis();
+
+    int get_need(const ASTNodePtr node);
+
+    /**
+     * False if the expression calls a kernel with side effects
+     * (then its operands are evaluated in the written order).
+     */
+    bool can_reorder(const ASTNodePtr node);
+
+    virtual void apply(KernelNode& node);
+    virtual void apply(KernelCallNode& node);
+
+    virtual void apply(ConstantNode& node);
+    virtual void apply(ScalarNode& node);
+    virtual void apply(TensorNode& node);
+
+    virtual void apply(AddNode& node);
+    virtual void apply(SubNode& node);
+    virtual void apply(MulNode& node);
+    virtual void apply(DivNode& node);
+
+    virtual void apply(AbsNode& node);
+    virtual void apply(SqrtNode& node);
+    virtual void apply(Log2Node& node);
+    virtual void apply(Exp2Node& node);
+
+    virtual void apply(AssignmentNode& node);
+    virtual void apply(AliasNode& node);
+    virtual void apply(ReturnNode& node);
+    virtual void apply(TupleElementNode& node);
+
+    virtual void apply(LoopVarNode& node);
+    virtual void apply(RepeatNode& node);
+
+private:
+    std::unordered_map<int, int> needs;
+    std::unordered_map<int, bool> reorderable;
+
+    void set_binary(const BinaryNode& node);
+    void set_unary(const UnaryNode& node);
+};
+
+
+/**
+ * Copies the AST nodes. Replaced nodes are not copied,
+ * their uses will refer to the replacement instead.
+ * Variables, constants and kernels are shared (not copied).
+ */
+class ASTCloner : public ASTVisitor
+{
+public:
+    explicit ASTCloner();
+
+    ASTNodePtr clone(const ASTNodePtr node);
+
+    /**
+     * The uses of the node with the given id will refer to the new node.
+     */
+    void replace(const int ast_id, const ASTNodePtr node);
+
+    /**
+     * Drops the already built copies, the replacements are kept.
+     * Required when the same nodes have to be copied again (e.g. next iteration).
+     */
+    void forget_clones();
+
+    virtual void apply(KernelNode& node);
+    virtual void apply(KernelCallNode& node);
+
+    virtual void apply(ConstantNode& node);
+    virtual void apply(ScalarNode& node);
+    virtual void apply(TensorNode& node);
+
+    virtual void apply(AddNode& node);
+    virtual void apply(SubNode& node);
+    virtual void apply(MulNode& node);
+    virtual void apply(DivNode& node);
+
+    virtual void apply(AbsNode& node);
+    virtual void apply(SqrtNode& node);
+    virtual void apply(Log2Node& node);
+    virtual void apply(Exp2Node& node);
+
+    virtual void apply(AssignmentNode& node);
+    virtual void apply(AliasNode& node);
+    virtual void apply(ReturnNode& node);
+    virtual void apply(TupleElementNode& node);
+
+    virtual void apply(LoopVarNode& node);
+    virtual void apply(RepeatNode& node);
+
+protected:
+    std::unordered_map<int, ASTNodePtr> replacements;
+    std::unordered_map<int, ASTNodePtr> clones;  // original ast_id -> copy
+
+    ASTNodePtr visited_node;  // the node being copied, shared nodes are returned as is
+};
+
+
+/**
+ * Builds straight-line expressions from a kernel body.
+ * Device kernel calls are inlined, repeat blocks are unrolled and
+ * aliases are resolved. A tensor read after an assignment refers
+ * to the assigned expression.
+ */
+class KernelInliner : public ASTCloner
+{
+public:
+    explicit KernelInliner();
+
+    /**
+     * Processes the statements of the kernel body in order.
+     */
+    void inline_kernel(const KernelNode& kernel);
+
+    /**
+     * The assigned tensors with their final values, in the order of the first assignment.
+     */
+    const std::vector<std::pair<TensorNodePtr, ASTNodePtr>>& get_outputs() const;
+
+    /**
+     * The returned expressions (empty for void kernels).
+     */
+    const std::vector<ASTNodePtr>& get_return_values() const;
+
+    virtual void apply(KernelCallNode& node) override;
+    virtual void apply(TupleElementNode& node) override;
+
+private:
+    std::unordered_map<int, TensorNodePtr> tensor_args;  // tensor arguments of an inlined kernel -> caller tensors
+    std::unordered_map<int, std::vector<ASTNodePtr>> call_results;
+    std::vector<std::pair<TensorNodePtr, ASTNodePtr>> outputs;
+    std::vector<ASTNodePtr> return_values;
+
+    void inline_statements(const std::vector<ASTNodePtr>& statements);
+    void inline_repeat(const RepeatNode& node);
+    void set_output(const TensorNodePtr tensor, const ASTNodePtr value);
+    TensorNodePtr resolve_tensor(const ASTNodePtr node) const;
+};